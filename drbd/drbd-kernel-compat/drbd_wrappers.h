@@ -209,6 +209,11 @@ static inline void shash_desc_zero(struct shash_desc *desc)
 #endif
 #endif
 
+/* introduced in a9a8ba90fa58 (v4.20-rc1) */
+#ifndef HASH_MAX_DIGESTSIZE
+#define HASH_MAX_DIGESTSIZE 64
+#endif
+
 /* RDMA related */
 #ifndef COMPAT_HAVE_IB_CQ_INIT_ATTR
 #include <rdma/ib_verbs.h>
@@ -247,6 +252,15 @@ extern struct proc_dir_entry *proc_create_single(const char *name, umode_t mode,
 #define MAX_SGE(ATTR) (ATTR).max_sge
 #endif
 
+#ifndef COMPAT_HAVE_TCP_SND_CWND
+#include <linux/tcp.h>
+/* introduced in 40570375356c (v5.18) */
+static inline u32 tcp_snd_cwnd(const struct tcp_sock *tp)
+{
+	return tp->snd_cwnd;
+}
+#endif
+
 #ifndef SECTOR_SHIFT
 #define SECTOR_SHIFT 9
 #endif
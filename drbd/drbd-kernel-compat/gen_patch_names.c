@@ -296,6 +296,12 @@ int main(int argc, char **argv)
 	patch(1, "__vmalloc", true, false,
 	      COMPAT___VMALLOC_HAS_2_PARAMS, "has_2_params");
 
+	patch(1, "iov_iter_type", true, false,
+	      COMPAT_HAVE_IOV_ITER_TYPE, "present");
+
+	patch(1, "tcp_sock_rate_delivered", true, false,
+	      COMPAT_HAVE_TCP_SOCK_RATE_DELIVERED, "present");
+
 /* #define BLKDEV_ISSUE_ZEROOUT_EXPORTED */
 /* #define BLKDEV_ZERO_NOUNMAP */
 
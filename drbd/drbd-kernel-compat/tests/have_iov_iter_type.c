@@ -0,0 +1,8 @@
+#include <linux/uio.h>
+
+/* Since v4.20 the iterator type is no longer or-ed into the direction
+ * passed to iov_iter_bvec() and friends; iov_iter_type() came with that. */
+int foo(struct iov_iter *i)
+{
+	return iov_iter_type(i);
+}
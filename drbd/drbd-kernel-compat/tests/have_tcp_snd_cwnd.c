@@ -0,0 +1,7 @@
+#include <linux/tcp.h>
+
+/* Since v5.18 snd_cwnd is read through an accessor. */
+u32 foo(const struct tcp_sock *tp)
+{
+	return tcp_snd_cwnd(tp);
+}
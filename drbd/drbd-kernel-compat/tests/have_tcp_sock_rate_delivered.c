@@ -0,0 +1,7 @@
+#include <linux/tcp.h>
+
+/* Delivery rate sampling came with v4.9. */
+u64 foo(const struct tcp_sock *tp)
+{
+	return (u64)tp->rate_delivered + tp->rate_interval_us;
+}
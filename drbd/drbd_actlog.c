@@ -12,6 +12,7 @@
  */
 
 #include <linux/slab.h>
+#include <linux/hash.h>
 #include <linux/crc32c.h>
 #include <linux/drbd.h>
 #include <linux/drbd_limits.h>
@@ -75,9 +76,226 @@ void wait_until_done_or_force_detached(struct drbd_device *device, struct drbd_b
 	}
 }
 
+/*
+ * Group commit of activity log transactions.
+ *
+ * Each volume writes its activity log transactions synchronously, with FUA
+ * and a preflush.  With several volumes of a resource sharing one meta data
+ * device, a burst to cold extents on all of them would pay for one flush per
+ * volume.  Instead, the first volume to arrive becomes the leader for its
+ * meta data device, and submits up to AL_GROUP_MAX queued transactions of
+ * the resource for that device as one batch: plain writes, followed by a
+ * single flush once all of them completed.  Only then the transactions
+ * count as written.  The batch leads until it completed, so everything
+ * arriving in the meantime gathers up to form the next one.  Volumes with
+ * their meta data elsewhere do not wait for it; they have batches of their
+ * own.
+ */
+#define AL_GROUP_MAX 16
+
+struct al_group_entry {
+	struct list_head list;
+	struct drbd_device *device;
+	struct block_device *md_bdev;
+	struct bio *bio;
+	bool submitted;
+};
+
+struct al_group_batch {
+	struct list_head leading;	/* on al_group_leaders until completed */
+	struct drbd_resource *resource;
+	struct block_device *md_bdev;
+	struct work_struct work;
+	atomic_t pending;
+	bool flush;
+	unsigned int n;
+	struct {
+		struct drbd_device *device;
+		struct bio *bio;
+	} e[AL_GROUP_MAX];
+};
+
+static void md_submit_bio(struct drbd_device *device, struct bio *bio, int op)
+{
+	device->md_io.submit_jif = jiffies;
+	if (drbd_insert_fault(device, (op == REQ_OP_WRITE) ? DRBD_FAULT_MD_WR : DRBD_FAULT_MD_RD)) {
+		bio->bi_status = BLK_STS_IOERR;
+		bio_endio(bio);
+	} else {
+		submit_bio(bio);
+	}
+}
+
+static void al_group_flush_endio(struct bio *bio)
+{
+	complete((struct completion *)bio->bi_private);
+}
+
+/* All writes of the batch completed.  Flush once for all of them, then
+ * complete each one as drbd_md_endio() would have done. */
+static void al_group_work(struct work_struct *work)
+{
+	struct al_group_batch *batch = container_of(work, struct al_group_batch, work);
+	struct drbd_resource *resource = batch->resource;
+	blk_status_t status = BLK_STS_OK;
+	unsigned int i;
+
+	if (batch->flush) {
+		DECLARE_COMPLETION_ONSTACK(done);
+		struct bio *bio = bio_alloc(GFP_NOIO, 0);
+
+		bio_set_dev(bio, batch->md_bdev);
+		bio->bi_opf = REQ_OP_WRITE | REQ_PREFLUSH | REQ_META | REQ_SYNC;
+		bio->bi_private = &done;
+		bio->bi_end_io = al_group_flush_endio;
+		submit_bio(bio);
+		wait_for_completion_io(&done);
+		status = bio->bi_status;
+		bio_put(bio);
+	}
+
+	spin_lock(&resource->al_group_lock);
+	list_del(&batch->leading);
+	spin_unlock(&resource->al_group_lock);
+	wake_up_all(&resource->al_group_wait);
+
+	for (i = 0; i < batch->n; i++) {
+		struct bio *bio = batch->e[i].bio;
+
+		if (!bio->bi_status)
+			bio->bi_status = status;
+		bio->bi_private = batch->e[i].device;
+		drbd_md_endio(bio);
+	}
+	kfree(batch);
+}
+
+static void al_group_endio(struct bio *bio)
+{
+	struct al_group_batch *batch = bio->bi_private;
+
+	if (atomic_dec_and_test(&batch->pending))
+		queue_work(system_unbound_wq, &batch->work);
+}
+
+static void al_group_submit_batch(struct al_group_batch *batch)
+{
+	struct blk_plug plug;
+	unsigned int i, n = batch->n;
+
+	for (i = 0; i < n; i++) {
+		struct bio *bio = batch->e[i].bio;
+
+		batch->e[i].device->al_group_histogram[min_t(unsigned int, n, DRBD_AL_GROUP_HIST - 1)]++;
+		if (n > 1) {
+			/* made durable by the flush in al_group_work() */
+			batch->flush |= !!(bio->bi_opf & (REQ_FUA | REQ_PREFLUSH));
+			bio->bi_opf &= ~(REQ_FUA | REQ_PREFLUSH);
+		}
+		bio->bi_private = batch;
+		bio->bi_end_io = al_group_endio;
+	}
+	atomic_set(&batch->pending, n);
+
+	/* The batch may be gone once the last write is submitted */
+	blk_start_plug(&plug);
+	for (i = 0; i < n; i++)
+		md_submit_bio(batch->e[i].device, batch->e[i].bio, REQ_OP_WRITE);
+	blk_finish_plug(&plug);
+}
+
+/* Called with al_group_lock held */
+static bool al_group_have_leader(struct drbd_resource *resource, struct block_device *md_bdev)
+{
+	struct al_group_batch *batch;
+
+	list_for_each_entry(batch, &resource->al_group_leaders, leading) {
+		if (batch->md_bdev == md_bdev)
+			return true;
+	}
+	return false;
+}
+
+static bool al_group_may_lead(struct drbd_resource *resource, struct al_group_entry *me)
+{
+	bool may_lead;
+
+	spin_lock(&resource->al_group_lock);
+	may_lead = me->submitted || !al_group_have_leader(resource, me->md_bdev);
+	spin_unlock(&resource->al_group_lock);
+	return may_lead;
+}
+
+/* Called with al_group_lock held */
+static void al_group_take(struct al_group_batch *batch, struct al_group_entry *e)
+{
+	batch->e[batch->n].device = e->device;
+	batch->e[batch->n].bio = e->bio;
+	batch->n++;
+	list_del(&e->list);
+	e->submitted = true;
+}
+
+/* Submits our transaction, either leading a batch or as part of the batch
+ * of someone else.  Completion is signalled in device->md_io, as usual. */
+static void al_group_submit(struct drbd_device *device, struct al_group_entry *me)
+{
+	struct drbd_resource *resource = device->resource;
+	struct al_group_batch *batch = NULL;
+	struct al_group_entry *e, *tmp;
+
+	spin_lock(&resource->al_group_lock);
+	list_add_tail(&me->list, &resource->al_group_list);
+	for (;;) {
+		if (me->submitted) {
+			spin_unlock(&resource->al_group_lock);
+			kfree(batch);
+			return;
+		}
+		if (!al_group_have_leader(resource, me->md_bdev)) {
+			if (batch)
+				break;
+			spin_unlock(&resource->al_group_lock);
+			batch = kzalloc(sizeof(*batch), GFP_NOIO);
+			spin_lock(&resource->al_group_lock);
+			if (!batch) {
+				/* on our own, if nobody took us meanwhile */
+				if (me->submitted) {
+					spin_unlock(&resource->al_group_lock);
+					return;
+				}
+				list_del(&me->list);
+				spin_unlock(&resource->al_group_lock);
+				md_submit_bio(device, me->bio, REQ_OP_WRITE);
+				return;
+			}
+			continue;
+		}
+		spin_unlock(&resource->al_group_lock);
+		wait_event(resource->al_group_wait, al_group_may_lead(resource, me));
+		spin_lock(&resource->al_group_lock);
+	}
+
+	batch->resource = resource;
+	batch->md_bdev = me->md_bdev;
+	INIT_WORK(&batch->work, al_group_work);
+	list_add(&batch->leading, &resource->al_group_leaders);
+	al_group_take(batch, me);
+	list_for_each_entry_safe(e, tmp, &resource->al_group_list, list) {
+		if (batch->n == AL_GROUP_MAX)
+			break;
+		if (e->md_bdev == me->md_bdev)
+			al_group_take(batch, e);
+	}
+	spin_unlock(&resource->al_group_lock);
+	wake_up_all(&resource->al_group_wait);
+
+	al_group_submit_batch(batch);
+}
+
 static int _drbd_md_sync_page_io(struct drbd_device *device,
 				 struct drbd_backing_dev *bdev,
-				 sector_t sector, int op)
+				 sector_t sector, int op, bool group)
 {
 	struct bio *bio;
 	/* we do all our meta data IO in aligned 4k blocks. */
@@ -91,7 +309,7 @@ static int _drbd_md_sync_page_io(struct drbd_device *device,
 	device->md_io.done = 0;
 	device->md_io.error = -ENODEV;
 
-	bio = bio_alloc_drbd(GFP_NOIO);
+	bio = bio_alloc_drbd(GFP_NOIO, 1);
 	bio_set_dev(bio, bdev->md_bdev);
 	bio->bi_iter.bi_sector = sector;
 	err = -EIO;
@@ -114,12 +332,16 @@ static int _drbd_md_sync_page_io(struct drbd_device *device,
 
 	bio_get(bio); /* one bio_put() is in the completion handler */
 	atomic_inc(&device->md_io.in_use); /* drbd_md_put_buffer() is in the completion handler */
-	device->md_io.submit_jif = jiffies;
-	if (drbd_insert_fault(device, (op == REQ_OP_WRITE) ? DRBD_FAULT_MD_WR : DRBD_FAULT_MD_RD)) {
-		bio->bi_status = BLK_STS_IOERR;
-		bio_endio(bio);
+	if (group && op == REQ_OP_WRITE) {
+		struct al_group_entry me = {
+			.device = device,
+			.md_bdev = bdev->md_bdev,
+			.bio = bio,
+		};
+
+		al_group_submit(device, &me);
 	} else {
-		submit_bio(bio);
+		md_submit_bio(device, bio, op);
 	}
 	wait_until_done_or_force_detached(device, bdev, &device->md_io.done);
 	err = device->md_io.error;
@@ -128,8 +350,8 @@ static int _drbd_md_sync_page_io(struct drbd_device *device,
 	return err;
 }
 
-int drbd_md_sync_page_io(struct drbd_device *device, struct drbd_backing_dev *bdev,
-			 sector_t sector, int op)
+static int __drbd_md_sync_page_io(struct drbd_device *device, struct drbd_backing_dev *bdev,
+				  sector_t sector, int op, bool group)
 {
 	int err;
 	D_ASSERT(device, atomic_read(&device->md_io.in_use) == 1);
@@ -152,7 +374,7 @@ int drbd_md_sync_page_io(struct drbd_device *device, struct drbd_backing_dev *bd
 		     (unsigned long long)sector,
 		     (op == REQ_OP_WRITE) ? "WRITE" : "READ");
 
-	err = _drbd_md_sync_page_io(device, bdev, sector, op);
+	err = _drbd_md_sync_page_io(device, bdev, sector, op, group);
 	if (err) {
 		drbd_err(device, "drbd_md_sync_page_io(,%llus,%s) failed with error %d\n",
 		    (unsigned long long)sector,
@@ -161,11 +383,18 @@ int drbd_md_sync_page_io(struct drbd_device *device, struct drbd_backing_dev *bd
 	return err;
 }
 
+int drbd_md_sync_page_io(struct drbd_device *device, struct drbd_backing_dev *bdev,
+			 sector_t sector, int op)
+{
+	return __drbd_md_sync_page_io(device, bdev, sector, op, false);
+}
+
 struct get_activity_log_ref_ctx {
 	/* in: which extent on which device? */
 	struct drbd_device *device;
 	unsigned int enr;
 	bool nonblock;
+	bool pin; /* also pin a committed extent for the fast path */
 
 	/* out: do we need to wake_up(&device->al_wait)? */
 	bool wake_up;
@@ -179,7 +408,7 @@ find_active_resync_extent(struct get_activity_log_ref_ctx *al_ctx)
 
 	rcu_read_lock();
 	for_each_peer_device_rcu(peer_device, al_ctx->device) {
-		tmp = lc_find(peer_device->resync_lru, al_ctx->enr/AL_EXT_PER_BM_SECT);
+		tmp = lc_find(peer_device->resync_lru, al_ctx->enr/al_ext_per_bm_sect(al_ctx->device));
 		if (unlikely(tmp != NULL)) {
 			struct bm_extent  *bm_ext = lc_entry(tmp, struct bm_extent, lce);
 			if (test_bit(BME_NO_WRITES, &bm_ext->flags)) {
@@ -209,7 +438,7 @@ set_bme_priority(struct get_activity_log_ref_ctx *al_ctx)
 
 	rcu_read_lock();
 	for_each_peer_device_rcu(peer_device, al_ctx->device) {
-		tmp = lc_find(peer_device->resync_lru, al_ctx->enr/AL_EXT_PER_BM_SECT);
+		tmp = lc_find(peer_device->resync_lru, al_ctx->enr/al_ext_per_bm_sect(al_ctx->device));
 		if (tmp) {
 			struct bm_extent  *bm_ext = lc_entry(tmp, struct bm_extent, lce);
 			if (test_bit(BME_NO_WRITES, &bm_ext->flags)
@@ -220,6 +449,191 @@ set_bme_priority(struct get_activity_log_ref_ctx *al_ctx)
 	rcu_read_unlock();
 }
 
+/*
+ * Lock-free activity log fast path.
+ *
+ * A pin holds one lc reference on a committed activity log extent on behalf
+ * of all writes to that extent coming through drbd_al_begin_io_fastpath().
+ * Those only modify the atomic refs of the pin, and never take al_lock.
+ *
+ * Pins are installed by the slow path, and killed when the extent is needed
+ * otherwise: by resync, when the activity log runs out of unused elements, or
+ * when it gets shrunk.  Both happen under al_lock.  A killed pin is marked
+ * AL_PIN_DEAD, which lets new fast path references fail.  Whoever drops the
+ * last reference of a dead pin gives its lc reference back.
+ */
+static struct drbd_al_pin *al_pin_slot(struct drbd_device *device, unsigned int enr)
+{
+	return &device->al_pins[hash_32(enr, ilog2(DRBD_AL_PINS))];
+}
+
+/* Called with al_lock held. Returns true if the extent became unused. */
+static bool __al_pin_release(struct drbd_device *device, struct drbd_al_pin *pin)
+{
+	struct lc_element *e = pin->e;
+
+	pin->e = NULL;
+	return lc_put(device->act_log, e) == 0;
+}
+
+static bool al_pin_release(struct drbd_device *device, struct drbd_al_pin *pin)
+{
+	unsigned long flags;
+	bool wake;
+
+	spin_lock_irqsave(&device->al_lock, flags);
+	wake = __al_pin_release(device, pin);
+	spin_unlock_irqrestore(&device->al_lock, flags);
+	if (wake)
+		wake_up(&device->al_wait);
+	return wake;
+}
+
+/* Called with al_lock held. Returns true if the extent became unused. */
+static bool al_pin_kill(struct drbd_device *device, struct drbd_al_pin *pin, bool only_idle)
+{
+	int refs, old;
+
+	refs = atomic_read(&pin->refs);
+	for (;;) {
+		if (refs & AL_PIN_DEAD)
+			return false;
+		if (refs && only_idle)
+			return false;
+		old = atomic_cmpxchg(&pin->refs, refs, refs | AL_PIN_DEAD);
+		if (old == refs)
+			break;
+		refs = old;
+	}
+	if (refs)
+		return false; /* the last al_pin_put() releases it */
+
+	atomic_dec(&device->al_pins_idle);
+	return __al_pin_release(device, pin);
+}
+
+/* Called with al_lock held, after a successful lc_try_get() of a committed extent */
+static void al_pin_install(struct get_activity_log_ref_ctx *al_ctx, struct lc_element *al_ext)
+{
+	struct drbd_device *device = al_ctx->device;
+	struct drbd_al_pin *pin = al_pin_slot(device, al_ext->lc_number);
+
+	if (al_ext->lc_number != al_ctx->enr)
+		return;
+	/* lc_try_get() ignores the lock; drbd_al_shrink() waits for all
+	 * references to go away, so do not add one it would not know of */
+	if (test_bit(__LC_LOCKED, &device->act_log->flags))
+		return;
+
+	/* Hash collision: replace an idle pin, but leave busy ones alone */
+	if (pin->e) {
+		al_ctx->wake_up |= al_pin_kill(device, pin, true);
+		if (pin->e)
+			return;
+	}
+
+	/* the reference for the pin itself */
+	if (!lc_try_get(device->act_log, al_ext->lc_number))
+		return;
+	pin->e = al_ext;
+	WRITE_ONCE(pin->enr, al_ext->lc_number);
+	atomic_inc(&device->al_pins_idle);
+	smp_wmb(); /* publish enr before the pin becomes live */
+	atomic_set(&pin->refs, 0);
+}
+
+static bool al_pin_put(struct drbd_device *device, struct drbd_al_pin *pin)
+{
+	int refs = atomic_dec_return(&pin->refs);
+
+	if (refs == AL_PIN_DEAD)
+		return al_pin_release(device, pin);
+	if (refs == 0) {
+		atomic_inc(&device->al_pins_idle);
+		/* Someone waiting for an unused element may kill it now */
+		if (wq_has_sleeper(&device->al_wait))
+			wake_up(&device->al_wait);
+		return true;
+	}
+	return false;
+}
+
+static bool al_pin_get(struct drbd_device *device, unsigned int enr)
+{
+	struct drbd_al_pin *pin = al_pin_slot(device, enr);
+	int refs, old;
+
+	if (READ_ONCE(pin->enr) != enr)
+		return false;
+	/* Do not keep cold extents starving, same as lc_try_get() */
+	if (test_bit(__LC_STARVING, &device->act_log->flags))
+		return false;
+
+	refs = atomic_read(&pin->refs);
+	for (;;) {
+		if (refs & AL_PIN_DEAD)
+			return false;
+		old = atomic_cmpxchg(&pin->refs, refs, refs + 1);
+		if (old == refs)
+			break;
+		refs = old;
+	}
+	if (refs == 0)
+		atomic_dec(&device->al_pins_idle);
+
+	/* The slot may have been recycled for an other extent meanwhile. */
+	if (READ_ONCE(pin->enr) != enr) {
+		al_pin_put(device, pin);
+		return false;
+	}
+	return true;
+}
+
+/* Called with al_lock held. Returns true if an extent became unused. */
+static bool al_unpin_idle(struct drbd_device *device)
+{
+	bool wake = false;
+	int i;
+
+	if (!atomic_read(&device->al_pins_idle))
+		return false;
+	for (i = 0; i < DRBD_AL_PINS; i++)
+		wake |= al_pin_kill(device, &device->al_pins[i], true);
+	return wake;
+}
+
+/* Called with al_lock held. Returns true if the extent became unused. */
+static bool al_unpin_extent(struct drbd_device *device, unsigned int enr)
+{
+	struct drbd_al_pin *pin = al_pin_slot(device, enr);
+
+	if (!pin->e || pin->enr != enr)
+		return false;
+	return al_pin_kill(device, pin, false);
+}
+
+/* Gives up all pins; busy ones are released with their last reference. */
+void drbd_al_unpin_all(struct drbd_device *device)
+{
+	bool wake = false;
+	int i;
+
+	spin_lock_irq(&device->al_lock);
+	for (i = 0; i < DRBD_AL_PINS; i++)
+		wake |= al_pin_kill(device, &device->al_pins[i], false);
+	spin_unlock_irq(&device->al_lock);
+	if (wake)
+		wake_up(&device->al_wait);
+}
+
+/* Number of activity log extents in use, not counting idle pins */
+unsigned int drbd_al_used(struct drbd_device *device)
+{
+	int used = device->act_log->used - atomic_read(&device->al_pins_idle);
+
+	return max(used, 0);
+}
+
 static
 struct lc_element *__al_get(struct get_activity_log_ref_ctx *al_ctx)
 {
@@ -233,10 +647,15 @@ struct lc_element *__al_get(struct get_activity_log_ref_ctx *al_ctx)
 		set_bme_priority(al_ctx);
 		goto out;
 	}
-	if (al_ctx->nonblock)
+	if (al_ctx->nonblock) {
 		al_ext = lc_try_get(device->act_log, al_ctx->enr);
-	else
+		if (al_ext && al_ctx->pin)
+			al_pin_install(al_ctx, al_ext);
+	} else {
 		al_ext = lc_get(device->act_log, al_ctx->enr);
+		if (!al_ext && al_unpin_idle(device))
+			al_ext = lc_get(device->act_log, al_ctx->enr);
+	}
  out:
 	spin_unlock_irq(&device->al_lock);
 	if (al_ctx->wake_up)
@@ -245,10 +664,10 @@ struct lc_element *__al_get(struct get_activity_log_ref_ctx *al_ctx)
 }
 
 static
-struct lc_element *_al_get_nonblock(struct drbd_device *device, unsigned int enr)
+struct lc_element *_al_get_nonblock(struct drbd_device *device, unsigned int enr, bool pin)
 {
 	struct get_activity_log_ref_ctx al_ctx =
-		{ .device = device, .enr = enr, .nonblock = true };
+		{ .device = device, .enr = enr, .nonblock = true, .pin = pin };
 	return __al_get(&al_ctx);
 }
 
@@ -307,8 +726,8 @@ bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval
 {
 	/* for bios crossing activity log extent boundaries,
 	 * we may need to activate two extents in one go */
-	unsigned first = i->sector >> (AL_EXTENT_SHIFT-9);
-	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (AL_EXTENT_SHIFT-9);
+	unsigned first = i->sector >> (device->al_extent_shift-9);
+	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (device->al_extent_shift-9);
 
 	D_ASSERT(device, first <= last);
 	D_ASSERT(device, atomic_read(&device->local_cnt) > 0);
@@ -320,10 +739,15 @@ bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval
 	if (first != last)
 		return false;
 
-	return _al_get_nonblock(device, first) != NULL;
+	if (al_pin_get(device, first)) {
+		i->al_pinned = true;
+		return true;
+	}
+
+	return _al_get_nonblock(device, first, true) != NULL;
 }
 
-#if (PAGE_SHIFT + 3) < (AL_EXTENT_SHIFT - BM_BLOCK_SHIFT)
+#if (PAGE_SHIFT + 3) < (AL_EXTENT_SHIFT_MAX - BM_BLOCK_SHIFT)
 /* Currently BM_BLOCK_SHIFT, BM_EXT_SHIFT and AL_EXTENT_SHIFT
  * are still coupled, or assume too much about their relation.
  * Code below will not work if this is violated.
@@ -332,9 +756,9 @@ bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval
 # error FIXME
 #endif
 
-static unsigned long al_extent_to_bm_bit(unsigned int al_enr)
+static unsigned long al_extent_to_bm_bit(struct drbd_device *device, unsigned int al_enr)
 {
-	return (unsigned long)al_enr << (AL_EXTENT_SHIFT - BM_BLOCK_SHIFT);
+	return (unsigned long)al_enr << (device->al_extent_shift - BM_BLOCK_SHIFT);
 }
 
 static sector_t al_tr_number_to_on_disk_sector(struct drbd_device *device)
@@ -388,8 +812,8 @@ static int __al_write_transaction(struct drbd_device *device, struct al_transact
 		if (e->lc_number != LC_FREE) {
 			unsigned long start, end;
 
-			start = al_extent_to_bm_bit(e->lc_number);
-			end = al_extent_to_bm_bit(e->lc_number + 1) - 1;
+			start = al_extent_to_bm_bit(device, e->lc_number);
+			end = al_extent_to_bm_bit(device, e->lc_number + 1) - 1;
 			drbd_bm_mark_range_for_writeout(device, start, end);
 		}
 		i++;
@@ -434,16 +858,24 @@ static int __al_write_transaction(struct drbd_device *device, struct al_transact
 		write_al_updates = rcu_dereference(device->ldev->disk_conf)->al_updates;
 		rcu_read_unlock();
 		if (write_al_updates) {
+			ktime_t write_kt = ktime_get();
+
 			ktime_aggregate_delta(device, start_kt, al_mid_kt);
-			if (drbd_md_sync_page_io(device, device->ldev, sector, REQ_OP_WRITE)) {
+			if (__drbd_md_sync_page_io(device, device->ldev, sector, REQ_OP_WRITE,
+						   drbd_al_group_commit)) {
 				err = -EIO;
 				drbd_chk_io_error(device, 1, DRBD_META_IO_ERROR);
 			} else {
+				s64 us = ktime_us_delta(ktime_get(), write_kt);
+
 				device->al_tr_number++;
 				device->al_writ_cnt++;
 				device->al_histogram[min_t(unsigned int,
 						device->act_log->pending_changes,
 						AL_UPDATES_PER_TRANSACTION)]++;
+				device->al_latency_histogram[min_t(unsigned int,
+						us > 0 ? ilog2(us) + 1 : 0,
+						DRBD_AL_LATENCY_HIST - 1)]++;
 			}
 			ktime_aggregate_delta(device, start_kt, al_after_sync_page_kt);
 		}
@@ -588,8 +1020,8 @@ int drbd_al_begin_io_for_peer(struct drbd_peer_device *peer_device, struct drbd_
 {
 	struct drbd_device *device = peer_device->device;
 	struct drbd_connection *connection = peer_device->connection;
-	unsigned first = i->sector >> (AL_EXTENT_SHIFT-9);
-	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (AL_EXTENT_SHIFT-9);
+	unsigned first = i->sector >> (device->al_extent_shift-9);
+	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (device->al_extent_shift-9);
 	unsigned enr;
 	bool need_transaction = false;
 	long timeout = MAX_SCHEDULE_TIMEOUT;
@@ -643,8 +1075,8 @@ int drbd_al_begin_io_nonblock(struct drbd_device *device, struct drbd_interval *
 	struct bm_extent *bm_ext;
 	/* for bios crossing activity log extent boundaries,
 	 * we may need to activate two extents in one go */
-	unsigned first = i->sector >> (AL_EXTENT_SHIFT-9);
-	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (AL_EXTENT_SHIFT-9);
+	unsigned first = i->sector >> (device->al_extent_shift-9);
+	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (device->al_extent_shift-9);
 	unsigned nr_al_extents;
 	unsigned available_update_slots;
 	struct get_activity_log_ref_ctx al_ctx = { .device = device, };
@@ -656,6 +1088,11 @@ int drbd_al_begin_io_nonblock(struct drbd_device *device, struct drbd_interval *
 	available_update_slots = min(al->nr_elements - al->used,
 				al->max_pending_changes - al->pending_changes);
 
+	/* Idle pins of the fast path do not get to block anyone. */
+	if (available_update_slots < nr_al_extents && al_unpin_idle(device))
+		available_update_slots = min(al->nr_elements - al->used,
+					al->max_pending_changes - al->pending_changes);
+
 	/* We want all necessary updates for a given request within the same transaction
 	 * We could first check how many updates are *actually* needed,
 	 * and use that instead of the worst-case nr_al_extents */
@@ -703,8 +1140,13 @@ bool drbd_al_complete_io(struct drbd_device *device, struct drbd_interval *i)
 {
 	/* for bios crossing activity log extent boundaries,
 	 * we may need to activate two extents in one go */
-	unsigned first = i->sector >> (AL_EXTENT_SHIFT-9);
-	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (AL_EXTENT_SHIFT-9);
+	unsigned first = i->sector >> (device->al_extent_shift-9);
+	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (device->al_extent_shift-9);
+
+	if (i->al_pinned) {
+		i->al_pinned = false;
+		return al_pin_put(device, al_pin_slot(device, first));
+	}
 
 	return put_actlog(device, first, last);
 }
@@ -714,6 +1156,8 @@ static int _try_lc_del(struct drbd_device *device, struct lc_element *al_ext)
 	int rv;
 
 	spin_lock_irq(&device->al_lock);
+	/* pins that went idle since drbd_al_unpin_all() */
+	al_unpin_idle(device);
 	rv = (al_ext->refcnt == 0);
 	if (likely(rv))
 		lc_del(device->act_log, al_ext);
@@ -738,6 +1182,7 @@ void drbd_al_shrink(struct drbd_device *device)
 
 	D_ASSERT(device, test_bit(__LC_LOCKED, &device->act_log->flags));
 
+	drbd_al_unpin_all(device);
 	for (i = 0; i < device->act_log->nr_elements; i++) {
 		al_ext = lc_element_by_index(device->act_log, i);
 		if (al_ext->lc_number == LC_FREE)
@@ -1279,7 +1724,7 @@ int drbd_try_rs_begin_io(struct drbd_peer_device *peer_device, sector_t sector,
 {
 	struct drbd_device *device = peer_device->device;
 	unsigned int enr = BM_SECT_TO_EXT(sector);
-	const unsigned int al_enr = enr*AL_EXT_PER_BM_SECT;
+	const unsigned int al_enr = enr*al_ext_per_bm_sect(device);
 	struct lc_element *e;
 	struct bm_extent *bm_ext;
 	int i;
@@ -1372,7 +1817,10 @@ int drbd_try_rs_begin_io(struct drbd_peer_device *peer_device, sector_t sector,
 		goto check_al;
 	}
 check_al:
-	for (i = 0; i < AL_EXT_PER_BM_SECT; i++) {
+	for (i = 0; i < al_ext_per_bm_sect(device); i++) {
+		/* No more writes through the fast path, they have to see BME_NO_WRITES */
+		if (al_unpin_extent(device, al_enr+i))
+			wake_up(&device->al_wait);
 		if (lc_is_used(device->act_log, al_enr+i))
 			goto try_again;
 	}
@@ -17,6 +17,7 @@
 #include <linux/string.h>
 #include <linux/drbd.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/dynamic_debug.h>
 #include <linux/libnvdimm.h>
 #include <asm/kmap_types.h>
@@ -78,6 +79,26 @@
  *	and out against their on-disk location as necessary, but need to make
  *	sure we don't cause too much meta data IO, and must not deadlock in
  *	tight memory situations. This needs some more work.
+ *
+ * sparse bitmap (module parameter bitmap_sparse):
+ *	Pages without any bit set are not kept, they all point to the shared
+ *	zero page, pages with all bits of all slots set may point to a shared
+ *	page with all bits set.  Before bits are changed on such a page, it
+ *	gets a page of its own.  Writers do that in a context that may sleep,
+ *	with drbd_bm_sparse_prepare(), before the bits are set from completion
+ *	context with bm_lock held.  For bits set without that, as when a peer
+ *	is lost while a write is in flight, the allocation there must not
+ *	sleep, and falls back to a small reserve of pages.  If even that is used up, the bits can not be recorded; we do
+ *	not make up out-of-sync state, but ask for a full sync with all peers
+ *	and detach, as when the bitmap could not be written.  Pages become
+ *	shared again when they are found to be all zero after being read or
+ *	written, so the memory needed follows the number of pages with bits
+ *	set, not the capacity.  Clean pages with bits set are not dropped and
+ *	paged in again on access, as that would mean IO under bm_lock.
+ *	The IO completion only marks a page that turned out all zero; it is
+ *	dropped later by the holder of bm_change, as _drbd_bm_find_next()
+ *	and its users walk the pages without bm_lock.  Shared pages are
+ *	never read into, and written out from a copy.
  */
 
 /*
@@ -195,6 +216,8 @@ void drbd_bm_unlock(struct drbd_device *device)
 	if (!(device->bitmap->bm_flags & BM_LOCK_ALL))
 		drbd_err(device, "FIXME bitmap not locked in bm_unlock\n");
 
+	bm_sparse_drop_marked(device);
+
 	b->bm_flags &= ~BM_LOCK_ALL;
 	b->bm_why  = NULL;
 	b->bm_task_comm[0] = 0;
@@ -208,7 +231,8 @@ void drbd_bm_slot_unlock(struct drbd_peer_device *peer_device)
 	drbd_bm_unlock(peer_device->device);
 }
 
-/* we store some "meta" info about our pages in page->private */
+/* we store the page index in page->private of our pages,
+ * and of the copies we write out */
 /* at a granularity of 4k storage per bitmap bit:
  * one peta byte storage: 1<<50 byte, 1<<38 * 4k storage blocks
  *  1<<38 bits,
@@ -218,6 +242,8 @@ void drbd_bm_slot_unlock(struct drbd_peer_device *peer_device)
  * Used to report the failed page idx on io error from the endio handlers.
  */
 #define BM_PAGE_IDX_MASK	((1UL<<24)-1)
+
+/* "meta" info about our pages, in bm_page_state[] */
 /* this page is currently read in, or written back */
 #define BM_PAGE_IO_LOCK		31
 /* if there has been an IO error for this page */
@@ -231,6 +257,9 @@ void drbd_bm_slot_unlock(struct drbd_peer_device *peer_device)
 /* pages marked with this "HINT" will be considered for writeout
  * on activity log transactions */
 #define BM_PAGE_HINT_WRITEOUT	27
+/* sparse bitmap: found all zero after IO, to be dropped by
+ * bm_sparse_drop_marked() */
+#define BM_PAGE_SPARSE_DROP	26
 
 /* store_page_idx uses non-atomic assignment. It is only used directly after
  * allocating the page.  All other bm_set_page_* and bm_clear_page_* need to
@@ -248,39 +277,42 @@ static unsigned long bm_page_to_idx(struct page *page)
 	return page_private(page) & BM_PAGE_IDX_MASK;
 }
 
+static unsigned long *bm_page_state(struct drbd_bitmap *b, unsigned int page_nr)
+{
+	return &b->bm_page_state[page_nr];
+}
+
 /* As is very unlikely that the same page is under IO from more than one
  * context, we can get away with a bit per page and one wait queue per bitmap.
  */
 static void bm_page_lock_io(struct drbd_device *device, int page_nr)
 {
 	struct drbd_bitmap *b = device->bitmap;
-	void *addr = &page_private(b->bm_pages[page_nr]);
+	void *addr = bm_page_state(b, page_nr);
 	wait_event(b->bm_io_wait, !test_and_set_bit(BM_PAGE_IO_LOCK, addr));
 }
 
 static void bm_page_unlock_io(struct drbd_device *device, int page_nr)
 {
 	struct drbd_bitmap *b = device->bitmap;
-	void *addr = &page_private(b->bm_pages[page_nr]);
+	void *addr = bm_page_state(b, page_nr);
 	clear_bit_unlock(BM_PAGE_IO_LOCK, addr);
 	wake_up(&device->bitmap->bm_io_wait);
 }
 
 /* set _before_ submit_io, so it may be reset due to being changed
  * while this page is in flight... will get submitted later again */
-static void bm_set_page_unchanged(struct page *page)
+static void bm_set_page_unchanged(struct drbd_bitmap *b, unsigned int page_nr)
 {
 	/* use cmpxchg? */
-	clear_bit(BM_PAGE_NEED_WRITEOUT, &page_private(page));
-	clear_bit(BM_PAGE_LAZY_WRITEOUT, &page_private(page));
+	clear_bit(BM_PAGE_NEED_WRITEOUT, bm_page_state(b, page_nr));
+	clear_bit(BM_PAGE_LAZY_WRITEOUT, bm_page_state(b, page_nr));
 }
 
 static void bm_set_page_need_writeout(struct drbd_bitmap *bitmap, unsigned int page_nr)
 {
-	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM)) {
-		struct page *page = bitmap->bm_pages[page_nr];
-		set_bit(BM_PAGE_NEED_WRITEOUT, &page_private(page));
-	}
+	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM))
+		set_bit(BM_PAGE_NEED_WRITEOUT, bm_page_state(bitmap, page_nr));
 }
 
 void drbd_bm_reset_al_hints(struct drbd_device *device)
@@ -288,33 +320,37 @@ void drbd_bm_reset_al_hints(struct drbd_device *device)
 	device->bitmap->n_bitmap_hints = 0;
 }
 
-static int bm_test_page_unchanged(struct page *page)
+static int bm_test_page_unchanged(struct drbd_bitmap *b, unsigned int page_nr)
 {
-	volatile const unsigned long *addr = &page_private(page);
+	volatile const unsigned long *addr = bm_page_state(b, page_nr);
 	return (*addr & ((1UL<<BM_PAGE_NEED_WRITEOUT)|(1UL<<BM_PAGE_LAZY_WRITEOUT))) == 0;
 }
 
-static void bm_set_page_io_err(struct page *page)
+static void bm_set_page_io_err(struct drbd_bitmap *b, unsigned int page_nr)
 {
-	set_bit(BM_PAGE_IO_ERROR, &page_private(page));
+	set_bit(BM_PAGE_IO_ERROR, bm_page_state(b, page_nr));
 }
 
-static void bm_clear_page_io_err(struct page *page)
+static void bm_clear_page_io_err(struct drbd_bitmap *b, unsigned int page_nr)
 {
-	clear_bit(BM_PAGE_IO_ERROR, &page_private(page));
+	clear_bit(BM_PAGE_IO_ERROR, bm_page_state(b, page_nr));
 }
 
 static void bm_set_page_lazy_writeout(struct drbd_bitmap *bitmap, unsigned int page_nr)
 {
-	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM)) {
-		struct page *page = bitmap->bm_pages[page_nr];
-		set_bit(BM_PAGE_LAZY_WRITEOUT, &page_private(page));
-	}
+	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM))
+		set_bit(BM_PAGE_LAZY_WRITEOUT, bm_page_state(bitmap, page_nr));
+}
+
+static int bm_test_page_lazy_writeout(struct drbd_bitmap *b, unsigned int page_nr)
+{
+	return test_bit(BM_PAGE_LAZY_WRITEOUT, bm_page_state(b, page_nr));
 }
 
-static int bm_test_page_lazy_writeout(struct page *page)
+/* Is this one of the pages shared by the pages of a sparse bitmap? */
+static bool bm_page_is_shared(struct drbd_bitmap *b, struct page *page)
 {
-	return test_bit(BM_PAGE_LAZY_WRITEOUT, &page_private(page));
+	return b->bm_ones_page && (page == ZERO_PAGE(0) || page == b->bm_ones_page);
 }
 
 /*
@@ -324,7 +360,7 @@ static int bm_test_page_lazy_writeout(struct page *page)
  */
 
 
-static void bm_free_pages(struct page **pages, unsigned long number)
+static void bm_free_pages(struct drbd_bitmap *b, struct page **pages, unsigned long number)
 {
 	unsigned long i;
 	if (!pages)
@@ -336,18 +372,36 @@ static void bm_free_pages(struct page **pages, unsigned long number)
 				 i, number);
 			continue;
 		}
-		__free_page(pages[i]);
+		if (!bm_page_is_shared(b, pages[i])) {
+			__free_page(pages[i]);
+			b->bm_resident_pages--;
+		}
 		pages[i] = NULL;
 	}
 }
 
+static unsigned long *bm_alloc_page_state(unsigned long pages)
+{
+	size_t bytes = pages * sizeof(long);
+	unsigned long *state;
+
+	/* GFP_NOIO, for the same reasons as in bm_realloc_pages() */
+	state = kzalloc(bytes, GFP_NOIO | __GFP_NOWARN);
+	if (!state)
+		state = __vmalloc(bytes, GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO);
+	return state;
+}
+
 /*
  * "have" and "want" are NUMBER OF PAGES.
+ * Also returns the new page state array in *new_state.
  */
-static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
+static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want,
+				      unsigned long **new_state)
 {
 	struct page **old_pages = b->bm_pages;
 	struct page **new_pages, *page;
+	unsigned long *state;
 	unsigned int i, bytes;
 	unsigned long have = b->bm_number_of_pages;
 
@@ -370,29 +424,45 @@ static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
 		if (!new_pages)
 			return NULL;
 	}
+	state = bm_alloc_page_state(want);
+	if (!state) {
+		kvfree(new_pages);
+		return NULL;
+	}
 
 	if (want >= have) {
-		for (i = 0; i < have; i++)
+		for (i = 0; i < have; i++) {
 			new_pages[i] = old_pages[i];
+			state[i] = b->bm_page_state[i];
+		}
 		for (; i < want; i++) {
+			if (b->bm_ones_page) {
+				new_pages[i] = ZERO_PAGE(0);
+				continue;
+			}
 			page = alloc_page(GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO);
 			if (!page) {
-				bm_free_pages(new_pages + have, i - have);
+				bm_free_pages(b, new_pages + have, i - have);
 				kvfree(new_pages);
+				kvfree(state);
 				return NULL;
 			}
 			/* we want to know which page it is
 			 * from the endio handlers */
 			bm_store_page_idx(page, i);
 			new_pages[i] = page;
+			b->bm_resident_pages++;
 		}
 	} else {
-		for (i = 0; i < want; i++)
+		for (i = 0; i < want; i++) {
 			new_pages[i] = old_pages[i];
+			state[i] = b->bm_page_state[i];
+		}
 		/* NOT HERE, we are outside the spinlock!
 		bm_free_pages(old_pages + want, have - want);
 		*/
 	}
+	*new_state = state;
 	return new_pages;
 }
 
@@ -410,6 +480,21 @@ struct drbd_bitmap *drbd_bm_alloc(void)
 
 	b->bm_max_peers = 1;
 
+	if (drbd_bitmap_sparse) {
+		/* without them, the bitmap is simply not sparse */
+		b->bm_sparse_reserve = mempool_create_page_pool(BM_SPARSE_RESERVE, 0);
+		b->bm_ones_page = alloc_page(GFP_KERNEL);
+		if (b->bm_ones_page && b->bm_sparse_reserve) {
+			memset(page_address(b->bm_ones_page), 0xff, PAGE_SIZE);
+		} else {
+			if (b->bm_ones_page)
+				__free_page(b->bm_ones_page);
+			mempool_destroy(b->bm_sparse_reserve);
+			b->bm_ones_page = NULL;
+			b->bm_sparse_reserve = NULL;
+		}
+	}
+
 	return b;
 }
 
@@ -422,11 +507,16 @@ sector_t drbd_bm_capacity(struct drbd_device *device)
 
 void drbd_bm_free(struct drbd_bitmap *bitmap)
 {
+	kvfree(bitmap->bm_summary);
+	if (bitmap->bm_ones_page)
+		__free_page(bitmap->bm_ones_page);
+	mempool_destroy(bitmap->bm_sparse_reserve);
 	if (bitmap->bm_flags & BM_ON_DAX_PMEM)
 		return;
 
-	bm_free_pages(bitmap->bm_pages, bitmap->bm_number_of_pages);
+	bm_free_pages(bitmap, bitmap->bm_pages, bitmap->bm_number_of_pages);
 	kvfree(bitmap->bm_pages);
+	kvfree(bitmap->bm_page_state);
 	kfree(bitmap);
 }
 
@@ -463,6 +553,58 @@ static inline unsigned long bit_to_page_interleaved(struct drbd_bitmap *bitmap,
 	return word32_to_page(interleaved_word32(bitmap, bitmap_index, bit));
 }
 
+/* The summary of each slot is BITS_TO_LONGS(bm_number_of_pages) long */
+static unsigned long *bm_summary(struct drbd_bitmap *bitmap, unsigned int bitmap_index)
+{
+	return bitmap->bm_summary + bitmap_index * BITS_TO_LONGS(bitmap->bm_number_of_pages);
+}
+
+static unsigned long *bm_alloc_summary(struct drbd_bitmap *bitmap, unsigned long pages)
+{
+	size_t bytes = bitmap->bm_max_peers * BITS_TO_LONGS(pages) * sizeof(long);
+	unsigned long *summary;
+
+	/* GFP_NOIO, for the same reasons as in bm_realloc_pages() */
+	summary = kzalloc(bytes, GFP_NOIO | __GFP_NOWARN);
+	if (!summary)
+		summary = __vmalloc(bytes, GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO);
+	return summary;
+}
+
+/* May this slot have bits set on this page? */
+static bool bm_summary_test(struct drbd_bitmap *bitmap, unsigned int bitmap_index, unsigned int page)
+{
+	if (!bitmap->bm_summary)
+		return true;
+	return test_bit(page, bm_summary(bitmap, bitmap_index));
+}
+
+static void bm_summary_set(struct drbd_bitmap *bitmap, unsigned int bitmap_index, unsigned int page)
+{
+	if (bitmap->bm_summary)
+		__set_bit(page, bm_summary(bitmap, bitmap_index));
+}
+
+static void bm_summary_clear(struct drbd_bitmap *bitmap, unsigned int bitmap_index, unsigned int page)
+{
+	if (bitmap->bm_summary)
+		__clear_bit(page, bm_summary(bitmap, bitmap_index));
+}
+
+/* Are all words of this slot on this (mapped) page zero? */
+static bool bm_slot_page_empty(struct drbd_bitmap *bitmap, unsigned int bitmap_index,
+			       unsigned int page, __le32 *addr)
+{
+	const unsigned int max_peers = bitmap->bm_max_peers;
+	unsigned long word = (unsigned long)page << (PAGE_SHIFT - 2);
+	unsigned int i = (bitmap_index + max_peers - word % max_peers) % max_peers;
+
+	for (; i < PAGE_SIZE / sizeof(u32); i += max_peers)
+		if (addr[i])
+			return false;
+	return true;
+}
+
 static void *bm_map(struct drbd_bitmap *bitmap, unsigned int page)
 {
 	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM))
@@ -477,12 +619,293 @@ static void bm_unmap(struct drbd_bitmap *bitmap, void *addr)
 		kunmap_atomic(addr);
 }
 
+static unsigned long
+bm_page_op_all_slots(struct drbd_bitmap *bitmap, unsigned int page_nr,
+		     enum bitmap_operations op, unsigned long *counts);
+
+/* Pages to unshare from completion context when the page allocator fails.
+ * Writers that expect to set bits unshare their pages before. */
+#define BM_SPARSE_RESERVE 16
+
+static bool bm_is_sparse(struct drbd_bitmap *bitmap)
+{
+	return bitmap->bm_ones_page && !(bitmap->bm_flags & BM_ON_DAX_PMEM);
+}
+
+/* Give a shared page of a sparse bitmap a page of its own.
+ * Called with bm_lock held, possibly from completion context. */
+static bool bm_sparse_unshare_atomic(struct drbd_bitmap *bitmap, unsigned int page_nr)
+{
+	struct page *page;
+
+	page = mempool_alloc(bitmap->bm_sparse_reserve, GFP_ATOMIC | __GFP_HIGHMEM);
+	if (!page) {
+		bitmap->bm_sparse_nomem++;
+		return false;
+	}
+	copy_highpage(page, bitmap->bm_pages[page_nr]);
+	bm_store_page_idx(page, page_nr);
+	bitmap->bm_pages[page_nr] = page;
+	bitmap->bm_resident_pages++;
+	return true;
+}
+
+/* Same, from a context that may sleep, without bm_lock held */
+static void bm_sparse_unshare(struct drbd_bitmap *bitmap, unsigned int page_nr)
+{
+	struct page *page;
+
+	if (!bm_is_sparse(bitmap) ||
+	    !bm_page_is_shared(bitmap, READ_ONCE(bitmap->bm_pages[page_nr])))
+		return;
+
+	page = alloc_page(GFP_NOIO | __GFP_HIGHMEM | __GFP_NOFAIL);
+	spin_lock_irq(&bitmap->bm_lock);
+	if (bm_page_is_shared(bitmap, bitmap->bm_pages[page_nr])) {
+		copy_highpage(page, bitmap->bm_pages[page_nr]);
+		bm_store_page_idx(page, page_nr);
+		bitmap->bm_pages[page_nr] = page;
+		bitmap->bm_resident_pages++;
+		page = NULL;
+	}
+	spin_unlock_irq(&bitmap->bm_lock);
+	if (page)
+		__free_page(page);
+}
+
+/* Is this page of a sparse bitmap all zero, on disk as well as in memory?
+ * Called with bm_lock held. */
+static bool bm_sparse_page_droppable(struct drbd_bitmap *bitmap, unsigned int page_nr)
+{
+	bool zero = false;
+	void *addr;
+
+	/* unchanged: it is on disk as it is now, so it is all zero there too */
+	if (!bm_page_is_shared(bitmap, bitmap->bm_pages[page_nr]) &&
+	    bm_test_page_unchanged(bitmap, page_nr)) {
+		addr = kmap_atomic(bitmap->bm_pages[page_nr]);
+		zero = !memchr_inv(addr, 0, PAGE_SIZE);
+		kunmap_atomic(addr);
+	}
+	return zero;
+}
+
+/* Mark a page of a sparse bitmap that has no bits set, to share the zero
+ * page again.  Called from completion context, with the IO lock of the
+ * page held.  The page can not be freed here, as the lockless walkers of
+ * the bitmap may be looking at it. */
+static void bm_sparse_mark_drop(struct drbd_bitmap *bitmap, unsigned int page_nr)
+{
+	unsigned long flags;
+	bool zero;
+
+	spin_lock_irqsave(&bitmap->bm_lock, flags);
+	zero = bm_sparse_page_droppable(bitmap, page_nr);
+	spin_unlock_irqrestore(&bitmap->bm_lock, flags);
+	if (zero && !test_and_set_bit(BM_PAGE_SPARSE_DROP, bm_page_state(bitmap, page_nr)))
+		atomic_inc(&bitmap->bm_sparse_drops);
+}
+
+/* Let the pages marked by bm_sparse_mark_drop() share the zero page.
+ * The caller holds bm_change, so nobody walks the pages without bm_lock.
+ * Pages under IO are left marked for the next time. */
+static void bm_sparse_drop_marked(struct drbd_device *device)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned int page_nr;
+
+	if (!atomic_xchg(&bitmap->bm_sparse_drops, 0))
+		return;
+
+	for (page_nr = 0; page_nr < bitmap->bm_number_of_pages; page_nr++) {
+		unsigned long *state = bm_page_state(bitmap, page_nr);
+		struct page *page = NULL;
+
+		if (!test_and_clear_bit(BM_PAGE_SPARSE_DROP, state))
+			continue;
+		if (test_and_set_bit(BM_PAGE_IO_LOCK, state)) {
+			set_bit(BM_PAGE_SPARSE_DROP, state);
+			atomic_inc(&bitmap->bm_sparse_drops);
+			continue;
+		}
+
+		spin_lock_irq(&bitmap->bm_lock);
+		if (bm_sparse_page_droppable(bitmap, page_nr)) {
+			page = bitmap->bm_pages[page_nr];
+			bitmap->bm_pages[page_nr] = ZERO_PAGE(0);
+			bitmap->bm_resident_pages--;
+		}
+		spin_unlock_irq(&bitmap->bm_lock);
+		bm_page_unlock_io(device, page_nr);
+		if (page)
+			mempool_free(page, bitmap->bm_sparse_reserve);
+		cond_resched();
+	}
+}
+
+/* Point a shared page to the other shared page, to the one with all bits
+ * set for BM_OP_SET, to the zero page for BM_OP_CLEAR.  The bits changed
+ * are added to changed[] per slot, returns their total. */
+static unsigned long bm_sparse_switch(struct drbd_bitmap *bitmap, unsigned int page_nr,
+				      enum bitmap_operations op, unsigned long *changed)
+{
+	struct page *to = op == BM_OP_SET ? bitmap->bm_ones_page : ZERO_PAGE(0);
+	unsigned long total;
+
+	if (bitmap->bm_pages[page_nr] == to)
+		return 0;
+	bitmap->bm_pages[page_nr] = bitmap->bm_ones_page;
+	total = bm_page_op_all_slots(bitmap, page_nr, BM_OP_COUNT, changed);
+	bitmap->bm_pages[page_nr] = to;
+	return total;
+}
+
+/* after setting or clearing bits of all slots on a page */
+static void bm_account_all_slots(struct drbd_bitmap *bitmap, unsigned int page_nr,
+				 enum bitmap_operations op, unsigned long *changed)
+{
+	unsigned int bitmap_index;
+
+	if (op == BM_OP_SET)
+		bm_set_page_need_writeout(bitmap, page_nr);
+	else
+		bm_set_page_lazy_writeout(bitmap, page_nr);
+	for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++) {
+		if (op == BM_OP_SET) {
+			bitmap->bm_set[bitmap_index] += changed[bitmap_index];
+			if (changed[bitmap_index])
+				bm_summary_set(bitmap, bitmap_index, page_nr);
+		} else {
+			bitmap->bm_set[bitmap_index] -= changed[bitmap_index];
+			bm_summary_clear(bitmap, bitmap_index, page_nr);
+		}
+	}
+}
+
+/* Before changing bits on a page, with bm_lock held.  Returns true if there
+ * is nothing to do on this page, because it is shared and would not change,
+ * or because it could not get a page of its own.  Bits that could not be
+ * cleared stay set, and are not counted as cleared.  Bits that could not be
+ * set are lost; that is flagged, for bm_sparse_check_failed(). */
+static bool bm_sparse_skip_page(struct drbd_bitmap *bitmap, unsigned int page_nr,
+				enum bitmap_operations op)
+{
+	struct page *page;
+
+	if (op != BM_OP_SET && op != BM_OP_CLEAR && op != BM_OP_MERGE)
+		return false;
+	if (!bm_is_sparse(bitmap))
+		return false;
+	page = bitmap->bm_pages[page_nr];
+	if (!bm_page_is_shared(bitmap, page))
+		return false;
+
+	/* nothing to clear on the zero page, nothing to set on the other */
+	if ((op == BM_OP_CLEAR) == (page == ZERO_PAGE(0)))
+		return true;
+	if (bm_sparse_unshare_atomic(bitmap, page_nr))
+		return false;
+	if (op != BM_OP_CLEAR)
+		bitmap->bm_flags |= BM_SPARSE_FAILED;
+	return true;
+}
+
+/* After bm_lock was released, possibly from completion context: if bits
+ * could not be set on a sparse bitmap, it no longer knows what is out of
+ * sync.  The worker deals with that, see bitmap_lost_bits(). */
+static void bm_sparse_check_failed(struct drbd_device *device)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long irq_flags;
+	bool failed;
+
+	if (likely(!(READ_ONCE(bitmap->bm_flags) & BM_SPARSE_FAILED)))
+		return;
+
+	spin_lock_irqsave(&bitmap->bm_lock, irq_flags);
+	failed = bitmap->bm_flags & BM_SPARSE_FAILED;
+	bitmap->bm_flags &= ~BM_SPARSE_FAILED;
+	if (failed)
+		bitmap->bm_sparse_lost++;
+	spin_unlock_irqrestore(&bitmap->bm_lock, irq_flags);
+	if (failed)
+		drbd_device_post_work(device, BITMAP_LOST_BITS);
+}
+
+/* Unshare the pages with bits sbit to ebit of the slots first_index to
+ * last_index, from a context that may sleep, without bm_lock held.  If the
+ * page allocator fails, that is left to bm_sparse_unshare_atomic(). */
+static void bm_sparse_prepare(struct drbd_bitmap *bitmap,
+			      unsigned int first_index, unsigned int last_index,
+			      unsigned long sbit, unsigned long ebit)
+{
+	unsigned long page_nr, last_page_nr;
+	struct page *page = NULL;
+
+	spin_lock_irq(&bitmap->bm_lock);
+	if (!bitmap->bm_bits || sbit >= bitmap->bm_bits)
+		goto out;
+	if (ebit >= bitmap->bm_bits)
+		ebit = bitmap->bm_bits - 1;
+	if (last_index >= bitmap->bm_max_peers)
+		last_index = bitmap->bm_max_peers - 1;
+	page_nr = word32_to_page(interleaved_word32(bitmap, first_index, sbit));
+	last_page_nr = word32_to_page(interleaved_word32(bitmap, last_index, ebit));
+
+	for (; page_nr <= last_page_nr && page_nr < bitmap->bm_number_of_pages; page_nr++) {
+		if (!bm_page_is_shared(bitmap, bitmap->bm_pages[page_nr]))
+			continue;
+		if (!page) {
+			spin_unlock_irq(&bitmap->bm_lock);
+			page = alloc_page(GFP_NOIO | __GFP_HIGHMEM | __GFP_NOWARN);
+			spin_lock_irq(&bitmap->bm_lock);
+			if (!page)
+				break;
+			if (page_nr >= bitmap->bm_number_of_pages ||
+			    !bm_page_is_shared(bitmap, bitmap->bm_pages[page_nr]))
+				continue;
+		}
+		copy_highpage(page, bitmap->bm_pages[page_nr]);
+		bm_store_page_idx(page, page_nr);
+		bitmap->bm_pages[page_nr] = page;
+		bitmap->bm_resident_pages++;
+		page = NULL;
+	}
+out:
+	spin_unlock_irq(&bitmap->bm_lock);
+	if (page)
+		__free_page(page);
+}
+
+/**
+ * drbd_bm_sparse_prepare() - Unshare the pages of a sparse bitmap for a range
+ * @device:	DRBD device.
+ * @sector:	Start of the range.
+ * @size:	Size of the range in bytes.
+ *
+ * For writers, before the bits of the range are set or cleared from
+ * completion context, where the allocation could fail.  May sleep.
+ */
+void drbd_bm_sparse_prepare(struct drbd_device *device, sector_t sector, unsigned int size)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+
+	if (!bitmap || !bm_is_sparse(bitmap) || !size)
+		return;
+	bm_sparse_prepare(bitmap, 0, DRBD_PEERS_MAX - 1, BM_SECT_TO_BIT(sector),
+			  BM_SECT_TO_BIT(sector + (size >> 9) - 1));
+}
+
 static __always_inline unsigned long
 ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start, unsigned long end,
 	 enum bitmap_operations op, __le32 *buffer)
 {
 	struct drbd_bitmap *bitmap = device->bitmap;
 	unsigned int word32_skip = 32 * bitmap->bm_max_peers;
+	/* With a single peer slot the words of one slot are contiguous,
+	 * and we can set, clear and count them 64 bits at a time. */
+	const bool word64_stride = bitmap->bm_max_peers == 1 &&
+		(op == BM_OP_CLEAR || op == BM_OP_SET || op == BM_OP_COUNT);
 	unsigned long total = 0;
 	unsigned long word;
 	unsigned int page, bit_in_page;
@@ -498,6 +921,40 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 		unsigned int count = 0;
 		void *addr;
 
+		if (op == BM_OP_FIND_BIT || op == BM_OP_COUNT) {
+			if (!bm_summary_test(bitmap, bitmap_index, page)) {
+				unsigned long next;
+
+				next = find_next_bit(bm_summary(bitmap, bitmap_index),
+						     bitmap->bm_number_of_pages, page);
+				bitmap->bm_summary_skipped += next - page;
+				if (next >= bitmap->bm_number_of_pages)
+					break;
+
+				/* first word of this slot on page "next" */
+				word = DIV_ROUND_UP((next << (PAGE_SHIFT - 2)) - bitmap_index,
+						    bitmap->bm_max_peers);
+				start = word << 5;
+				word = word * bitmap->bm_max_peers + bitmap_index;
+				page = word32_to_page(word);
+				bit_in_page = word32_in_page(word) << 5;
+				if (start > end)
+					break;
+			}
+			bitmap->bm_summary_scanned++;
+		}
+
+		if (bm_sparse_skip_page(bitmap, page, op)) {
+			unsigned long last = last_bit_on_page(bitmap, bitmap_index, start);
+
+			if (op == BM_OP_MERGE)
+				buffer += (last + 1 - start) / 32;
+			start = last + 1;
+			word = interleaved_word32(bitmap, bitmap_index, start);
+			bit_in_page = word32_in_page(word) << 5;
+			continue;
+		}
+
 		addr = bm_map(bitmap, page);
 		if (((start & 31) && (start | 31) <= end) || op == BM_OP_TEST) {
 			unsigned int last = bit_in_page | 31;
@@ -554,6 +1011,31 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 		while (start + 31 <= end) {
 			__le32 *p = (__le32 *)addr + (bit_in_page >> 5);
 
+			if (word64_stride && !(bit_in_page & 63) && start + 63 <= end) {
+				__le64 *q = (__le64 *)p;
+
+				switch(op) {
+				case BM_OP_CLEAR:
+					count += hweight64(*q);
+					*q = 0;
+					break;
+				case BM_OP_SET:
+					count += hweight64(~*q);
+					*q = -1;
+					break;
+				case BM_OP_COUNT:
+					total += hweight64(*q);
+					break;
+				default:
+					break;
+				}
+				start += 64;
+				bit_in_page += 64;
+				if (bit_in_page >= BITS_PER_PAGE)
+					goto next_page;
+				continue;
+			}
+
 			switch(op) {
 			case BM_OP_CLEAR:
 				count += hweight32(*p);
@@ -662,6 +1144,19 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 		}
 
 	    next_page:
+		switch(op) {
+		case BM_OP_CLEAR:
+			if (count && bm_slot_page_empty(bitmap, bitmap_index, page, addr))
+				bm_summary_clear(bitmap, bitmap_index, page);
+			break;
+		case BM_OP_SET:
+		case BM_OP_MERGE:
+			if (count)
+				bm_summary_set(bitmap, bitmap_index, page);
+			break;
+		default:
+			break;
+		}
 		bm_unmap(bitmap, addr);
 		bit_in_page -= BITS_PER_PAGE;
 		switch(op) {
@@ -757,6 +1252,7 @@ bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start
 	spin_lock_irqsave(&bitmap->bm_lock, irq_flags);
 	count = __bm_op(device, bitmap_index, start, end, op, buffer);
 	spin_unlock_irqrestore(&bitmap->bm_lock, irq_flags);
+	bm_sparse_check_failed(device);
 	return count;
 }
 
@@ -791,25 +1287,129 @@ bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start
 	____bm_op(device, bitmap_index, start, end, op, buffer)
 #endif
 
+/* Count, set or clear all bits of all peer slots on one bitmap page.
+ * Walking the interleaved words of all slots in one go touches every page
+ * once, instead of once per slot as a per-slot ____bm_op() would.
+ * Bits beyond bm_bits are masked out and left alone.
+ * The number of bits counted or changed is added to counts[] per slot.
+ * Returns the total number of bits counted or changed on this page. */
+static unsigned long
+bm_page_op_all_slots(struct drbd_bitmap *bitmap, unsigned int page_nr,
+		     enum bitmap_operations op, unsigned long *counts)
+{
+	const unsigned int max_peers = bitmap->bm_max_peers;
+	const unsigned long full_words = bitmap->bm_bits >> 5;
+	const __le32 last_mask = cpu_to_le32((1U << (bitmap->bm_bits & 31)) - 1);
+	unsigned long word = (unsigned long)page_nr << (PAGE_SHIFT - 2);
+	unsigned long slot_word = word / max_peers;
+	unsigned int slot = word % max_peers;
+	unsigned long total = 0;
+	__le32 *addr;
+	unsigned int i;
+
+	addr = bm_map(bitmap, page_nr);
+	if (max_peers == 1 && slot_word + PAGE_SIZE / sizeof(u32) <= full_words) {
+		__le64 *q = (__le64 *)addr;
+
+		for (i = 0; i < PAGE_SIZE / sizeof(u64); i++) {
+			switch(op) {
+			case BM_OP_COUNT:
+				total += hweight64(q[i]);
+				break;
+			case BM_OP_SET:
+				total += hweight64(~q[i]);
+				q[i] = -1;
+				break;
+			case BM_OP_CLEAR:
+				total += hweight64(q[i]);
+				q[i] = 0;
+				break;
+			default:
+				BUG();
+			}
+		}
+		counts[0] += total;
+		goto out;
+	}
+
+	for (i = 0; i < PAGE_SIZE / sizeof(u32); i++) {
+		__le32 mask;
+		unsigned int c;
+
+		if (slot_word < full_words)
+			mask = cpu_to_le32(~0U);
+		else if (slot_word == full_words)
+			mask = last_mask;
+		else
+			break;
+
+		switch(op) {
+		case BM_OP_COUNT:
+			c = hweight32(addr[i] & mask);
+			break;
+		case BM_OP_SET:
+			c = hweight32(~addr[i] & mask);
+			addr[i] |= mask;
+			break;
+		case BM_OP_CLEAR:
+			c = hweight32(addr[i] & mask);
+			addr[i] &= ~mask;
+			break;
+		default:
+			BUG();
+		}
+		counts[slot] += c;
+		total += c;
+
+		if (++slot == max_peers) {
+			slot = 0;
+			slot_word++;
+		}
+	}
+ out:
+	bm_unmap(bitmap, addr);
+	return total;
+}
+
+/* Count the bits set on pages [page_nr, page_nr + nr_pages), add them to
+ * bits_set[], and rebuild the summary of those pages.  The reads of the
+ * whole bitmap count disjoint ranges concurrently, so the summary is
+ * updated with atomic bit operations here. */
+static void bm_count_page_range(struct drbd_bitmap *bitmap, unsigned int page_nr,
+				unsigned int nr_pages, unsigned long *bits_set)
+{
+	unsigned long on_page[DRBD_PEERS_MAX];
+	unsigned int bitmap_index, end = page_nr + nr_pages;
+
+	for (; page_nr < end; page_nr++) {
+		memset(on_page, 0, sizeof(on_page));
+		bm_page_op_all_slots(bitmap, page_nr, BM_OP_COUNT, on_page);
+		for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++) {
+			bits_set[bitmap_index] += on_page[bitmap_index];
+			if (!bitmap->bm_summary)
+				continue;
+			if (on_page[bitmap_index])
+				set_bit(page_nr, bm_summary(bitmap, bitmap_index));
+			else
+				clear_bit(page_nr, bm_summary(bitmap, bitmap_index));
+		}
+		cond_resched();
+	}
+}
+
 /* you better not modify the bitmap while this is running,
  * or its results will be stale */
 static void bm_count_bits(struct drbd_device *device)
 {
 	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long bits_set[DRBD_PEERS_MAX] = { };
 	unsigned int bitmap_index;
 
-	for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++) {
-		unsigned long bit = 0, bits_set = 0;
-
-		while (bit < bitmap->bm_bits) {
-			unsigned long last_bit = last_bit_on_page(bitmap, bitmap_index, bit);
+	/* rebuilds the summary as well */
+	bm_count_page_range(bitmap, 0, bitmap->bm_number_of_pages, bits_set);
 
-			bits_set += ___bm_op(device, bitmap_index, bit, last_bit, BM_OP_COUNT, NULL);
-			bit = last_bit + 1;
-			cond_resched();
-		}
-		bitmap->bm_set[bitmap_index] = bits_set;
-	}
+	for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++)
+		bitmap->bm_set[bitmap_index] = bits_set[bitmap_index];
 }
 
 /* For the layout, see comment above drbd_md_set_sector_offsets(). */
@@ -843,9 +1443,11 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 	unsigned long bits, words, obits;
 	unsigned long want, have, onpages; /* number of pages */
 	struct page **npages = NULL, **opages = NULL;
+	unsigned long *nsummary = NULL, *osummary = NULL;
+	unsigned long *nstate = NULL, *ostate = NULL;
 	void *bm_on_pmem = NULL;
 	int err = 0;
-	bool growing;
+	bool growing, recount;
 
 	if (!expect(device, b))
 		return -ENOMEM;
@@ -864,7 +1466,11 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		spin_lock_irq(&b->bm_lock);
 		opages = b->bm_pages;
 		onpages = b->bm_number_of_pages;
+		osummary = b->bm_summary;
+		ostate = b->bm_page_state;
 		b->bm_pages = NULL;
+		b->bm_summary = NULL;
+		b->bm_page_state = NULL;
 		b->bm_number_of_pages = 0;
 		for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++)
 			b->bm_set[bitmap_index] = 0;
@@ -873,9 +1479,11 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		b->bm_dev_capacity = 0;
 		spin_unlock_irq(&b->bm_lock);
 		if (!(b->bm_flags & BM_ON_DAX_PMEM)) {
-			bm_free_pages(opages, onpages);
+			bm_free_pages(b, opages, onpages);
 			kvfree(opages);
 		}
+		kvfree(osummary);
+		kvfree(ostate);
 		goto out;
 	}
 	bits  = BM_SECT_TO_BIT(ALIGN(capacity, BM_SECT_PER_BIT));
@@ -894,6 +1502,18 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 
 	want = ALIGN(words*sizeof(long), PAGE_SIZE) >> PAGE_SHIFT;
 	have = b->bm_number_of_pages;
+
+	/* The bits past the old end on its last page are set or cleared below
+	 * with bm_lock held, where a shared page could not be unshared
+	 * reliably.  Unshare them here, before the new page array copies the
+	 * pointers to the old pages. */
+	obits = b->bm_bits;
+	if (bm_is_sparse(b) && bits > obits) {
+		unsigned long page_nr = word32_to_page(interleaved_word32(b, 0, obits));
+
+		for (; page_nr < have; page_nr++)
+			bm_sparse_unshare(b, page_nr);
+	}
 	if (drbd_md_dax_active(device->ldev)) {
 		bm_on_pmem = drbd_dax_bitmap(device, want);
 	} else {
@@ -904,7 +1524,7 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 			if (drbd_insert_fault(device, DRBD_FAULT_BM_ALLOC))
 				npages = NULL;
 			else
-				npages = bm_realloc_pages(b, want);
+				npages = bm_realloc_pages(b, want, &nstate);
 		}
 
 		if (!npages) {
@@ -913,9 +1533,33 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		}
 	}
 
+	/* Without a summary, we just do not skip anything. */
+	nsummary = bm_alloc_summary(b, want);
+
 	spin_lock_irq(&b->bm_lock);
 	obits  = b->bm_bits;
 
+	/* Pages that we keep keep their summary.  New pages are all zero,
+	 * or get a fresh summary in bm_count_bits() below.  Without an old
+	 * summary, the pages we keep may have bits set anywhere; do not skip
+	 * them until bm_count_bits() below rebuilt it. */
+	osummary = b->bm_summary;
+	recount = nsummary && !osummary && have;
+	if (nsummary) {
+		unsigned long keep = min(have, want);
+		unsigned int bitmap_index;
+
+		for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++) {
+			unsigned long *dst = nsummary + bitmap_index * BITS_TO_LONGS(want);
+
+			if (osummary)
+				bitmap_copy(dst, bm_summary(b, bitmap_index), keep);
+			else
+				bitmap_fill(dst, keep);
+		}
+	}
+	b->bm_summary = nsummary;
+
 	growing = bits > obits;
 
 	if (bm_on_pmem) {
@@ -934,6 +1578,10 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 	} else {
 		opages = b->bm_pages;
 		b->bm_pages = npages;
+		if (nstate) {
+			ostate = b->bm_page_state;
+			b->bm_page_state = nstate;
+		}
 	}
 	b->bm_number_of_pages = want;
 	b->bm_bits  = bits;
@@ -943,6 +1591,20 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 	if (growing) {
 		unsigned int bitmap_index;
 
+		/* Pages that are new as a whole can share the page with all bits set,
+		 * the bm_set of the slots is updated below. */
+		if (set_new_bits && bm_is_sparse(b)) {
+			unsigned long changed[DRBD_PEERS_MAX], page_nr;
+
+			for (page_nr = have; page_nr < want; page_nr++) {
+				memset(changed, 0, sizeof(changed));
+				bm_sparse_switch(b, page_nr, BM_OP_SET, changed);
+				bm_set_page_need_writeout(b, page_nr);
+				for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++)
+					bm_summary_set(b, bitmap_index, page_nr);
+			}
+		}
+
 		for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++) {
 			unsigned long bm_set = b->bm_set[bitmap_index];
 
@@ -959,13 +1621,15 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 
 	if (want < have && !(b->bm_flags & BM_ON_DAX_PMEM)) {
 		/* implicit: (opages != NULL) && (opages != npages) */
-		bm_free_pages(opages + want, have - want);
+		bm_free_pages(b, opages + want, have - want);
 	}
 
 	spin_unlock_irq(&b->bm_lock);
 	if (opages != npages)
 		kvfree(opages);
-	if (!growing)
+	kvfree(osummary);
+	kvfree(ostate);
+	if (!growing || recount)
 		bm_count_bits(device);
 	drbd_info(device, "resync bitmap: bits=%lu words=%lu pages=%lu\n", bits, words, want);
 
@@ -1043,11 +1707,29 @@ unsigned long drbd_bm_bits(struct drbd_device *device)
 void drbd_bm_merge_lel(struct drbd_peer_device *peer_device, size_t offset, size_t number,
 			unsigned long *buffer)
 {
-	unsigned long start, end;
+	size_t i = 0, first;
 
-	start = offset * BITS_PER_LONG;
-	end = start + number * BITS_PER_LONG - 1;
-	bm_op(peer_device->device, peer_device->bitmap_index, start, end, BM_OP_MERGE, (__le32 *)buffer);
+	/* zero words would not change anything, and they would make a
+	 * sparse bitmap allocate pages for nothing */
+	while (i < number) {
+		unsigned long start, end;
+
+		while (i < number && !buffer[i])
+			i++;
+		first = i;
+		while (i < number && buffer[i])
+			i++;
+		if (first == i)
+			break;
+
+		start = (offset + first) * BITS_PER_LONG;
+		end = (offset + i) * BITS_PER_LONG - 1;
+		if (bm_is_sparse(peer_device->device->bitmap))
+			bm_sparse_prepare(peer_device->device->bitmap, peer_device->bitmap_index,
+					  peer_device->bitmap_index, start, end);
+		bm_op(peer_device->device, peer_device->bitmap_index, start, end, BM_OP_MERGE,
+		      (__le32 *)(buffer + first));
+	}
 }
 
 /* copy number words from the bitmap starting at offset into the buffer.
@@ -1077,89 +1759,207 @@ static void drbd_bm_aio_ctx_destroy(struct kref *kref)
 }
 
 /* bv_page may be a copy, or may be the original */
-static void drbd_bm_endio(struct bio *bio)
+static void bm_end_page(struct drbd_bm_aio_ctx *ctx, struct page *page, blk_status_t status)
 {
-	struct drbd_bm_aio_ctx *ctx = bio->bi_private;
 	struct drbd_device *device = ctx->device;
 	struct drbd_bitmap *b = device->bitmap;
-	unsigned int idx = bm_page_to_idx(bio->bi_io_vec[0].bv_page);
-
-	blk_status_t status = bio->bi_status;
+	unsigned int idx = bm_page_to_idx(page);
+	/* shared pages of a sparse bitmap are written from a copy as well */
+	bool copy = (ctx->flags & BM_AIO_COPY_PAGES) ||
+		page != READ_ONCE(b->bm_pages[idx]);
 
-	if ((ctx->flags & BM_AIO_COPY_PAGES) == 0 &&
-	    !bm_test_page_unchanged(b->bm_pages[idx]))
+	if (!copy && !bm_test_page_unchanged(b, idx))
 		drbd_warn(device, "bitmap page idx %u changed during IO!\n", idx);
 
 	if (status) {
 		/* ctx error will hold the completed-last non-zero error code,
 		 * in case error codes differ. */
 		ctx->error = blk_status_to_errno(status);
-		bm_set_page_io_err(b->bm_pages[idx]);
+		bm_set_page_io_err(b, idx);
 		/* Not identical to on disk version of it.
 		 * Is BM_PAGE_IO_ERROR enough? */
 		if (drbd_ratelimit())
 			drbd_err(device, "IO ERROR %d on bitmap page idx %u\n",
 				 status, idx);
 	} else {
-		bm_clear_page_io_err(b->bm_pages[idx]);
+		bm_clear_page_io_err(b, idx);
 		dynamic_drbd_dbg(device, "bitmap page idx %u completed\n", idx);
+		if (bm_is_sparse(b))
+			bm_sparse_mark_drop(b, idx);
 	}
 
 	bm_page_unlock_io(device, idx);
 
-	if (ctx->flags & BM_AIO_COPY_PAGES)
-		mempool_free(bio->bi_io_vec[0].bv_page, &drbd_md_io_page_pool);
+	if (copy)
+		mempool_free(page, &drbd_md_io_page_pool);
+}
 
-	bio_put(bio);
+/* The pages of one bio are contiguous on disk and in the bitmap */
+static void bm_end_pages(struct drbd_bm_aio_ctx *ctx, struct bio *bio)
+{
+	unsigned short i;
+	unsigned int k;
+
+	/* bio_add_page() merges physically contiguous pages into one bvec */
+	for (i = 0; i < bio->bi_vcnt; i++) {
+		struct bio_vec *bvec = &bio->bi_io_vec[i];
+
+		for (k = 0; k < DIV_ROUND_UP(bvec->bv_len, PAGE_SIZE); k++)
+			bm_end_page(ctx, nth_page(bvec->bv_page, k), bio->bi_status);
+	}
+}
+
+static void bm_aio_ctx_bio_done(struct drbd_bm_aio_ctx *ctx)
+{
+	struct drbd_device *device = ctx->device;
 
 	if (atomic_dec_and_test(&ctx->in_flight)) {
 		ctx->done = 1;
 		wake_up(&device->misc_wait);
 		kref_put(&ctx->kref, &drbd_bm_aio_ctx_destroy);
+	} else if (ctx->flags & BM_AIO_READ) {
+		/* see bm_run_submit() */
+		wake_up(&device->misc_wait);
 	}
 }
 
-static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_hold(local)
+static void drbd_bm_endio(struct bio *bio)
 {
-	struct bio *bio = bio_alloc_drbd(GFP_NOIO);
+	struct drbd_bm_aio_ctx *ctx = bio->bi_private;
+
+	bm_end_pages(ctx, bio);
+	bio_put(bio);
+	bm_aio_ctx_bio_done(ctx);
+}
+
+/* Reading the whole bitmap: the set bits of each bio are counted as soon
+ * as it completes, in parallel with the remaining reads, instead of in one
+ * pass over all pages after the last one completed. */
+struct bm_count_work {
+	struct work_struct work;
+	struct drbd_bm_aio_ctx *ctx;
+	struct bio *bio;
+	unsigned int page_nr;
+	unsigned int nr_pages;
+};
+
+static void bm_count_work_fn(struct work_struct *work)
+{
+	struct bm_count_work *cw = container_of(work, struct bm_count_work, work);
+	struct drbd_bm_aio_ctx *ctx = cw->ctx;
+	struct drbd_bitmap *b = ctx->device->bitmap;
+	unsigned long bits_set[DRBD_PEERS_MAX] = { };
+	unsigned int bitmap_index;
+
+	if (!cw->bio->bi_status) {
+		bm_count_page_range(b, cw->page_nr, cw->nr_pages, bits_set);
+		for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++)
+			atomic_long_add(bits_set[bitmap_index], &ctx->bits_set[bitmap_index]);
+	}
+
+	/* count first, the pages must not change before they are unlocked */
+	bm_end_pages(ctx, cw->bio);
+	bio_put(cw->bio);
+	kfree(cw);
+	bm_aio_ctx_bio_done(ctx);
+}
+
+static void drbd_bm_read_endio(struct bio *bio)
+{
+	struct bm_count_work *cw = bio->bi_private;
+
+	queue_work(system_unbound_wq, &cw->work);
+}
+
+/* Submits one bio for up to nr_pages pages starting at page_nr.
+ * Returns the number of pages it covers, at least one. */
+static unsigned int bm_pages_io_async(struct drbd_bm_aio_ctx *ctx,
+		unsigned int page_nr, unsigned int nr_pages) __must_hold(local)
+{
+	struct bio *bio = bio_alloc_drbd(GFP_NOIO, nr_pages);
 	struct drbd_device *device = ctx->device;
 	struct drbd_bitmap *b = device->bitmap;
-	struct page *page;
-	unsigned int len;
+	struct bm_count_work *cw = NULL;
 	unsigned int op = (ctx->flags & BM_AIO_READ) ? REQ_OP_READ : REQ_OP_WRITE;
+	sector_t last_sector = drbd_md_last_sector(device->ldev);
+	unsigned int n, size = 0;
 
 	sector_t on_disk_sector =
 		device->ldev->md.md_offset + device->ldev->md.bm_offset;
 	on_disk_sector += ((sector_t)page_nr) << (PAGE_SHIFT-9);
 
-	/* this might happen with very small
-	 * flexible external meta data device,
-	 * or with PAGE_SIZE > 4k */
-	len = min_t(unsigned int, PAGE_SIZE,
-		(drbd_md_last_sector(device->ldev) - on_disk_sector + 1)<<9);
-
-	/* serialize IO on this page */
-	bm_page_lock_io(device, page_nr);
-	/* before memcpy and submit,
-	 * so it can be redirtied any time */
-	bm_set_page_unchanged(b->bm_pages[page_nr]);
-
-	if (ctx->flags & BM_AIO_COPY_PAGES) {
-		page = mempool_alloc(&drbd_md_io_page_pool,
-				GFP_NOIO | __GFP_HIGHMEM);
-		copy_highpage(page, b->bm_pages[page_nr]);
-		bm_store_page_idx(page, page_nr);
-	} else
-		page = b->bm_pages[page_nr];
+	for (n = 0; n < nr_pages; n++) {
+		sector_t sector = on_disk_sector + (n << (PAGE_SHIFT-9));
+		bool copy = ctx->flags & BM_AIO_COPY_PAGES;
+		struct page *page;
+		unsigned int len;
+
+		/* this might happen with very small
+		 * flexible external meta data device,
+		 * or with PAGE_SIZE > 4k */
+		len = min_t(unsigned int, PAGE_SIZE, (last_sector - sector + 1)<<9);
+
+		/* A shared page of a sparse bitmap has no page index of its own
+		 * for bm_end_page(); write it from a copy out of the pool
+		 * instead of giving it a page of its own. */
+		if (!copy && op == REQ_OP_WRITE && bm_is_sparse(b) &&
+		    bm_page_is_shared(b, READ_ONCE(b->bm_pages[page_nr + n])))
+			copy = true;
+
+		if (copy) {
+			/* Only wait for the pool with nothing of it held yet */
+			page = mempool_alloc(&drbd_md_io_page_pool,
+				(n ? GFP_NOWAIT : GFP_NOIO) | __GFP_HIGHMEM);
+			if (!page)
+				break;
+		}
+
+		/* serialize IO on this page */
+		bm_page_lock_io(device, page_nr + n);
+		/* before memcpy and submit,
+		 * so it can be redirtied any time */
+		bm_set_page_unchanged(b, page_nr + n);
+
+		if (copy) {
+			copy_highpage(page, READ_ONCE(b->bm_pages[page_nr + n]));
+			bm_store_page_idx(page, page_nr + n);
+		} else {
+			/* never read into, or submit, a shared page; on write
+			 * only if it was dropped since we looked above */
+			bm_sparse_unshare(b, page_nr + n);
+			page = b->bm_pages[page_nr + n];
+		}
+
+		/* there is a bvec for each page, this can not fail */
+		bio_add_page(bio, page, len, 0);
+		size += len;
+		if (len < PAGE_SIZE) {
+			n++;
+			break;
+		}
+	}
+
 	bio_set_dev(bio, device->ldev->md_bdev);
 	bio->bi_iter.bi_sector = on_disk_sector;
-	/* bio_add_page of a single page to an empty bio will always succeed,
-	 * according to api.  Do we want to assert that? */
-	bio_add_page(bio, page, len, 0);
 	bio->bi_private = ctx;
 	bio->bi_end_io = drbd_bm_endio;
 	bio->bi_opf = op;
 
+	if (op == REQ_OP_READ)
+		cw = kmalloc(sizeof(*cw), GFP_NOIO);
+	if (cw) {
+		INIT_WORK(&cw->work, bm_count_work_fn);
+		cw->ctx = ctx;
+		cw->bio = bio;
+		cw->page_nr = page_nr;
+		cw->nr_pages = n;
+		bio->bi_private = cw;
+		bio->bi_end_io = drbd_bm_read_endio;
+	} else if (op == REQ_OP_READ) {
+		ctx->count_all = true;
+	}
+
+	atomic_inc(&ctx->in_flight);
 	if (drbd_insert_fault(device, (op == REQ_OP_WRITE) ? DRBD_FAULT_MD_WR : DRBD_FAULT_MD_RD)) {
 		bio->bi_status = BLK_STS_IOERR;
 		bio_endio(bio);
@@ -1167,10 +1967,59 @@ static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_ho
 		submit_bio(bio);
 		/* this should not count as user activity and cause the
 		 * resync to throttle -- see drbd_rs_should_slow_down(). */
-		atomic_add(len >> 9, &device->rs_sect_ev);
+		atomic_add(size >> 9, &device->rs_sect_ev);
+	}
+	ctx->nr_bios++;
+	return n;
+}
+
+/* Contiguous pages are collected into runs, and each run is submitted
+ * with as few bios as possible. */
+struct bm_run {
+	unsigned int page_nr;
+	unsigned int nr_pages;
+};
+
+/* Reading a sparse bitmap needs memory for each page in flight, until it
+ * is found to be zero.  Limit that to this many bios. */
+#define BM_SPARSE_READ_BIOS 16
+
+static void bm_run_submit(struct drbd_bm_aio_ctx *ctx, struct bm_run *run) __must_hold(local)
+{
+	struct drbd_device *device = ctx->device;
+
+	while (run->nr_pages) {
+		unsigned int n = bm_pages_io_async(ctx, run->page_nr, run->nr_pages);
+
+		run->page_nr += n;
+		run->nr_pages -= n;
+		cond_resched();
+
+		if ((ctx->flags & BM_AIO_READ) && bm_is_sparse(device->bitmap))
+			wait_event(device->misc_wait,
+				   atomic_read(&ctx->in_flight) <= BM_SPARSE_READ_BIOS ||
+				   test_bit(FORCE_DETACH, &device->flags));
 	}
 }
 
+static void bm_run_add(struct drbd_bm_aio_ctx *ctx, struct bm_run *run,
+		       unsigned int page_nr) __must_hold(local)
+{
+	if (run->nr_pages &&
+	    (run->page_nr + run->nr_pages != page_nr || run->nr_pages == BIO_MAX_PAGES))
+		bm_run_submit(ctx, run);
+	if (!run->nr_pages)
+		run->page_nr = page_nr;
+	run->nr_pages++;
+}
+
+static int cmp_uint(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
 /**
  * bm_rw_range() - read/write the specified range of bitmap pages
  * @device: drbd device this bitmap is associated with
@@ -1181,7 +2030,7 @@ static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_ho
  * Silently limits end_page to the current bitmap size.
  *
  * We don't want to special case on logical_block_size of the backend device,
- * so we submit PAGE_SIZE aligned pieces.
+ * so we submit PAGE_SIZE aligned pieces, contiguous ones merged into one bio.
  * Note that on "most" systems, PAGE_SIZE is 4k.
  *
  * In case this becomes an issue on systems with larger PAGE_SIZE,
@@ -1193,6 +2042,7 @@ static int bm_rw_range(struct drbd_device *device,
 {
 	struct drbd_bm_aio_ctx *ctx;
 	struct drbd_bitmap *b = device->bitmap;
+	struct bm_run run = { };
 	unsigned int i, count = 0;
 	unsigned long now;
 	int err = 0;
@@ -1251,31 +2101,32 @@ static int bm_rw_range(struct drbd_device *device,
 
 	now = jiffies;
 
-	/* let the layers below us try to merge these bios... */
+	/* contiguous pages go to disk in one bio, see bm_run_add() */
 
 	if (flags & BM_AIO_READ) {
 		for (i = start_page; i <= end_page; i++) {
-			atomic_inc(&ctx->in_flight);
-			bm_page_io_async(ctx, i);
+			bm_run_add(ctx, &run, i);
 			++count;
-			cond_resched();
 		}
 	} else if (flags & BM_AIO_WRITE_HINTED) {
 		/* ASSERT: BM_AIO_WRITE_ALL_PAGES is not set. */
 		unsigned int hint;
+
+		/* in order, so that neighbouring pages end up in one bio */
+		sort(b->al_bitmap_hints, b->n_bitmap_hints, sizeof(b->al_bitmap_hints[0]),
+		     cmp_uint, NULL);
 		for (hint = 0; hint < b->n_bitmap_hints; hint++) {
 			i = b->al_bitmap_hints[hint];
 			if (i > end_page)
 				continue;
 			/* Several AL-extents may point to the same page. */
 			if (!test_and_clear_bit(BM_PAGE_HINT_WRITEOUT,
-			    &page_private(b->bm_pages[i])))
+			    bm_page_state(b, i)))
 				continue;
 			/* Has it even changed? */
-			if (bm_test_page_unchanged(b->bm_pages[i]))
+			if (bm_test_page_unchanged(b, i))
 				continue;
-			atomic_inc(&ctx->in_flight);
-			bm_page_io_async(ctx, i);
+			bm_run_add(ctx, &run, i);
 			++count;
 		}
 	} else {
@@ -1283,23 +2134,22 @@ static int bm_rw_range(struct drbd_device *device,
 			/* ignore completely unchanged pages,
 			 * unless specifically requested to write ALL pages */
 			if (!(flags & BM_AIO_WRITE_ALL_PAGES) &&
-			    bm_test_page_unchanged(b->bm_pages[i])) {
+			    bm_test_page_unchanged(b, i)) {
 				dynamic_drbd_dbg(device, "skipped bm write for idx %u\n", i);
 				continue;
 			}
 			/* during lazy writeout,
 			 * ignore those pages not marked for lazy writeout. */
 			if ((flags & BM_AIO_WRITE_LAZY) &&
-			    !bm_test_page_lazy_writeout(b->bm_pages[i])) {
+			    !bm_test_page_lazy_writeout(b, i)) {
 				dynamic_drbd_dbg(device, "skipped bm lazy write for idx %u\n", i);
 				continue;
 			}
-			atomic_inc(&ctx->in_flight);
-			bm_page_io_async(ctx, i);
+			bm_run_add(ctx, &run, i);
 			++count;
-			cond_resched();
 		}
 	}
+	bm_run_submit(ctx, &run);
 
 	/*
 	 * We initialize ctx->in_flight to one to make sure drbd_bm_endio
@@ -1334,13 +2184,35 @@ static int bm_rw_range(struct drbd_device *device,
 		err = -EIO; /* Disk timeout/force-detach during IO... */
 
 	if (flags & BM_AIO_READ) {
-		now = jiffies;
-		bm_count_bits(device);
-		drbd_info(device, "recounting of set bits took additional %ums\n",
-		     jiffies_to_msecs(jiffies - now));
+		unsigned int bitmap_index;
+
+		b->bm_read_pages = count;
+		b->bm_read_bios = ctx->nr_bios;
+		b->bm_read_ms = jiffies_to_msecs(jiffies - now);
+		drbd_info(device, "bitmap READ of %u pages in %u bios took %u ms, including the count of set bits\n",
+			  count, ctx->nr_bios, b->bm_read_ms);
+
+		if (ctx->count_all || atomic_read(&ctx->in_flight)) {
+			now = jiffies;
+			bm_count_bits(device);
+			drbd_info(device, "recounting of set bits took additional %ums\n",
+			     jiffies_to_msecs(jiffies - now));
+		} else {
+			for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++)
+				b->bm_set[bitmap_index] = atomic_long_read(&ctx->bits_set[bitmap_index]);
+		}
 	}
 
 	kref_put(&ctx->kref, &drbd_bm_aio_ctx_destroy);
+
+	/* Drop the pages found all zero.  If our caller holds the bitmap
+	 * lock, drbd_bm_unlock() does that. */
+	if (bm_is_sparse(b) && mutex_trylock(&b->bm_change)) {
+		b->bm_why = "sparse drop";
+		bm_sparse_drop_marked(device);
+		b->bm_why = NULL;
+		mutex_unlock(&b->bm_change);
+	}
 	return err;
 }
 
@@ -1362,9 +2234,8 @@ int drbd_bm_read(struct drbd_device *device,
 static void push_al_bitmap_hint(struct drbd_device *device, unsigned int page_nr)
 {
 	struct drbd_bitmap *b = device->bitmap;
-	struct page *page = b->bm_pages[page_nr];
 	BUG_ON(b->n_bitmap_hints >= ARRAY_SIZE(b->al_bitmap_hints));
-	if (!test_and_set_bit(BM_PAGE_HINT_WRITEOUT, &page_private(page)))
+	if (!test_and_set_bit(BM_PAGE_HINT_WRITEOUT, bm_page_state(b, page_nr)))
 		b->al_bitmap_hints[b->n_bitmap_hints++] = page_nr;
 }
 
@@ -1502,6 +2373,19 @@ __bm_many_bits_op(struct drbd_device *device, unsigned int bitmap_index, unsigne
 		if (end < last_bit)
 			last_bit = end;
 
+		/* we may sleep here, unshare before changing bits */
+		if (bm_is_sparse(bitmap)) {
+			unsigned long page_nr = word32_to_page(interleaved_word32(bitmap, bitmap_index, bit));
+			struct page *page = bitmap->bm_pages[page_nr];
+
+			if (bm_page_is_shared(bitmap, page) &&
+			    (op == BM_OP_CLEAR) != (page == ZERO_PAGE(0))) {
+				spin_unlock_irq(&bitmap->bm_lock);
+				bm_sparse_unshare(bitmap, page_nr);
+				spin_lock_irq(&bitmap->bm_lock);
+			}
+		}
+
 		__bm_op(device, bitmap_index, bit, last_bit, op, NULL);
 		bit = last_bit + 1;
 		if (need_resched()) {
@@ -1511,6 +2395,7 @@ __bm_many_bits_op(struct drbd_device *device, unsigned int bitmap_index, unsigne
 		}
 	}
 	spin_unlock_irq(&bitmap->bm_lock);
+	bm_sparse_check_failed(device);
 }
 
 void drbd_bm_set_many_bits(struct drbd_peer_device *peer_device, unsigned long start, unsigned long end)
@@ -1539,24 +2424,47 @@ _drbd_bm_set_many_bits(struct drbd_device *device, int bitmap_index, unsigned lo
 	__bm_many_bits_op(device, bitmap_index, start, end, BM_OP_SET);
 }
 
+/* set or clear all bits of all peer slots, in one pass over the pages */
+static void bm_all_slots_op(struct drbd_device *device, enum bitmap_operations op)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long changed[DRBD_PEERS_MAX];
+	unsigned int page_nr;
+
+	if (!expect(device, bitmap))
+		return;
+
+	spin_lock_irq(&bitmap->bm_lock);
+	for (page_nr = 0; page_nr < bitmap->bm_number_of_pages; page_nr++) {
+		memset(changed, 0, sizeof(changed));
+		/* a shared page of a sparse bitmap only ever changes as a whole */
+		if (bm_is_sparse(bitmap) && bm_page_is_shared(bitmap, bitmap->bm_pages[page_nr])) {
+			if (!bm_sparse_switch(bitmap, page_nr, op, changed))
+				goto next;
+		} else if (!bm_page_op_all_slots(bitmap, page_nr, op, changed))
+			goto next;
+
+		bm_account_all_slots(bitmap, page_nr, op, changed);
+	next:
+		if (need_resched()) {
+			spin_unlock_irq(&bitmap->bm_lock);
+			cond_resched();
+			spin_lock_irq(&bitmap->bm_lock);
+		}
+	}
+	spin_unlock_irq(&bitmap->bm_lock);
+}
+
 /* set all bits in the bitmap */
 void drbd_bm_set_all(struct drbd_device *device)
 {
-       struct drbd_bitmap *bitmap = device->bitmap;
-       unsigned int bitmap_index;
-
-       for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++)
-	       __bm_many_bits_op(device, bitmap_index, 0, -1, BM_OP_SET);
+	bm_all_slots_op(device, BM_OP_SET);
 }
 
 /* clear all bits in the bitmap */
 void drbd_bm_clear_all(struct drbd_device *device)
 {
-	struct drbd_bitmap *bitmap = device->bitmap;
-	unsigned int bitmap_index;
-
-	for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++)
-		__bm_many_bits_op(device, bitmap_index, 0, -1, BM_OP_CLEAR);
+	bm_all_slots_op(device, BM_OP_CLEAR);
 }
 
 unsigned int drbd_bm_clear_bits(struct drbd_device *device, unsigned int bitmap_index,
@@ -1605,6 +2513,8 @@ void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsi
 	spin_lock_irq(&bitmap->bm_lock);
 
 	bitmap->bm_set[to_index] = 0;
+	if (bitmap->bm_summary)
+		bitmap_zero(bm_summary(bitmap, to_index), bitmap->bm_number_of_pages);
 	current_page_nr = 0;
 	addr = bm_map(bitmap, current_page_nr);
 	for (word_nr = 0; word_nr < words32_total; word_nr += bitmap->bm_max_peers) {
@@ -1637,12 +2547,63 @@ void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsi
 			addr = bm_map(bitmap, current_page_nr);
 		}
 
-		if (addr[word32_in_page(to_word_nr)] != data_word)
+		if (addr[word32_in_page(to_word_nr)] != data_word) {
+			/* a shared page is only written to as a whole */
+			if (bm_is_sparse(bitmap) &&
+			    bm_page_is_shared(bitmap, bitmap->bm_pages[current_page_nr])) {
+				bm_unmap(bitmap, addr);
+				spin_unlock_irq(&bitmap->bm_lock);
+				bm_sparse_unshare(bitmap, current_page_nr);
+				spin_lock_irq(&bitmap->bm_lock);
+				addr = bm_map(bitmap, current_page_nr);
+			}
 			bm_set_page_need_writeout(bitmap, current_page_nr);
-		addr[word32_in_page(to_word_nr)] = data_word;
+			addr[word32_in_page(to_word_nr)] = data_word;
+		}
 		bitmap->bm_set[to_index] += hweight32(data_word);
+		if (data_word)
+			bm_summary_set(bitmap, to_index, current_page_nr);
 	}
 	bm_unmap(bitmap, addr);
 
 	spin_unlock_irq(&bitmap->bm_lock);
 }
+
+void drbd_bm_seq_printf_summary(struct seq_file *seq, struct drbd_device *device)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long pages, skipped, scanned, dirty[DRBD_PEERS_MAX];
+	unsigned long resident, nomem, lost;
+	unsigned int bitmap_index, max_peers;
+	bool have_summary, sparse;
+
+	if (!bitmap)
+		return;
+
+	spin_lock_irq(&bitmap->bm_lock);
+	pages = bitmap->bm_number_of_pages;
+	max_peers = bitmap->bm_max_peers;
+	have_summary = bitmap->bm_summary != NULL;
+	skipped = bitmap->bm_summary_skipped;
+	scanned = bitmap->bm_summary_scanned;
+	sparse = bm_is_sparse(bitmap);
+	resident = bitmap->bm_resident_pages;
+	nomem = bitmap->bm_sparse_nomem;
+	lost = bitmap->bm_sparse_lost;
+	for (bitmap_index = 0; bitmap_index < max_peers; bitmap_index++)
+		dirty[bitmap_index] = have_summary ?
+			bitmap_weight(bm_summary(bitmap, bitmap_index), pages) : pages;
+	spin_unlock_irq(&bitmap->bm_lock);
+
+	seq_printf(seq, "pages: %lu\n", pages);
+	if (sparse)
+		seq_printf(seq, "resident pages: %lu\nfailed to unshare: %lu\nfailed to set bits: %lu\n",
+			   resident, nomem, lost);
+	seq_printf(seq, "summary bytes: %lu\n",
+		   have_summary ? max_peers * BITS_TO_LONGS(pages) * sizeof(long) : 0);
+	seq_printf(seq, "pages skipped: %lu\n", skipped);
+	seq_printf(seq, "pages scanned: %lu\n", scanned);
+	for (bitmap_index = 0; bitmap_index < max_peers; bitmap_index++)
+		seq_printf(seq, "slot %u: %lu of %lu pages may have bits set\n",
+			   bitmap_index, dirty[bitmap_index], pages);
+}
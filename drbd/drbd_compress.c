@@ -0,0 +1,312 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+   drbd_compress.c
+
+   This file is part of DRBD by Philipp Reisner and Lars Ellenberg.
+
+   Payload compression for bandwidth bound replication links.
+
+   The data payload of P_DATA, P_DATA_REPLY and P_RS_DATA_REPLY is
+   compressed in DRBD_COMPRESS_CHUNK sized chunks, so that the receiving
+   side can decompress each chunk straight into its destination page.
+   Chunks that do not compress are stored.  If a whole packet does not
+   shrink by at least an eighth, it is sent uncompressed, and we back off
+   from trying for an exponentially growing number of packets.
+
+ */
+
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/highmem.h>
+#include <linux/crypto.h>
+#include <asm/unaligned.h>
+#include "drbd_int.h"
+
+#define DRBD_COMPRESS_BACKOFF_MAX 64
+
+/* the index is what goes over the wire in p_compressed.alg */
+static const char * const drbd_compress_algs[] = {
+	[1] = "lzo",
+	[2] = "lz4",
+	[3] = "lz4hc",
+	[4] = "zstd",
+	[5] = "deflate",
+};
+
+const char *drbd_compress_alg_name(u8 alg)
+{
+	if (alg >= ARRAY_SIZE(drbd_compress_algs))
+		return NULL;
+	return drbd_compress_algs[alg];
+}
+
+static u8 drbd_compress_alg_id(const char *name)
+{
+	u8 alg;
+
+	for (alg = 1; alg < ARRAY_SIZE(drbd_compress_algs); alg++) {
+		if (!strcmp(name, drbd_compress_algs[alg]))
+			return alg;
+	}
+	return 0;
+}
+
+/* Called from the receiver during the handshake, with a peer that supports
+ * compression, before anything is sent on the data stream.  The algorithm
+ * may have changed since the last connection; the buffers are kept then.
+ * Failing to set up compression is not fatal, we then simply send
+ * everything uncompressed. */
+void drbd_compress_init(struct drbd_connection *connection)
+{
+	struct drbd_compress *c = &connection->compress;
+	struct crypto_comp *tfm;
+	u8 alg = 0;
+
+	if (drbd_compress_alg[0]) {
+		alg = drbd_compress_alg_id(drbd_compress_alg);
+		if (!alg)
+			drbd_warn(connection, "Unknown compression algorithm \"%s\"\n",
+				  drbd_compress_alg);
+	}
+	if (c->tfm && c->alg == alg)
+		return;
+
+	crypto_free_comp(c->tfm);
+	c->tfm = NULL;
+	if (!alg)
+		return;
+
+	tfm = crypto_alloc_comp(drbd_compress_algs[alg], 0, 0);
+	if (IS_ERR(tfm)) {
+		drbd_warn(connection, "Can not allocate \"%s\" for compression: %ld\n",
+			  drbd_compress_algs[alg], PTR_ERR(tfm));
+		return;
+	}
+
+	if (!c->buf)
+		c->buf = vmalloc(sizeof(struct p_compressed) + DRBD_MAX_BIO_SIZE);
+	if (!c->chunk_in)
+		c->chunk_in = kmalloc(DRBD_COMPRESS_CHUNK, GFP_KERNEL);
+	/* twice the chunk size is more than the worst case of all of them */
+	if (!c->chunk_out)
+		c->chunk_out = kmalloc(2 * DRBD_COMPRESS_CHUNK, GFP_KERNEL);
+	if (!c->buf || !c->chunk_in || !c->chunk_out) {
+		drbd_warn(connection, "Can not allocate compression buffers\n");
+		crypto_free_comp(tfm);
+		drbd_compress_free(connection);
+		return;
+	}
+	c->tfm = tfm;
+	c->alg = alg;
+	c->skip = 0;
+	c->backoff = 0;
+}
+
+void drbd_compress_free(struct drbd_connection *connection)
+{
+	struct drbd_compress *c = &connection->compress;
+
+	crypto_free_comp(c->tfm);
+	crypto_free_comp(c->peer_tfm);
+	vfree(c->buf);
+	kfree(c->chunk_in);
+	kfree(c->chunk_out);
+	kfree(c->peer_buf);
+
+	c->tfm = NULL;
+	c->peer_tfm = NULL;
+	c->buf = NULL;
+	c->chunk_in = NULL;
+	c->chunk_out = NULL;
+	c->peer_buf = NULL;
+}
+
+static int compress_chunk(struct drbd_compress *c)
+{
+	unsigned int len = c->in_len;
+	unsigned int dlen = 2 * DRBD_COMPRESS_CHUNK;
+	char *out = c->buf + c->out_len;
+
+	if (c->out_len + sizeof(__be16) + len > c->limit)
+		return -ENOSPC;
+
+	if (crypto_comp_compress(c->tfm, c->chunk_in, len, c->chunk_out, &dlen) ||
+	    dlen >= len - len / 16) {
+		put_unaligned_be16(0, out);
+		memcpy(out + sizeof(__be16), c->chunk_in, len);
+		dlen = len;
+		c->stored_chunks++;
+	} else {
+		put_unaligned_be16(dlen, out);
+		memcpy(out + sizeof(__be16), c->chunk_out, dlen);
+	}
+	c->out_len += sizeof(__be16) + dlen;
+	c->in_len = 0;
+	c->chunks++;
+	return 0;
+}
+
+static int compress_feed(struct drbd_compress *c, const char *data, unsigned int len)
+{
+	while (len) {
+		unsigned int l = min_t(unsigned int, len, DRBD_COMPRESS_CHUNK - c->in_len);
+		int err;
+
+		memcpy(c->chunk_in + c->in_len, data, l);
+		c->in_len += l;
+		data += l;
+		len -= l;
+		if (c->in_len == DRBD_COMPRESS_CHUNK) {
+			err = compress_chunk(c);
+			if (err)
+				return err;
+		}
+	}
+	return 0;
+}
+
+static bool compress_begin(struct drbd_connection *connection, unsigned int size)
+{
+	struct drbd_compress *c = &connection->compress;
+
+	if (!c->tfm || !(connection->agreed_features & DRBD_FF_COMPRESS) || !size)
+		return false;
+
+	if (c->skip) {
+		c->skip--;
+		c->skipped_bytes += size;
+		return false;
+	}
+
+	c->in_len = 0;
+	c->out_len = sizeof(struct p_compressed);
+	c->limit = c->out_len + size - size / 8;
+	return true;
+}
+
+static unsigned int compress_end(struct drbd_connection *connection, unsigned int size, int err)
+{
+	struct drbd_compress *c = &connection->compress;
+	struct p_compressed *p = (struct p_compressed *)c->buf;
+
+	if (!err && c->in_len)
+		err = compress_chunk(c);
+	if (err) {
+		c->backoff = c->backoff ? min(c->backoff * 2, DRBD_COMPRESS_BACKOFF_MAX) : 1;
+		c->skip = c->backoff;
+		c->incompressible_bytes += size;
+		return 0;
+	}
+	c->backoff = 0;
+
+	p->alg = c->alg;
+	memset(p->pad, 0, sizeof(p->pad));
+	p->size = cpu_to_be32(size);
+
+	c->raw_bytes += size;
+	c->wire_bytes += c->out_len;
+	return c->out_len;
+}
+
+/**
+ * drbd_compress_bio() - Compress the payload of a write into compress.buf
+ * @connection:	DRBD connection, caller holds its mutex[DATA_STREAM].
+ * @bio:	the bio to compress.
+ *
+ * Returns the size of the compressed payload including its p_compressed
+ * header, or 0 if it is to be sent uncompressed.
+ */
+unsigned int drbd_compress_bio(struct drbd_connection *connection, struct bio *bio)
+{
+	struct drbd_compress *c = &connection->compress;
+	unsigned int size = bio->bi_iter.bi_size;
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	int err = 0;
+
+	if (!compress_begin(connection, size))
+		return 0;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		char *src = kmap_atomic(bvec.bv_page);
+
+		err = compress_feed(c, src + bvec.bv_offset, bvec.bv_len);
+		kunmap_atomic(src);
+		if (err)
+			break;
+	}
+	return compress_end(connection, size, err);
+}
+
+/* Same as drbd_compress_bio(), for the page chain of a peer request */
+unsigned int drbd_compress_pages(struct drbd_connection *connection,
+				 struct page *page, unsigned int size)
+{
+	struct drbd_compress *c = &connection->compress;
+	unsigned int len = size;
+	int err = 0;
+
+	if (!compress_begin(connection, size))
+		return 0;
+
+	page_chain_for_each(page) {
+		unsigned int l = min_t(unsigned int, len, PAGE_SIZE);
+		char *src = kmap_atomic(page);
+
+		err = compress_feed(c, src, l);
+		kunmap_atomic(src);
+		if (err)
+			break;
+		len -= l;
+	}
+	return compress_end(connection, size, err);
+}
+
+/* Make sure we can decompress what the peer compressed with @alg.
+ * Only called from the receiver thread. */
+int drbd_compress_peer_alg(struct drbd_connection *connection, u8 alg)
+{
+	struct drbd_compress *c = &connection->compress;
+	const char *name = drbd_compress_alg_name(alg);
+	struct crypto_comp *tfm;
+
+	if (c->peer_tfm && c->peer_alg == alg)
+		return 0;
+
+	if (!name) {
+		drbd_err(connection, "Peer uses unknown compression algorithm %u\n", alg);
+		return -EINVAL;
+	}
+
+	if (!c->peer_buf) {
+		/* compressed input, and decompressed output for bios */
+		c->peer_buf = kmalloc(2 * DRBD_COMPRESS_CHUNK, GFP_NOIO);
+		if (!c->peer_buf)
+			return -ENOMEM;
+	}
+
+	tfm = crypto_alloc_comp(name, 0, 0);
+	if (IS_ERR(tfm)) {
+		drbd_err(connection, "Can not allocate \"%s\" for decompression: %ld\n",
+			 name, PTR_ERR(tfm));
+		return PTR_ERR(tfm);
+	}
+	crypto_free_comp(c->peer_tfm);
+	c->peer_tfm = tfm;
+	c->peer_alg = alg;
+	return 0;
+}
+
+int drbd_decompress_chunk(struct drbd_connection *connection,
+			  const void *src, unsigned int slen, void *dst, unsigned int dlen)
+{
+	unsigned int len = dlen;
+	int err;
+
+	err = crypto_comp_decompress(connection->compress.peer_tfm, src, slen, dst, &len);
+	if (!err && len != dlen)
+		err = -EINVAL;
+	if (err)
+		drbd_err(connection, "Decompression of a %u byte chunk failed: %d\n", slen, err);
+	return err;
+}
@@ -0,0 +1,245 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+   drbd_csum_cache.c
+
+   This file is part of DRBD by Philipp Reisner and Lars Ellenberg.
+
+   Digest cache for online verify and checksum based resync.
+
+   Digests of blocks read for verify or checksum based resync are kept,
+   so that the next run can skip reading and hashing blocks that were
+   not written to in the meantime.  Each resync extent has a generation
+   counter, which every write to it bumps on submission and on
+   completion.  A digest is only valid while the generation it was read
+   under is current.  Generation counters are hashed by extent number,
+   so on very large devices a write may invalidate more than its own
+   extent, which is safe.
+
+   Note that a cached digest is by definition not read from disk again,
+   so a verify served from the cache can not find silent corruption of
+   the backing device in those blocks.  That is why it is off by default.
+
+ */
+
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/hash.h>
+#include "drbd_int.h"
+
+#define DRBD_CSUM_CACHE_HASH_BITS	12
+#define DRBD_CSUM_CACHE_GENS		16384	/* covers 2 TiB without aliasing */
+
+struct drbd_csum_cache_entry {
+	struct hlist_node hash;
+	struct list_head lru;
+	sector_t sector;
+	unsigned int size;
+	unsigned int gen;
+	struct shash_alg *alg;
+	int digest_size;
+	u8 digest[];
+};
+
+static atomic_t *extent_gen(struct drbd_csum_cache *cache, sector_t sector)
+{
+	return &cache->gen[(sector >> (BM_EXT_SHIFT - 9)) & (DRBD_CSUM_CACHE_GENS - 1)];
+}
+
+/* A block may span two extents, the sum changes whenever one of them does */
+static unsigned int block_gen(struct drbd_csum_cache *cache, sector_t sector, unsigned int size)
+{
+	sector_t last = sector + (size >> 9) - 1;
+	unsigned int gen = atomic_read(extent_gen(cache, sector));
+
+	if ((last >> (BM_EXT_SHIFT - 9)) != (sector >> (BM_EXT_SHIFT - 9)))
+		gen += atomic_read(extent_gen(cache, last));
+	return gen;
+}
+
+static struct hlist_head *block_hash(struct drbd_csum_cache *cache, sector_t sector)
+{
+	return &cache->hash[hash_64(sector, DRBD_CSUM_CACHE_HASH_BITS)];
+}
+
+void drbd_csum_cache_init(struct drbd_device *device)
+{
+	struct drbd_csum_cache *cache = &device->csum_cache;
+	int i;
+
+	spin_lock_init(&cache->lock);
+	INIT_LIST_HEAD(&cache->lru);
+	if (!drbd_csum_cache_entries)
+		return;
+
+	cache->hash = kvmalloc_array(1 << DRBD_CSUM_CACHE_HASH_BITS, sizeof(*cache->hash),
+				     GFP_KERNEL);
+	cache->gen = kvmalloc_array(DRBD_CSUM_CACHE_GENS, sizeof(*cache->gen), GFP_KERNEL);
+	if (!cache->hash || !cache->gen) {
+		drbd_warn(device, "Can not allocate the checksum cache\n");
+		kvfree(cache->hash);
+		kvfree(cache->gen);
+		cache->hash = NULL;
+		cache->gen = NULL;
+		return;
+	}
+	for (i = 0; i < 1 << DRBD_CSUM_CACHE_HASH_BITS; i++)
+		INIT_HLIST_HEAD(&cache->hash[i]);
+	for (i = 0; i < DRBD_CSUM_CACHE_GENS; i++)
+		atomic_set(&cache->gen[i], 0);
+	cache->max_entries = drbd_csum_cache_entries;
+}
+
+static void drop_entry(struct drbd_csum_cache *cache, struct drbd_csum_cache_entry *e)
+{
+	hlist_del(&e->hash);
+	list_del(&e->lru);
+	cache->nr_entries--;
+	kfree(e);
+}
+
+/* On detach: the next backing device may contain anything */
+void drbd_csum_cache_clear(struct drbd_device *device)
+{
+	struct drbd_csum_cache *cache = &device->csum_cache;
+	struct drbd_csum_cache_entry *e, *tmp;
+
+	if (!cache->hash)
+		return;
+
+	spin_lock(&cache->lock);
+	list_for_each_entry_safe(e, tmp, &cache->lru, lru)
+		drop_entry(cache, e);
+	spin_unlock(&cache->lock);
+}
+
+void drbd_csum_cache_free(struct drbd_device *device)
+{
+	struct drbd_csum_cache *cache = &device->csum_cache;
+
+	drbd_csum_cache_clear(device);
+	kvfree(cache->hash);
+	kvfree(cache->gen);
+	cache->hash = NULL;
+	cache->gen = NULL;
+}
+
+/* Called for every write to the backing device, when it is submitted and
+ * when it completes.  May be called from any context. */
+void drbd_csum_cache_invalidate(struct drbd_device *device, sector_t sector, unsigned int size)
+{
+	struct drbd_csum_cache *cache = &device->csum_cache;
+	sector_t ext, last_ext;
+	unsigned int n = 0;
+
+	if (!cache->gen)
+		return;
+
+	ext = sector >> (BM_EXT_SHIFT - 9);
+	last_ext = (sector + (size >> 9) - (size ? 1 : 0)) >> (BM_EXT_SHIFT - 9);
+	for (; ext <= last_ext && n < DRBD_CSUM_CACHE_GENS; ext++, n++)
+		atomic_inc(&cache->gen[ext & (DRBD_CSUM_CACHE_GENS - 1)]);
+}
+
+/**
+ * drbd_csum_cache_lookup() - Find the digest of a block about to be read
+ * @peer_req:	the read of a verify or checksum based resync request.
+ * @tfm:	the digest algorithm.
+ * @digest_size: the size of the digest, more than one with DRBD_FF_OV_TREE.
+ *
+ * On a hit, peer_req->csum is set, and the caller need not read the block.
+ * On a miss, the current generation of the block is recorded, so that the
+ * digest computed after the read can be stored with drbd_csum_cache_store().
+ */
+bool drbd_csum_cache_lookup(struct drbd_peer_request *peer_req,
+			    struct crypto_shash *tfm, int digest_size)
+{
+	struct drbd_csum_cache *cache = &peer_req->peer_device->device->csum_cache;
+	struct shash_alg *alg = crypto_shash_alg(tfm);
+	sector_t sector = peer_req->i.sector;
+	unsigned int size = peer_req->i.size;
+	struct drbd_csum_cache_entry *e;
+	struct digest_info *di;
+	unsigned int gen;
+
+	if (!cache->hash || peer_req->csum)
+		return false;
+
+	/* before looking at the entry: a write racing with us makes it stale */
+	gen = block_gen(cache, sector, size);
+
+	di = kmalloc(sizeof(*di) + digest_size, GFP_NOIO);
+	if (!di)
+		return false;
+
+	spin_lock(&cache->lock);
+	hlist_for_each_entry(e, block_hash(cache, sector), hash) {
+		if (e->sector != sector || e->size != size ||
+		    e->alg != alg || e->digest_size != digest_size)
+			continue;
+		if (e->gen != gen) {
+			drop_entry(cache, e);
+			break;
+		}
+		list_move(&e->lru, &cache->lru);
+		di->digest_size = digest_size;
+		di->digest = di + 1;
+		memcpy(di->digest, e->digest, digest_size);
+		cache->hits++;
+		spin_unlock(&cache->lock);
+		peer_req->csum = di;
+		return true;
+	}
+	cache->misses++;
+	spin_unlock(&cache->lock);
+	kfree(di);
+
+	peer_req->csum_gen = gen;
+	peer_req->flags |= EE_CSUM_CACHE;
+	return false;
+}
+
+/* Remember the digest of a block read after drbd_csum_cache_lookup() missed */
+void drbd_csum_cache_store(struct drbd_peer_request *peer_req,
+			   struct crypto_shash *tfm, const void *digest, int digest_size)
+{
+	struct drbd_csum_cache *cache = &peer_req->peer_device->device->csum_cache;
+	struct shash_alg *alg = crypto_shash_alg(tfm);
+	sector_t sector = peer_req->i.sector;
+	unsigned int size = peer_req->i.size;
+	struct drbd_csum_cache_entry *e, *new;
+
+	if (!(peer_req->flags & EE_CSUM_CACHE) || !cache->hash ||
+	    (peer_req->flags & EE_WAS_ERROR))
+		return;
+	peer_req->flags &= ~EE_CSUM_CACHE;
+
+	new = kmalloc(sizeof(*new) + digest_size, GFP_NOIO);
+	if (!new)
+		return;
+	new->sector = sector;
+	new->size = size;
+	new->gen = peer_req->csum_gen;
+	new->alg = alg;
+	new->digest_size = digest_size;
+	memcpy(new->digest, digest, digest_size);
+
+	spin_lock(&cache->lock);
+	/* written to while we read it */
+	if (block_gen(cache, sector, size) != new->gen) {
+		spin_unlock(&cache->lock);
+		kfree(new);
+		return;
+	}
+	hlist_for_each_entry(e, block_hash(cache, sector), hash) {
+		if (e->sector == sector && e->size == size) {
+			drop_entry(cache, e);
+			break;
+		}
+	}
+	if (cache->nr_entries >= cache->max_entries)
+		drop_entry(cache, list_last_entry(&cache->lru, struct drbd_csum_cache_entry, lru));
+	hlist_add_head(&new->hash, block_hash(cache, sector));
+	list_add(&new->lru, &cache->lru);
+	cache->nr_entries++;
+	spin_unlock(&cache->lock);
+}
@@ -24,6 +24,7 @@ static struct dentry *drbd_debugfs_refcounts;
 static struct dentry *drbd_debugfs_resources;
 static struct dentry *drbd_debugfs_minors;
 static struct dentry *drbd_debugfs_compat;
+static struct dentry *drbd_debugfs_page_pool;
 
 #ifdef CONFIG_DRBD_TIMING_STATS
 static void seq_print_age_or_dash(struct seq_file *m, bool valid, ktime_t dt)
@@ -799,6 +800,7 @@ static int connection_transport_show(struct seq_file *m, void *ignored)
 		seq_printf(m, "  corked: %d\n", test_bit(CORKED + i, &connection->flags));
 		seq_printf(m, "  unsent: %ld bytes\n", (long)(sbuf->pos - sbuf->unsent));
 		seq_printf(m, "  allocated: %d bytes\n", sbuf->allocated_size);
+		seq_printf(m, "  pages: %u (%u queued)\n", sbuf->ring_size, sbuf->nr_pending);
 	}
 
 	seq_printf(m, "\ntransport_type: %s\n", transport->class->name);
@@ -808,6 +810,119 @@ static int connection_transport_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static void seq_print_compression_ratio(struct seq_file *m, const char *dir, u64 raw, u64 wire)
+{
+	seq_printf(m, "%s: %llu bytes -> %llu bytes", dir, raw, wire);
+	if (raw)
+		seq_printf(m, " (%llu%%)", div64_u64(wire * 100, raw));
+	seq_putc(m, '\n');
+}
+
+static int connection_compression_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_connection *connection = m->private;
+	struct drbd_compress *c = &connection->compress;
+	const char *alg = drbd_compress_alg_name(c->alg);
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "algorithm: %s\n", c->tfm ? alg : "none");
+	seq_printf(m, "agreed: %s\n",
+		   connection->agreed_features & DRBD_FF_COMPRESS ? "yes" : "no");
+	seq_print_compression_ratio(m, "sent", c->raw_bytes, c->wire_bytes);
+	seq_printf(m, "  chunks: %llu (%llu stored)\n", c->chunks, c->stored_chunks);
+	seq_printf(m, "  incompressible: %llu bytes\n", c->incompressible_bytes);
+	seq_printf(m, "  skipped: %llu bytes (backoff %u)\n", c->skipped_bytes, c->backoff);
+	seq_print_compression_ratio(m, "received", c->peer_raw_bytes, c->peer_wire_bytes);
+	return 0;
+}
+
+static int connection_request_timeout_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_connection *connection = m->private;
+	unsigned long deadline = READ_ONCE(connection->req_deadline_jif);
+	unsigned long jif = jiffies;
+	struct drbd_request *req;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "timeout: %u ms\n", jiffies_to_msecs(READ_ONCE(connection->req_timeout_jif)));
+	seq_puts(m, "oldest deadline: ");
+	if (!deadline)
+		seq_puts(m, "none\n");
+	else if (time_after(deadline, jif))
+		seq_printf(m, "in %u ms\n", jiffies_to_msecs(deadline - jif));
+	else
+		seq_printf(m, "%u ms ago\n", jiffies_to_msecs(jif - deadline));
+	seq_printf(m, "timer: %s\n", timer_pending(&connection->request_timer) ? "pending" : "idle");
+
+	rcu_read_lock();
+	req = READ_ONCE(connection->req_ack_pending);
+	if (!req)
+		req = READ_ONCE(connection->req_not_net_done);
+	if (req) {
+		seq_puts(m, "\nminor\tvnr\t" RQ_HDR);
+		seq_print_minor_vnr_req(m, req, ktime_get(), jif);
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+static const char * const drbd_cong_decision_names[] = {
+	[CONG_FILL] = "cong-fill",
+	[CONG_EXTENTS] = "cong-extents",
+	[CONG_PREDICTED] = "predicted",
+	[CONG_CATCH_UP] = "catch-up",
+	[CONG_STAY_AHEAD] = "stay-ahead",
+};
+
+static void seq_print_ms(struct seq_file *m, unsigned int ms)
+{
+	if (ms == UINT_MAX)
+		seq_puts(m, "-");
+	else
+		seq_printf(m, "%u", ms);
+}
+
+static int connection_congestion_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_connection *connection = m->private;
+	struct drbd_cong_model *cm = &connection->cong;
+	unsigned long jif = jiffies;
+	unsigned int i, n;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "horizon: %u ms\n", drbd_cong_horizon_ms);
+	seq_printf(m, "catch up: %u ms\n", drbd_ahead_catch_up_ms);
+
+	spin_lock_irq(&cm->lock);
+	seq_printf(m, "writes: %u KiB/s\n", cm->write_rate / 2);
+	seq_printf(m, "acked: %u KiB/s\n", cm->drain_rate / 2);
+	seq_printf(m, "backlog: %u KiB\n", cm->backlog / 2);
+	seq_printf(m, "send buffer: %u of %u bytes\n", cm->sndbuf_used, cm->sndbuf_size);
+	seq_printf(m, "sampled: %u ms ago\n", jiffies_to_msecs(jif - cm->sample_jif));
+
+	n = min_t(unsigned int, cm->events, DRBD_CONG_HISTORY);
+	seq_printf(m, "\ndecisions: %u\n", cm->events);
+	if (n)
+		seq_puts(m, "age_ms\tdecision\tbacklog_kb\twrites_kbps\tacked_kbps\teta_ms\n");
+	for (i = 1; i <= n; i++) {
+		struct drbd_cong_event *ev = &cm->history[(cm->events - i) % DRBD_CONG_HISTORY];
+
+		seq_printf(m, "%u\t%s\t%u\t%u\t%u\t",
+			   jiffies_to_msecs(jif - ev->jif), drbd_cong_decision_names[ev->what],
+			   ev->backlog / 2, ev->write_rate / 2, ev->drain_rate / 2);
+		seq_print_ms(m, ev->eta_ms);
+		seq_putc(m, '\n');
+	}
+	spin_unlock_irq(&cm->lock);
+	return 0;
+}
+
 static int connection_debug_show(struct seq_file *m, void *ignored)
 {
 	struct drbd_connection *connection = m->private;
@@ -898,6 +1013,9 @@ drbd_debugfs_connection_attr(oldest_requests)
 drbd_debugfs_connection_attr(callback_history)
 drbd_debugfs_connection_attr(transport)
 drbd_debugfs_connection_attr(debug)
+drbd_debugfs_connection_attr(compression)
+drbd_debugfs_connection_attr(request_timeout)
+drbd_debugfs_connection_attr(congestion)
 
 void drbd_debugfs_connection_add(struct drbd_connection *connection)
 {
@@ -919,6 +1037,9 @@ void drbd_debugfs_connection_add(struct drbd_connection *connection)
 	conn_dcf(oldest_requests);
 	conn_dcf(transport);
 	conn_dcf(debug);
+	conn_dcf(compression);
+	conn_dcf(request_timeout);
+	conn_dcf(congestion);
 
 	idr_for_each_entry(&connection->peer_devices, peer_device, vnr) {
 		if (!peer_device->debugfs_peer_dev)
@@ -928,6 +1049,9 @@ void drbd_debugfs_connection_add(struct drbd_connection *connection)
 
 void drbd_debugfs_connection_cleanup(struct drbd_connection *connection)
 {
+	drbd_debugfs_remove(&connection->debugfs_conn_congestion);
+	drbd_debugfs_remove(&connection->debugfs_conn_request_timeout);
+	drbd_debugfs_remove(&connection->debugfs_conn_compression);
 	drbd_debugfs_remove(&connection->debugfs_conn_debug);
 	drbd_debugfs_remove(&connection->debugfs_conn_transport);
 	drbd_debugfs_remove(&connection->debugfs_conn_callback_history);
@@ -963,15 +1087,48 @@ static void seq_printf_nice_histogram(struct seq_file *m, unsigned *hist, unsign
 }
 
 
+static unsigned histogram_max(unsigned *hist, unsigned const n)
+{
+	unsigned i, max = 0;
+
+	for (i = 0; i < n; i++)
+		if (hist[i] > max)
+			max = hist[i];
+	return max;
+}
+
+static void seq_printf_bar(struct seq_file *m, unsigned count, unsigned max)
+{
+	unsigned v = (count * 60UL + max-1) / max;
+
+	seq_printf(m, " : %10u : %-60.*s\n", count, v,
+		"############################################################");
+}
+
 static int device_act_log_histogram_show(struct seq_file *m, void *ignored)
 {
 	struct drbd_device *device = m->private;
+	unsigned i, max;
 
 	/* BUMP me if you change the file format/content/presentation */
-	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "v: %u\n\n", 1);
 
 	if (get_ldev_if_state(device, D_FAILED)) {
 		seq_printf_nice_histogram(m, device->al_histogram, AL_UPDATES_PER_TRANSACTION);
+
+		seq_puts(m, "\ntransactions written together (group commit)\n");
+		max = histogram_max(device->al_group_histogram, DRBD_AL_GROUP_HIST);
+		for (i = 1; max && i < DRBD_AL_GROUP_HIST; i++) {
+			seq_printf(m, "%2u%s", i, i == DRBD_AL_GROUP_HIST - 1 ? "+" : " ");
+			seq_printf_bar(m, device->al_group_histogram[i], max);
+		}
+
+		seq_puts(m, "\ntransaction write latency, usec\n");
+		max = histogram_max(device->al_latency_histogram, DRBD_AL_LATENCY_HIST);
+		for (i = 0; max && i < DRBD_AL_LATENCY_HIST; i++) {
+			seq_printf(m, "<%8lu", 1UL << i);
+			seq_printf_bar(m, device->al_latency_histogram[i], max);
+		}
 		put_ldev(device);
 	}
 	return 0;
@@ -1048,6 +1205,44 @@ static int device_md_io_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static int device_bitmap_summary_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+
+	if (!get_ldev_if_state(device, D_FAILED))
+		return -ENODEV;
+	drbd_bm_seq_printf_summary(m, device);
+	put_ldev(device);
+
+	return 0;
+}
+
+static int device_submit_stats_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	struct submit_worker *submit = &device->submit;
+	unsigned long batches = submit->batches;
+	unsigned int i;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "batches: %lu\n", batches);
+	seq_printf(m, "writes: %lu\n", submit->batched_writes);
+	seq_printf(m, "avg writes per batch: %lu\n",
+		   batches ? submit->batched_writes / batches : 0);
+	seq_printf(m, "avg queue wait: %llu usec\n",
+		   batches ? div64_u64(submit->wait_us_total, batches) : 0);
+	seq_printf(m, "max queue wait: %llu usec\n", submit->wait_us_max);
+
+	seq_puts(m, "\nwrites per batch\n");
+	for (i = 0; i < DRBD_SUBMIT_BATCH_HIST; i++)
+		seq_printf(m, "%4u%s : %10u\n", 1U << i,
+			   i == DRBD_SUBMIT_BATCH_HIST - 1 ? "+" : " ", submit->batch_hist[i]);
+
+	return 0;
+}
+
 static int device_data_gen_id_show(struct seq_file *m, void *ignored)
 {
 	struct drbd_device *device = m->private;
@@ -1199,6 +1394,24 @@ static int device_attr_release(struct inode *inode, struct file *file)
 	return single_release(inode, file);
 }
 
+static int device_csum_cache_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	struct drbd_csum_cache *cache = &device->csum_cache;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	if (!cache->hash) {
+		seq_puts(m, "disabled\n");
+		return 0;
+	}
+	seq_printf(m, "entries: %u/%u\n", cache->nr_entries, cache->max_entries);
+	seq_printf(m, "hits: %lu\n", cache->hits);
+	seq_printf(m, "misses: %lu\n", cache->misses);
+	return 0;
+}
+
 #define __drbd_debugfs_device_attr(name, write_fn)				\
 static int device_ ## name ## _open(struct inode *inode, struct file *file)	\
 {										\
@@ -1224,6 +1437,9 @@ drbd_debugfs_device_attr(io_frozen)
 drbd_debugfs_device_attr(ed_gen_id)
 drbd_debugfs_device_attr(openers)
 drbd_debugfs_device_attr(md_io)
+drbd_debugfs_device_attr(bitmap_summary)
+drbd_debugfs_device_attr(submit_stats)
+drbd_debugfs_device_attr(csum_cache)
 #ifdef CONFIG_DRBD_TIMING_STATS
 __drbd_debugfs_device_attr(req_timing, device_req_timing_write)
 #endif
@@ -1263,6 +1479,9 @@ void drbd_debugfs_device_add(struct drbd_device *device)
 	vol_dcf(ed_gen_id);
 	vol_dcf(openers);
 	vol_dcf(md_io);
+	vol_dcf(bitmap_summary);
+	vol_dcf(submit_stats);
+	vol_dcf(csum_cache);
 #ifdef CONFIG_DRBD_TIMING_STATS
 	drbd_dcf(device->debugfs_vol, device, req_timing, 0600);
 #endif
@@ -1291,6 +1510,9 @@ void drbd_debugfs_device_cleanup(struct drbd_device *device)
 	drbd_debugfs_remove(&device->debugfs_vol_ed_gen_id);
 	drbd_debugfs_remove(&device->debugfs_vol_openers);
 	drbd_debugfs_remove(&device->debugfs_vol_md_io);
+	drbd_debugfs_remove(&device->debugfs_vol_bitmap_summary);
+	drbd_debugfs_remove(&device->debugfs_vol_submit_stats);
+	drbd_debugfs_remove(&device->debugfs_vol_csum_cache);
 #ifdef CONFIG_DRBD_TIMING_STATS
 	drbd_debugfs_remove(&device->debugfs_vol_req_timing);
 #endif
@@ -1552,6 +1774,8 @@ static int peer_device_proc_drbd_show(struct seq_file *m, void *ignored)
 	union drbd_state state;
 	const char *sn;
 	struct net_conf *nc;
+	u64 oos_writes, oos_packets;
+	unsigned int oos_nr;
 	char wp;
 
 	state.disk = device->disk_state[NOW];
@@ -1626,6 +1850,14 @@ static int peer_device_proc_drbd_show(struct seq_file *m, void *ignored)
 		/* nr extents needed to satisfy the above in the worst case */
 		atomic_read(&device->wait_for_actlog_ecnt));
 
+	spin_lock(&peer_device->oos_batch.lock);
+	oos_writes = peer_device->oos_batch.writes;
+	oos_packets = peer_device->oos_batch.packets;
+	oos_nr = peer_device->oos_batch.nr;
+	spin_unlock(&peer_device->oos_batch.lock);
+	seq_printf(m, "\tcoalesced out-of-sync: %llu writes in %llu packets, %u extents pending\n",
+		   oos_writes, oos_packets, oos_nr);
+
 	rcu_read_unlock();
 
 	return 0;
@@ -1741,10 +1973,58 @@ static const struct file_operations drbd_compat_fops = {
 	.release = single_release,
 };
 
+static int drbd_page_pool_show(struct seq_file *m, void *ignored)
+{
+	unsigned long hits, misses, refills, drains, steals;
+	unsigned int count;
+	int cpu;
+
+	seq_puts(m, "content and format of this will change without notice\n");
+	seq_printf(m, "vacant: %d\n", drbd_pp_vacant);
+	seq_printf(m, "%4s %8s %12s %12s %12s %12s %12s\n",
+		   "cpu", "pages", "hits", "misses", "refills", "drains", "steals");
+
+	if (!drbd_pp_caches)
+		return 0;
+
+	for_each_possible_cpu(cpu) {
+		struct drbd_pp_cache *cache = per_cpu_ptr(drbd_pp_caches, cpu);
+
+		spin_lock(&cache->lock);
+		count = cache->count;
+		hits = cache->hits;
+		misses = cache->misses;
+		refills = cache->refills;
+		drains = cache->drains;
+		steals = cache->steals;
+		spin_unlock(&cache->lock);
+
+		if (!(count | hits | misses | refills | drains | steals))
+			continue;
+		seq_printf(m, "%4d %8u %12lu %12lu %12lu %12lu %12lu\n",
+			   cpu, count, hits, misses, refills, drains, steals);
+	}
+	return 0;
+}
+
+static int drbd_page_pool_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, drbd_page_pool_show, NULL);
+}
+
+static const struct file_operations drbd_page_pool_fops = {
+	.owner = THIS_MODULE,
+	.open = drbd_page_pool_open,
+	.llseek = seq_lseek,
+	.read = seq_read,
+	.release = single_release,
+};
+
 /* not __exit, may be indirectly called
  * from the module-load-failure path as well. */
 void drbd_debugfs_cleanup(void)
 {
+	drbd_debugfs_remove(&drbd_debugfs_page_pool);
 	drbd_debugfs_remove(&drbd_debugfs_compat);
 	drbd_debugfs_remove(&drbd_debugfs_resources);
 	drbd_debugfs_remove(&drbd_debugfs_minors);
@@ -1774,4 +2054,7 @@ void __init drbd_debugfs_init(void)
 
 	dentry = debugfs_create_file("compat", 0444, drbd_debugfs_root, NULL, &drbd_compat_fops);
 	drbd_debugfs_compat = dentry;
+
+	dentry = debugfs_create_file("page_pool", 0444, drbd_debugfs_root, NULL, &drbd_page_pool_fops);
+	drbd_debugfs_page_pool = dentry;
 }
@@ -45,6 +45,15 @@
 #include "drbd_transport.h"
 #include "drbd_polymorph_printk.h"
 
+/* Feature flags, packet flags, packet layouts and meta data flags and magics
+ * are allocated in drbd-headers, not here, so that they stay unique across
+ * the module, drbd-utils and drbdmeta.  Catch a drbd-headers submodule that
+ * is too old. */
+#if !defined(DRBD_FF_COMPRESS) || !defined(DRBD_FF_OV_TREE) || \
+	!defined(DRBD_FF_OOS_RANGES) || !defined(DRBD_MD_MAGIC_09_AL_EXT)
+#error "drbd-headers too old, update the submodule"
+#endif
+
 #ifdef __CHECKER__
 # define __protected_by(x)       __attribute__((require_context(x,1,999,"rdwr")))
 # define __protected_read_by(x)  __attribute__((require_context(x,1,999,"read")))
@@ -60,6 +69,16 @@
 /* module parameter, defined in drbd_main.c */
 extern unsigned int drbd_minor_count;
 extern unsigned int drbd_protocol_version_min;
+extern bool drbd_parallel_peer_submit;
+extern bool drbd_al_group_commit;
+extern bool drbd_adaptive_read_balancing;
+extern bool drbd_send_zeroes;
+extern unsigned int drbd_csum_cache_entries;
+extern char drbd_compress_alg[];
+extern bool drbd_bitmap_sparse;
+extern unsigned int drbd_cong_horizon_ms;
+extern unsigned int drbd_ahead_catch_up_ms;
+extern bool drbd_oos_batch;
 
 #ifdef CONFIG_DRBD_FAULT_INJECTION
 extern int drbd_enable_faults;
@@ -251,6 +270,17 @@ extern u64 directly_connected_nodes(struct drbd_resource *, enum which_state);
 	 typecheck(u64, b) && \
 	((s64)(a) - (s64)(b) > 0))
 
+/* Moving averages of the reads served by the local disk or by one peer,
+ * updated on completion without locking; an occasionally lost update does
+ * not matter here. */
+struct drbd_rb_stats {
+	unsigned long latency_ns;	/* 1/8 weight to the latest read */
+	unsigned int depth;		/* requests in flight when issued, << 4 */
+	unsigned long last_jif;		/* of the latest completion */
+	unsigned long probe_jif;	/* probe in flight since, see rb_probe() */
+	u64 reads;
+};
+
 /* An application I/O request.
  *
  * Fields marked as "immutable" may only be modified when the request is
@@ -318,6 +348,14 @@ struct drbd_request {
 	unsigned long pre_submit_jif;
 	unsigned long pre_send_jif[DRBD_PEERS_MAX];
 
+	/* for adaptive read balancing, see drbd_rb_account() */
+	ktime_t rb_start_kt;
+	unsigned int rb_depth;
+
+	/* Write payload all zero?  Scanned once by the first sender to look,
+	 * see drbd_req_all_zero(). */
+	u8 payload_zero;
+
 #ifdef CONFIG_DRBD_TIMING_STATS
 	/* for DRBD internal statistics */
 	ktime_t start_kt;
@@ -436,6 +474,13 @@ struct drbd_peer_request {
 	atomic_t pending_bios;
 	struct drbd_interval i;
 	unsigned long flags;	/* see comments on ee flag bits below */
+
+	/* reads for checksum based resync and online verify:
+	 * digest computed on drbd_csum_wq, see drbd_csum_work_fn() */
+	struct work_struct csum_work;
+	struct digest_info *csum;
+	unsigned int csum_gen; /* see drbd_csum_cache_lookup() */
+
 	union {
 		struct { /* regular peer_request */
 			struct drbd_epoch *epoch; /* for writes */
@@ -526,6 +571,9 @@ enum {
 
 	/* Hold reference in activity log */
 	__EE_IN_ACTLOG,
+
+	/* csum_gen is valid, the digest may go into the csum cache */
+	__EE_CSUM_CACHE,
 };
 #define EE_MAY_SET_IN_SYNC     (1<<__EE_MAY_SET_IN_SYNC)
 #define EE_SET_OUT_OF_SYNC     (1<<__EE_SET_OUT_OF_SYNC)
@@ -544,6 +592,7 @@ enum {
 #define EE_APPLICATION		(1<<__EE_APPLICATION)
 #define EE_RS_THIN_REQ		(1<<__EE_RS_THIN_REQ)
 #define EE_IN_ACTLOG		(1<<__EE_IN_ACTLOG)
+#define EE_CSUM_CACHE		(1<<__EE_CSUM_CACHE)
 
 /* flag bits per device */
 enum device_flag {
@@ -573,6 +622,7 @@ enum device_flag {
         DESTROY_DISK,           /* tell worker to close backing devices and destroy related structures. */
 	MD_SYNC,		/* tell worker to call drbd_md_sync() */
 	MAKE_NEW_CUR_UUID,	/* tell worker to ping peers and eventually write new current uuid */
+	BITMAP_LOST_BITS,	/* tell worker that bits could not be set in a sparse bitmap */
 
 	HAVE_LDEV,
 	STABLE_RESYNC,		/* One peer_device finished the resync stable! */
@@ -653,6 +703,7 @@ enum bm_flag {
 
 	BM_LOCK_SINGLE_SLOT = 0x10,
 	BM_ON_DAX_PMEM = 0x10000,
+	BM_SPARSE_FAILED = 0x20000, /* bits could not be set, see bm_sparse_check_failed() */
 };
 
 struct drbd_bitmap {
@@ -685,6 +736,33 @@ struct drbd_bitmap {
 	unsigned int n_bitmap_hints;
 	unsigned int al_bitmap_hints[2*AL_UPDATES_PER_TRANSACTION];
 
+	/* Second level summary, per peer slot one bit per bitmap page.
+	 * A clear bit means that slot has no bits set on that page, so
+	 * find_next and count can skip it.  May be NULL, then nothing is
+	 * skipped.  Protected by bm_lock, like the pages themselves. */
+	unsigned long *bm_summary;
+	unsigned long bm_summary_skipped; /* statistics, pages skipped */
+	unsigned long bm_summary_scanned; /* statistics, pages looked at */
+
+	/* Per page IO and writeout state, BM_PAGE_* in drbd_bitmap.c.  Not in
+	 * page->private, since pages of a sparse bitmap may be shared. */
+	unsigned long *bm_page_state;
+
+	/* Sparse bitmap: pages without bits set all point to the zero page,
+	 * pages with all bits set may point to bm_ones_page.  NULL if not
+	 * sparse. */
+	struct page *bm_ones_page;
+	mempool_t *bm_sparse_reserve; /* to unshare from completion context */
+	unsigned long bm_resident_pages; /* pages not shared */
+	unsigned long bm_sparse_nomem; /* statistics, failed to unshare */
+	unsigned long bm_sparse_lost; /* statistics, failed to set bits */
+	atomic_t bm_sparse_drops; /* pages marked BM_PAGE_SPARSE_DROP */
+
+	/* last read of the whole bitmap, reported to the attach request */
+	unsigned int bm_read_pages;
+	unsigned int bm_read_bios;
+	unsigned int bm_read_ms;
+
 	/* debugging aid, in case we are still racy somewhere */
 	char          *bm_why;
 	char          bm_task_comm[TASK_COMM_LEN];
@@ -729,6 +807,7 @@ struct drbd_md {
 	u32 al_stripes;
 	u32 al_stripe_size_4k;
 	u32 al_size_4k; /* cached product of the above */
+	unsigned int al_extent_shift; /* from flags, see drbd_md_decode() */
 };
 
 struct drbd_backing_dev {
@@ -861,15 +940,137 @@ struct drbd_thread_timing_details
 };
 #define DRBD_THREAD_DETAILS_HIST	16
 
+/* Upper limit for the send_buffer_pages module parameter */
+#define DRBD_SEND_BUFFER_PAGES_MAX 16
+
+/* A completely filled send buffer page, not yet handed to the transport */
+struct drbd_send_segment {
+	unsigned int slot;
+	unsigned int offset;
+	unsigned int size;
+};
+
 struct drbd_send_buffer {
 	struct page *page;  /* current buffer page for sending data */
 	char *unsent;  /* start of unsent area != pos if corked... */
 	char *pos; /* position within that page */
 	int allocated_size; /* currently allocated space */
 	int additional_size;  /* additional space to be added to next packet's size */
+
+	/* Ring of preallocated pages; page is ring[cur].  A full page is
+	 * queued in pending[] and sent with the next flush, while packing
+	 * continues in a ring page the network stack no longer references. */
+	struct page *ring[DRBD_SEND_BUFFER_PAGES_MAX];
+	unsigned int ring_size;
+	unsigned int cur;
+	unsigned long pending_mask; /* ring slots in pending[] */
+	unsigned int nr_pending;
+	struct drbd_send_segment pending[DRBD_SEND_BUFFER_PAGES_MAX];
+};
+
+/* In Ahead mode, the out-of-sync notifications of several writes are
+ * coalesced per extent of DRBD_OOS_EXTENT_BITS, into one P_OUT_OF_SYNC
+ * with a list of struct p_oos_range, see DRBD_FF_OOS_RANGES. */
+#define DRBD_OOS_BATCH_EXTENTS	8
+#define DRBD_OOS_BATCH_DELAY	(HZ / 50)
+
+struct drbd_oos_batch {
+	spinlock_t lock;
+	unsigned int nr;
+	unsigned long start_jif;	/* when the oldest extent was added */
+	struct {
+		unsigned long nr;	/* extent number */
+		DECLARE_BITMAP(bits, DRBD_OOS_EXTENT_BITS);
+	} ext[DRBD_OOS_BATCH_EXTENTS];
+
+	/* statistics */
+	u64 writes;
+	u64 packets;
+};
+
+struct drbd_compress {
+	/* sending side, protected by connection->mutex[DATA_STREAM] */
+	struct crypto_comp *tfm;
+	u8 alg;
+	char *buf;		/* compressed payload of one packet */
+	char *chunk_in;
+	char *chunk_out;
+	unsigned int in_len;
+	unsigned int out_len;
+	unsigned int limit;
+	unsigned int skip;	/* packets left to send uncompressed */
+	unsigned int backoff;
+
+	/* receiving side, only accessed from the receiver thread */
+	struct crypto_comp *peer_tfm;
+	u8 peer_alg;
+	char *peer_buf;
+
+	/* statistics, see connection_compression_show() */
+	u64 raw_bytes;
+	u64 wire_bytes;
+	u64 chunks;
+	u64 stored_chunks;
+	u64 incompressible_bytes;
+	u64 skipped_bytes;
+	u64 peer_raw_bytes;
+	u64 peer_wire_bytes;
+};
+
+/* Why we did or did not pull ahead of, or return to syncing with, a peer,
+ * see connection_congestion_show() */
+enum drbd_cong_decision {
+	CONG_FILL,		/* cong-fill threshold reached */
+	CONG_EXTENTS,		/* cong-extents threshold reached */
+	CONG_PREDICTED,		/* cong-fill or send buffer projected to fill up */
+	CONG_CATCH_UP,		/* Ahead -> SyncSource, resync projected to catch up */
+	CONG_STAY_AHEAD,	/* resync would not catch up in time, stay Ahead */
+};
+
+#define DRBD_CONG_HISTORY 8
+
+struct drbd_cong_event {
+	unsigned long jif;
+	enum drbd_cong_decision what;
+	unsigned int backlog;		/* sectors */
+	unsigned int write_rate;	/* sectors per second */
+	unsigned int drain_rate;	/* sectors per second */
+	unsigned int eta_ms;		/* to congestion, or to catch up */
+};
+
+/* Rates of application writes coming in, and of replicated writes being
+ * acknowledged by the peer, sampled from the request path and from the
+ * sender, see drbd_cong_sample() */
+struct drbd_cong_model {
+	spinlock_t lock;
+	atomic64_t drained;		/* sectors no longer in ap_in_flight */
+	unsigned long sample_jif;
+	u64 last_dagtag_sector;
+	u64 last_drained;
+	unsigned int write_rate;	/* 1/4 weight to the latest sample */
+	unsigned int drain_rate;	/* only sampled while there is a backlog */
+	unsigned int backlog;		/* ap_in_flight + rs_in_flight */
+	unsigned int sndbuf_used;	/* bytes, from transport->ops->stats() */
+	unsigned int sndbuf_size;
+	unsigned int events;
+	struct drbd_cong_event history[DRBD_CONG_HISTORY];
 };
 
 
+/* activity log transaction statistics, see device_act_log_histogram_show() */
+#define DRBD_AL_GROUP_HIST 17
+#define DRBD_AL_LATENCY_HIST 24
+
+/* Lock-free references to hot activity log extents, see drbd_actlog.c */
+#define DRBD_AL_PINS 64
+#define AL_PIN_DEAD (1 << 30)
+
+struct drbd_al_pin {
+	unsigned int enr;
+	atomic_t refs;		/* fast path references, or AL_PIN_DEAD */
+	struct lc_element *e;	/* holds one lc reference while set */
+};
+
 struct drbd_resource {
 	char *name;
 #ifdef CONFIG_DEBUG_FS
@@ -957,6 +1158,12 @@ struct drbd_resource {
 	struct drbd_work_queue work;
 	struct drbd_thread worker;
 
+	/* group commit of activity log transactions, see al_group_submit() */
+	spinlock_t al_group_lock;
+	struct list_head al_group_list;
+	struct list_head al_group_leaders; /* one per meta data device */
+	wait_queue_head_t al_group_wait;
+
 	struct list_head listeners;
 	spinlock_t listeners_lock;
 
@@ -978,6 +1185,9 @@ struct drbd_connection {
 	struct dentry *debugfs_conn_oldest_requests;
 	struct dentry *debugfs_conn_transport;
 	struct dentry *debugfs_conn_debug;
+	struct dentry *debugfs_conn_compression;
+	struct dentry *debugfs_conn_request_timeout;
+	struct dentry *debugfs_conn_congestion;
 #endif
 	struct kref kref;
 	struct kref_debug_info kref_debug;
@@ -1001,6 +1211,8 @@ struct drbd_connection {
 			char after[64];
 		} d;
 	} scratch_buffer;
+	struct drbd_compress compress;
+	struct drbd_cong_model cong;
 
 	int agreed_pro_version;		/* actually used protocol version */
 	u32 agreed_features;
@@ -1016,6 +1228,12 @@ struct drbd_connection {
 	struct crypto_shash *peer_integrity_tfm;  /* checksums we verify, only accessed from receiver thread  */
 	struct crypto_shash *csums_tfm;
 	struct crypto_shash *verify_tfm;
+	/* digest of an all zero block of that size, only used by the sender
+	 * thread; reset whenever verify_tfm changes */
+	struct {
+		unsigned int size;
+		u8 digest[DRBD_OV_TREE_FANOUT * HASH_MAX_DIGESTSIZE];
+	} verify_zero;
 
 	void *int_dig_in;
 	void *int_dig_vv;
@@ -1049,6 +1267,7 @@ struct drbd_connection {
 
 	atomic_t pp_in_use;		/* allocated from page pool */
 	atomic_t pp_in_use_by_net;	/* sendpage()d, still referenced by transport */
+	wait_queue_head_t pp_wait;	/* throttled by max_buffers */
 	/* sender side */
 	struct drbd_work_queue sender_work;
 
@@ -1105,6 +1324,11 @@ struct drbd_connection {
 	struct drbd_request *req_ack_pending;
 	struct drbd_request *req_not_net_done;
 
+	/* checks the oldest of the above against ko-count * timeout */
+	struct timer_list request_timer;
+	unsigned long req_timeout_jif;	/* as of the last run of the timer */
+	unsigned long req_deadline_jif;	/* 0 if there was no request */
+
 	unsigned int s_cb_nr; /* keeps counting up */
 	unsigned int r_cb_nr; /* keeps counting up */
 	struct drbd_thread_timing_details s_timing_details[DRBD_THREAD_DETAILS_HIST];
@@ -1198,6 +1422,7 @@ struct drbd_peer_device {
 	atomic_t ap_pending_cnt; /* AP data packets on the wire, ack expected */
 	atomic_t unacked_cnt;	 /* Need to send replies for */
 	atomic_t rs_pending_cnt; /* RS request/data packets on the wire */
+	struct drbd_rb_stats rb_stats; /* reads served by this peer */
 
 	/* use checksums for *this* resync */
 	bool use_csums;
@@ -1271,16 +1496,55 @@ struct drbd_peer_device {
 	struct {/* sender todo per peer_device */
 		bool was_ahead;
 	} todo;
+	struct drbd_oos_batch oos_batch;
 	union drbd_state connect_state;
 };
 
+/* Application writes are queued on the list of the CPU they were issued on,
+ * so concurrent submitters do not contend on one lock.  do_submit() collects
+ * them from all CPUs into one activity log transaction. */
+struct drbd_submit_queue {
+	spinlock_t lock;
+	struct list_head writes;
+	unsigned int nr;
+	ktime_t first_kt; /* when writes became non-empty */
+};
+
+/* log2 buckets of writes collected per batch: 1, 2-3, 4-7, ..., 512 and more */
+#define DRBD_SUBMIT_BATCH_HIST 10
+
 struct submit_worker {
 	struct workqueue_struct *wq;
 	struct work_struct worker;
 
+	struct drbd_submit_queue __percpu *queues;
+
 	spinlock_t lock;
-	struct list_head writes;
 	struct list_head peer_writes;
+
+	/* peer writes already "hot" in the activity log,
+	 * submitted on drbd_peer_submit_wq, see drbd_parallel_peer_submit */
+	struct work_struct peer_submit;
+	struct list_head peer_ready;
+
+	/* statistics, only updated by do_submit() */
+	unsigned long batches;
+	unsigned long batched_writes;
+	unsigned int batch_hist[DRBD_SUBMIT_BATCH_HIST];
+	u64 wait_us_total; /* sum over batches of the oldest write's wait */
+	u64 wait_us_max;
+};
+
+/* Digests of verify and checksum based resync reads, see drbd_csum_cache.c */
+struct drbd_csum_cache {
+	spinlock_t lock;
+	struct hlist_head *hash;	/* NULL if disabled */
+	struct list_head lru;
+	atomic_t *gen;			/* per resync extent, hashed */
+	unsigned int nr_entries;
+	unsigned int max_entries;
+	unsigned long hits;
+	unsigned long misses;
 };
 
 struct opener {
@@ -1316,6 +1580,9 @@ struct drbd_device {
 	struct dentry *debugfs_vol_ed_gen_id;
 	struct dentry *debugfs_vol_openers;
 	struct dentry *debugfs_vol_md_io;
+	struct dentry *debugfs_vol_bitmap_summary;
+	struct dentry *debugfs_vol_submit_stats;
+	struct dentry *debugfs_vol_csum_cache;
 #ifdef CONFIG_DRBD_TIMING_STATS
 	struct dentry *debugfs_vol_req_timing;
 #endif
@@ -1379,7 +1646,12 @@ struct drbd_device {
 	spinlock_t al_lock;
 	wait_queue_head_t al_wait;
 	struct lru_cache *act_log;	/* activity log */
+	unsigned int al_extent_shift;	/* of the attached meta data */
+	struct drbd_al_pin al_pins[DRBD_AL_PINS];
+	atomic_t al_pins_idle;		/* live pins without fast path references */
 	unsigned al_histogram[AL_UPDATES_PER_TRANSACTION+1];
+	unsigned al_group_histogram[DRBD_AL_GROUP_HIST]; /* transactions written together */
+	unsigned al_latency_histogram[DRBD_AL_LATENCY_HIST]; /* log2 usec */
 	unsigned int al_tr_number;
 	int al_tr_cycle;
 	wait_queue_head_t seq_wait;
@@ -1398,6 +1670,9 @@ struct drbd_device {
 	 * are deferred to this single-threaded work queue */
 	struct submit_worker submit;
 	u64 read_nodes; /* used for balancing read requests among peers */
+	struct drbd_rb_stats rb_local;
+	int rb_target; /* node id of the last adaptive read balancing choice, -1 for local */
+	struct drbd_csum_cache csum_cache;
 	bool have_quorum[2];	/* no quorum -> suspend IO or error IO */
 	bool cached_state_unstable; /* updates with each state change */
 	bool cached_err_io; /* complete all IOs with error */
@@ -1433,6 +1708,10 @@ struct drbd_bm_aio_ctx {
 #define BM_AIO_READ	        8
 #define BM_AIO_WRITE_LAZY      16
 	int error;
+	/* BM_AIO_READ: set bits counted as the reads complete */
+	atomic_long_t bits_set[DRBD_PEERS_MAX];
+	bool count_all; /* ... unless we could not, then count all at the end */
+	unsigned int nr_bios;
 	struct kref kref;
 };
 
@@ -1552,6 +1831,9 @@ extern int drbd_send_state(struct drbd_peer_device *, union drbd_state);
 extern int drbd_send_current_state(struct drbd_peer_device *);
 extern int drbd_send_sync_param(struct drbd_peer_device *);
 extern int drbd_send_out_of_sync(struct drbd_peer_device *, sector_t, unsigned int);
+extern int drbd_queue_out_of_sync(struct drbd_peer_device *, sector_t, unsigned int);
+extern int drbd_flush_out_of_sync(struct drbd_peer_device *);
+extern void drbd_clear_out_of_sync_batch(struct drbd_peer_device *);
 extern int drbd_send_block(struct drbd_peer_device *, enum drbd_packet,
 			   struct drbd_peer_request *);
 extern int drbd_send_dblock(struct drbd_peer_device *, struct drbd_request *req);
@@ -1663,9 +1945,17 @@ extern sector_t drbd_get_max_capacity(
  *  but is about to become configurable.
  */
 
-/* One activity log extent represents 4M of storage */
+/* One activity log extent represents 4M of storage by default.  Extents of
+ * up to one resync extent can be chosen when the meta data is created, see
+ * device->al_extent_shift. */
 #define AL_EXTENT_SHIFT 22
 #define AL_EXTENT_SIZE (1<<AL_EXTENT_SHIFT)
+#define AL_EXTENT_SHIFT_MAX BM_EXT_SHIFT
+
+/* The activity log extent shift is recorded in the MDF_AL_EXTENT_SHIFT_MASK
+ * bits of the meta data flags, as offset to AL_EXTENT_SHIFT.  Older modules
+ * ignore the flags, so meta data with other than 4M extents carries its own
+ * magic, DRBD_MD_MAGIC_09_AL_EXT, which they refuse.  drbdmeta writes both. */
 
 /* drbd_bitmap.c */
 /*
@@ -1716,7 +2006,10 @@ extern sector_t drbd_get_max_capacity(
 
 
 /* in one sector of the bitmap, we have this many activity_log extents. */
-#define AL_EXT_PER_BM_SECT  (1 << (BM_EXT_SHIFT - AL_EXTENT_SHIFT))
+static inline unsigned int al_ext_per_bm_sect(struct drbd_device *device)
+{
+	return 1U << (BM_EXT_SHIFT - device->al_extent_shift);
+}
 
 /* Indexed external meta data has a fixed on-disk size of 128MiB, of which
  * 4KiB are our "superblock", and 32KiB are the fixed size activity
@@ -1760,10 +2053,11 @@ extern sector_t drbd_get_max_capacity(
 #define DRBD_MAX_BBIO_SECTORS    (DRBD_MAX_BATCH_BIO_SIZE >> 9)
 
 /* how many activity log extents are touched by this interval? */
-static inline int interval_to_al_extents(struct drbd_interval *i)
+static inline int interval_to_al_extents(struct drbd_device *device, struct drbd_interval *i)
 {
-	unsigned int first = i->sector >> (AL_EXTENT_SHIFT-9);
-	unsigned int last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (AL_EXTENT_SHIFT-9);
+	unsigned int shift = device->al_extent_shift - 9;
+	unsigned int first = i->sector >> shift;
+	unsigned int last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> shift;
 	return 1 + last - first; /* worst case: all touched extends are cold. */
 }
 
@@ -1783,6 +2077,8 @@ extern void drbd_bm_clear_many_bits(struct drbd_peer_device *, unsigned long, un
 extern void _drbd_bm_clear_many_bits(struct drbd_device *, int, unsigned long, unsigned long);
 extern void _drbd_bm_set_many_bits(struct drbd_device *, int, unsigned long, unsigned long);
 extern int drbd_bm_test_bit(struct drbd_peer_device *, unsigned long);
+/* before bits of the range get set or cleared from completion context */
+extern void drbd_bm_sparse_prepare(struct drbd_device *, sector_t, unsigned int);
 extern int  drbd_bm_read(struct drbd_device *, struct drbd_peer_device *) __must_hold(local);
 extern void drbd_bm_reset_al_hints(struct drbd_device *device) __must_hold(local);
 extern void drbd_bm_mark_range_for_writeout(struct drbd_device *, unsigned long, unsigned long);
@@ -1814,6 +2110,7 @@ extern void drbd_bm_unlock(struct drbd_device *device);
 extern void drbd_bm_slot_lock(struct drbd_peer_device *peer_device, char *why, enum bm_flag flags);
 extern void drbd_bm_slot_unlock(struct drbd_peer_device *peer_device);
 extern void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsigned int to_index);
+extern void drbd_bm_seq_printf_summary(struct seq_file *seq, struct drbd_device *device);
 /* drbd_main.c */
 
 extern struct kmem_cache *drbd_request_cache;
@@ -1841,6 +2138,29 @@ extern spinlock_t   drbd_pp_lock;
 extern int	    drbd_pp_vacant;
 extern wait_queue_head_t drbd_pp_wait;
 
+/* In front of drbd_pp_pool, each CPU keeps a small cache of pages, so the
+ * receivers of many connections do not all bounce on drbd_pp_lock.
+ * Caches are refilled from and drained to drbd_pp_pool in batches.
+ * If both the local cache and drbd_pp_pool are short, we gather the pages
+ * from the caches of all CPUs before we fall back to alloc_page().
+ */
+#define DRBD_PP_BATCH		32
+#define DRBD_PP_CACHE_HIGH	(4 * DRBD_PP_BATCH)
+
+struct drbd_pp_cache {
+	spinlock_t lock;
+	struct page *pages;
+	unsigned int count;
+
+	/* statistics, protected by lock */
+	unsigned long hits;	/* allocations served from this cache */
+	unsigned long misses;	/* allocations that had to call alloc_page() */
+	unsigned long refills;	/* batches taken from drbd_pp_pool */
+	unsigned long drains;	/* batches given back to drbd_pp_pool */
+	unsigned long steals;	/* allocations gathered from all CPUs' caches */
+};
+extern struct drbd_pp_cache __percpu *drbd_pp_caches;
+
 /* We also need a standard (emergency-reserve backed) page pool
  * for meta data IO (activity log, bitmap).
  * We can keep it global, as long as it is used as "N pages at a time".
@@ -1853,7 +2173,7 @@ extern mempool_t drbd_md_io_page_pool;
  * when we need it for housekeeping purposes */
 extern struct bio_set drbd_md_io_bio_set;
 /* to allocate from that set */
-extern struct bio *bio_alloc_drbd(gfp_t gfp_mask);
+extern struct bio *bio_alloc_drbd(gfp_t gfp_mask, unsigned int nr_iovecs);
 
 /* And a bio_set for cloning */
 extern struct bio_set drbd_io_bio_set;
@@ -1964,6 +2284,14 @@ static inline void ov_out_of_sync_print(struct drbd_peer_device *peer_device)
 	peer_device->ov_last_oos_size = 0;
 }
 
+/* The chunks of an online verify block that get a digest each */
+static inline unsigned int drbd_ov_tree_chunk(struct drbd_connection *connection, unsigned int size)
+{
+	if (!(connection->agreed_features & DRBD_FF_OV_TREE) || size <= BM_BLOCK_SIZE)
+		return size;
+	return round_up(DIV_ROUND_UP(size, DRBD_OV_TREE_FANOUT), BM_BLOCK_SIZE);
+}
+
 static inline void ov_skipped_print(struct drbd_peer_device *peer_device)
 {
 	if (peer_device->ov_last_skipped_size) {
@@ -1976,6 +2304,9 @@ static inline void ov_skipped_print(struct drbd_peer_device *peer_device)
 
 extern void drbd_csum_bio(struct crypto_shash *, struct bio *, void *);
 extern void drbd_csum_pages(struct crypto_shash *, struct page *, void *);
+extern bool drbd_bio_all_zero(struct bio *);
+extern bool drbd_peer_req_all_zero(struct drbd_peer_request *);
+extern bool drbd_csum_cache_hit(struct drbd_peer_request *);
 /* worker callbacks */
 extern int w_e_end_data_req(struct drbd_work *, int);
 extern int w_e_end_rsdata_req(struct drbd_work *, int);
@@ -2063,7 +2394,12 @@ extern void drbd_send_peer_ack_wf(struct work_struct *ws);
 extern bool drbd_rs_c_min_rate_throttle(struct drbd_peer_device *);
 extern bool drbd_rs_should_slow_down(struct drbd_peer_device *, sector_t,
 				     bool throttle_if_app_is_waiting);
+extern void verify_skipped_block(struct drbd_peer_device *, const sector_t, const unsigned int);
+extern void verify_note_skipped(struct drbd_peer_device *, const sector_t, const unsigned int);
 extern int drbd_submit_peer_request(struct drbd_peer_request *);
+extern void do_peer_submit(struct work_struct *ws);
+extern struct workqueue_struct *drbd_peer_submit_wq;
+extern struct workqueue_struct *drbd_csum_wq;
 extern void drbd_cleanup_after_failed_submit_peer_request(struct drbd_peer_request *peer_req);
 extern void drbd_cleanup_peer_requests_wfa(struct drbd_device *device, struct list_head *cleanup);
 extern int drbd_free_peer_reqs(struct drbd_connection *, struct list_head *, bool is_net_ee);
@@ -2123,6 +2459,27 @@ void drbd_bump_write_ordering(struct drbd_resource *resource, struct drbd_backin
 extern void twopc_timer_fn(struct timer_list *t);
 extern void connect_timer_fn(struct timer_list *t);
 
+/* drbd_compress.c */
+extern void drbd_compress_init(struct drbd_connection *connection);
+extern void drbd_compress_free(struct drbd_connection *connection);
+extern unsigned int drbd_compress_bio(struct drbd_connection *connection, struct bio *bio);
+extern unsigned int drbd_compress_pages(struct drbd_connection *connection,
+					struct page *page, unsigned int size);
+extern int drbd_compress_peer_alg(struct drbd_connection *connection, u8 alg);
+extern int drbd_decompress_chunk(struct drbd_connection *connection,
+				 const void *src, unsigned int slen, void *dst, unsigned int dlen);
+extern const char *drbd_compress_alg_name(u8 alg);
+
+/* drbd_csum_cache.c */
+extern void drbd_csum_cache_init(struct drbd_device *device);
+extern void drbd_csum_cache_clear(struct drbd_device *device);
+extern void drbd_csum_cache_free(struct drbd_device *device);
+extern void drbd_csum_cache_invalidate(struct drbd_device *device, sector_t sector, unsigned int size);
+extern bool drbd_csum_cache_lookup(struct drbd_peer_request *peer_req,
+				   struct crypto_shash *tfm, int digest_size);
+extern void drbd_csum_cache_store(struct drbd_peer_request *peer_req,
+				  struct crypto_shash *tfm, const void *digest, int digest_size);
+
 /* drbd_proc.c */
 extern struct proc_dir_entry *drbd_proc;
 int drbd_seq_show(struct seq_file *seq, void *v);
@@ -2135,6 +2492,8 @@ extern void drbd_al_begin_io_commit(struct drbd_device *device);
 extern bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval *i);
 extern int drbd_al_begin_io_for_peer(struct drbd_peer_device *peer_device, struct drbd_interval *i);
 extern bool drbd_al_complete_io(struct drbd_device *device, struct drbd_interval *i);
+extern void drbd_al_unpin_all(struct drbd_device *device);
+extern unsigned int drbd_al_used(struct drbd_device *device);
 extern void drbd_rs_complete_io(struct drbd_peer_device *, sector_t);
 extern int drbd_rs_begin_io(struct drbd_peer_device *, sector_t);
 extern int drbd_try_rs_begin_io(struct drbd_peer_device *, sector_t, bool);
@@ -13,6 +13,9 @@ struct drbd_interval {
 	unsigned int waiting:1;		/* someone is waiting for completion */
 	unsigned int completed:1;	/* this has been completed already;
 					 * ignore for conflict detection */
+	/* activity log reference is on a pin; not a bit field,
+	 * it is changed without holding interval_lock */
+	bool al_pinned;
 };
 
 static inline void drbd_clear_interval(struct drbd_interval *i)
@@ -129,6 +129,81 @@ const struct kernel_param_ops param_ops_drbd_protocol_version = {
 unsigned int drbd_protocol_version_min = PRO_VERSION_MIN;
 module_param_named(protocol_version_min, drbd_protocol_version_min, drbd_protocol_version, 0644);
 
+/* Submit peer writes that hit the activity log fast path from a per-volume
+ * work item instead of the receiver thread, so the receiver can go on
+ * reading from the socket, and volumes are submitted in parallel. */
+bool drbd_parallel_peer_submit;
+MODULE_PARM_DESC(parallel_peer_submit, "submit peer writes from per-volume workers instead of the receiver");
+module_param_named(parallel_peer_submit, drbd_parallel_peer_submit, bool, 0644);
+
+/* Pages per stream and connection the packets are assembled in.  With more
+ * than one, a batch of corked packets spanning pages is sent in one go, and
+ * we rarely have to wait for the network stack to release a page. */
+static unsigned int drbd_send_buffer_pages = 4;
+MODULE_PARM_DESC(send_buffer_pages, "send buffer pages per stream of new connections (1-16)");
+module_param_named(send_buffer_pages, drbd_send_buffer_pages, uint, 0644);
+struct workqueue_struct *drbd_peer_submit_wq;
+struct workqueue_struct *drbd_csum_wq;
+
+/* Write concurrent activity log transactions of the volumes of a resource
+ * on the same meta data device as one batch, see al_group_submit() */
+bool drbd_al_group_commit;
+MODULE_PARM_DESC(al_group_commit, "submit concurrent activity log transactions of a resource on the same meta data device together");
+module_param_named(al_group_commit, drbd_al_group_commit, bool, 0644);
+
+/* With read-balancing least-pending, and on diskless nodes, send each read
+ * to the target with the lowest expected latency, see drbd_req.c */
+bool drbd_adaptive_read_balancing;
+MODULE_PARM_DESC(adaptive_read_balancing, "balance reads by measured latency of the local disk and the peers");
+module_param_named(adaptive_read_balancing, drbd_adaptive_read_balancing, bool, 0644);
+
+/* Send writes that contain only zeroes as P_ZEROES, without payload, see
+ * drbd_send_dblock().  The peer zeroes out from its receiver thread, which
+ * can take longer than receiving the data, unless its backing device
+ * supports WRITE_ZEROES. */
+bool drbd_send_zeroes;
+MODULE_PARM_DESC(send_zeroes, "send all-zero writes without payload to peers that support it (scans every write)");
+module_param_named(send_zeroes, drbd_send_zeroes, bool, 0644);
+
+/* Digests kept per volume for the next online verify or checksum based
+ * resync, see drbd_csum_cache.c.  Taken into account when a volume is
+ * created. */
+unsigned int drbd_csum_cache_entries;
+MODULE_PARM_DESC(csum_cache_entries, "verify and csum-resync digests cached per volume (0 = off)");
+module_param_named(csum_cache_entries, drbd_csum_cache_entries, uint, 0644);
+
+/* Compress the data payload on links to peers that support it, see
+ * drbd_compress.c.  Empty for no compression. */
+char drbd_compress_alg[CRYPTO_MAX_ALG_NAME];
+MODULE_PARM_DESC(compress, "payload compression (lzo, lz4, lz4hc, zstd, deflate)");
+module_param_string(compress, drbd_compress_alg, sizeof(drbd_compress_alg), 0644);
+
+/* Share the pages of the bitmap that have no bits set, instead of keeping
+ * one page of memory for each, see drbd_bitmap.c.  Taken into account when
+ * a volume is created. */
+bool drbd_bitmap_sparse;
+MODULE_PARM_DESC(bitmap_sparse, "keep only bitmap pages with bits set in memory");
+module_param_named(bitmap_sparse, drbd_bitmap_sparse, bool, 0644);
+
+/* With on-congestion pull-ahead, also pull ahead when, at the current rates
+ * of writes and of acknowledgements, the backlog is projected to reach
+ * cong-fill or to fill the send buffer within this time.  Once Ahead, only
+ * return to SyncSource when the resync is projected to catch up within
+ * ahead_catch_up_ms.  See drbd_cong_sample() in drbd_req.c. */
+unsigned int drbd_cong_horizon_ms;
+MODULE_PARM_DESC(cong_horizon_ms, "pull ahead when congestion is projected within this many ms (0 = off)");
+module_param_named(cong_horizon_ms, drbd_cong_horizon_ms, uint, 0644);
+
+unsigned int drbd_ahead_catch_up_ms;
+MODULE_PARM_DESC(ahead_catch_up_ms, "stay Ahead until the resync is projected to finish within this many ms (0 = off)");
+module_param_named(ahead_catch_up_ms, drbd_ahead_catch_up_ms, uint, 0644);
+
+/* In Ahead mode, coalesce the out-of-sync notifications for peers that
+ * support it, see drbd_queue_out_of_sync() */
+bool drbd_oos_batch;
+MODULE_PARM_DESC(oos_batch, "send out-of-sync notifications in Ahead mode as ranges per 4 MiB extent");
+module_param_named(oos_batch, drbd_oos_batch, bool, 0644);
+
 
 /* in 2.6.x, our device mapping and config info contains our virtual gendisks
  * as member "struct gendisk *vdisk;"
@@ -156,6 +231,7 @@ struct page *drbd_pp_pool;
 spinlock_t   drbd_pp_lock;
 int          drbd_pp_vacant;
 wait_queue_head_t drbd_pp_wait;
+struct drbd_pp_cache __percpu *drbd_pp_caches;
 
 static const struct block_device_operations drbd_ops = {
 	.owner =   THIS_MODULE,
@@ -163,12 +239,12 @@ static const struct block_device_operations drbd_ops = {
 	.release = drbd_release,
 };
 
-struct bio *bio_alloc_drbd(gfp_t gfp_mask)
+struct bio *bio_alloc_drbd(gfp_t gfp_mask, unsigned int nr_iovecs)
 {
 	if (!bioset_initialized(&drbd_md_io_bio_set))
-		return bio_alloc(gfp_mask, 1);
+		return bio_alloc(gfp_mask, nr_iovecs);
 
-	return bio_alloc_bioset(gfp_mask, 1, &drbd_md_io_bio_set);
+	return bio_alloc_bioset(gfp_mask, nr_iovecs, &drbd_md_io_bio_set);
 }
 
 #ifdef __CHECKER__
@@ -884,28 +960,79 @@ static void prepare_header(struct drbd_connection *connection, int vnr,
 		prepare_header80(buffer, cmd, size);
 }
 
+/* A ring page is free if it is not queued for sending, and the network
+ * stack released its references from earlier sends. */
+static bool send_buffer_slot_free(struct drbd_send_buffer *sbuf, unsigned int slot)
+{
+	int count = page_count(sbuf->ring[slot]);
+
+	BUG_ON(count == 0);
+	return count == 1 && !test_bit(slot, &sbuf->pending_mask);
+}
+
+static void use_send_buffer_slot(struct drbd_send_buffer *sbuf, unsigned int slot)
+{
+	sbuf->cur = slot;
+	sbuf->page = sbuf->ring[slot];
+	sbuf->unsent =
+	sbuf->pos = page_address(sbuf->page);
+}
+
+/* Queue the filled current page for the next flush and continue in a free
+ * ring page.  Returns false if there is none, the caller has to flush then. */
+static bool queue_send_buffer_page(struct drbd_send_buffer *sbuf)
+{
+	int size = sbuf->pos - sbuf->unsent + sbuf->allocated_size;
+	unsigned int i;
+
+	for (i = 1; i < sbuf->ring_size; i++) {
+		unsigned int slot = (sbuf->cur + i) % sbuf->ring_size;
+
+		if (!send_buffer_slot_free(sbuf, slot))
+			continue;
+
+		if (size) {
+			struct drbd_send_segment *seg = &sbuf->pending[sbuf->nr_pending++];
+
+			seg->slot = sbuf->cur;
+			seg->offset = sbuf->unsent - (char *)page_address(sbuf->page);
+			seg->size = size;
+			__set_bit(sbuf->cur, &sbuf->pending_mask);
+		}
+		sbuf->allocated_size = 0;
+		use_send_buffer_slot(sbuf, slot);
+		return true;
+	}
+
+	return false;
+}
+
 static void new_or_recycle_send_buffer_page(struct drbd_send_buffer *sbuf)
 {
 	while (1) {
 		struct page *page;
-		int count = page_count(sbuf->page);
+		unsigned int i;
 
-		BUG_ON(count == 0);
-		if (count == 1)
-			goto have_page;
+		for (i = 0; i < sbuf->ring_size; i++) {
+			unsigned int slot = (sbuf->cur + i) % sbuf->ring_size;
+
+			if (send_buffer_slot_free(sbuf, slot)) {
+				use_send_buffer_slot(sbuf, slot);
+				return;
+			}
+		}
 
+		/* All ring pages still referenced by the network stack */
 		page = alloc_page(GFP_NOIO | __GFP_NORETRY | __GFP_NOWARN);
 		if (page) {
-			put_page(sbuf->page);
-			sbuf->page = page;
-			goto have_page;
+			put_page(sbuf->ring[sbuf->cur]);
+			sbuf->ring[sbuf->cur] = page;
+			use_send_buffer_slot(sbuf, sbuf->cur);
+			return;
 		}
 
 		schedule_timeout_uninterruptible(HZ / 10);
 	}
-have_page:
-	sbuf->unsent =
-	sbuf->pos = page_address(sbuf->page);
 }
 
 static char *alloc_send_buffer(struct drbd_connection *connection, int size,
@@ -915,8 +1042,10 @@ static char *alloc_send_buffer(struct drbd_connection *connection, int size,
 	char *page_start = page_address(sbuf->page);
 
 	if (sbuf->pos - page_start + size > PAGE_SIZE) {
-		flush_send_buffer(connection, drbd_stream);
-		new_or_recycle_send_buffer_page(sbuf);
+		if (!queue_send_buffer_page(sbuf)) {
+			flush_send_buffer(connection, drbd_stream);
+			new_or_recycle_send_buffer_page(sbuf);
+		}
 	}
 
 	sbuf->allocated_size = size;
@@ -1002,10 +1131,11 @@ static int flush_send_buffer(struct drbd_connection *connection, enum drbd_strea
 	struct drbd_send_buffer *sbuf = &connection->send_buffer[drbd_stream];
 	struct drbd_transport *transport = &connection->transport;
 	struct drbd_transport_ops *tr_ops = transport->ops;
-	int msg_flags, err, offset, size;
+	int msg_flags, err = 0, offset, size;
+	unsigned int i;
 
 	size = sbuf->pos - sbuf->unsent + sbuf->allocated_size;
-	if (size == 0)
+	if (size == 0 && !sbuf->nr_pending)
 		return 0;
 
 	if (drbd_stream == DATA_STREAM) {
@@ -1015,6 +1145,22 @@ static int flush_send_buffer(struct drbd_connection *connection, enum drbd_strea
 	}
 
 	msg_flags = sbuf->additional_size ? MSG_MORE : 0;
+
+	for (i = 0; i < sbuf->nr_pending && !err; i++) {
+		struct drbd_send_segment *seg = &sbuf->pending[i];
+		bool more = size || i + 1 < sbuf->nr_pending;
+
+		err = tr_ops->send_page(transport, drbd_stream, sbuf->ring[seg->slot],
+					seg->offset, seg->size, more ? MSG_MORE : msg_flags);
+	}
+	/* Sent, or lost together with the connection */
+	sbuf->nr_pending = 0;
+	sbuf->pending_mask = 0;
+	if (err || size == 0) {
+		sbuf->allocated_size = 0;
+		return err;
+	}
+
 	offset = sbuf->unsent - (char *)page_address(sbuf->page);
 	err = tr_ops->send_page(transport, drbd_stream, sbuf->page, offset, size, msg_flags);
 	if (!err) {
@@ -2033,6 +2179,35 @@ static int _drbd_send_zc_bio(struct drbd_peer_device *peer_device, struct bio *b
 	}
 }
 
+/* The compressed payload is in connection->compress.buf, which we reuse
+ * for the next packet.  Copy it into the send buffer, as _drbd_no_send_page()
+ * does. */
+static int _drbd_send_compressed(struct drbd_peer_device *peer_device,
+				 unsigned int size, unsigned int raw_size)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	struct drbd_send_buffer *sbuf = &connection->send_buffer[DATA_STREAM];
+	const char *data = connection->compress.buf;
+	int err;
+
+	while (size) {
+		unsigned int l = min_t(unsigned int, size, PAGE_SIZE);
+
+		memcpy(alloc_send_buffer(connection, l, DATA_STREAM), data, l);
+		data += l;
+		size -= l;
+		if (size) {
+			sbuf->pos += sbuf->allocated_size;
+			sbuf->allocated_size = 0;
+		}
+	}
+	err = flush_send_buffer(connection, DATA_STREAM);
+	if (!err)
+		peer_device->send_cnt += raw_size >> 9;
+
+	return err;
+}
+
 static int _drbd_send_zc_ee(struct drbd_peer_device *peer_device,
 			    struct drbd_peer_request *peer_req)
 {
@@ -2074,8 +2249,32 @@ static u32 bio_flags_to_wire(struct drbd_connection *connection, struct bio *bio
 		 : 0);
 }
 
+enum {
+	RQ_PAYLOAD_UNKNOWN,	/* zero initialized by drbd_req_new() */
+	RQ_PAYLOAD_DATA,
+	RQ_PAYLOAD_ZERO,
+};
+
+/* The senders of several connections may race here; at worst, both scan */
+static bool drbd_req_all_zero(struct drbd_request *req)
+{
+	u8 z = READ_ONCE(req->payload_zero);
+
+	if (z == RQ_PAYLOAD_UNKNOWN) {
+		z = drbd_bio_all_zero(req->master_bio) ? RQ_PAYLOAD_ZERO : RQ_PAYLOAD_DATA;
+		WRITE_ONCE(req->payload_zero, z);
+	}
+	return z == RQ_PAYLOAD_ZERO;
+}
+
 /* Used to send write or TRIM aka REQ_OP_DISCARD requests
- * R_PRIMARY -> Peer	(P_DATA, P_TRIM)
+ * R_PRIMARY -> Peer	(P_DATA, P_TRIM, P_ZEROES)
+ *
+ * With the send_zeroes module parameter, writes containing only zeroes
+ * (freshly provisioned or trimmed images) are sent as P_ZEROES without
+ * payload, if the peer understands it.  As they
+ * come without DP_DISCARD, the peer does not unmap.  Not so with FUA or
+ * PREFLUSH: the peer zeroes out without honouring them.
  */
 int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *req)
 {
@@ -2087,12 +2286,17 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 	struct p_wsame *wsame = NULL;
 	void *digest_out = NULL;
 	unsigned int dp_flags = 0;
+	unsigned int compressed = 0;
 	int digest_size = 0;
 	int err;
 	const unsigned s = req->net_rq_state[peer_device->node_id];
 	const int op = bio_op(req->master_bio);
+	const bool zeroes = drbd_send_zeroes && op == REQ_OP_WRITE && req->i.size &&
+		!(req->master_bio->bi_opf & (REQ_FUA | REQ_PREFLUSH)) &&
+		(peer_device->connection->agreed_features & DRBD_FF_WZEROES) &&
+		drbd_req_all_zero(req);
 
-	if (op == REQ_OP_DISCARD || op == REQ_OP_WRITE_ZEROES) {
+	if (op == REQ_OP_DISCARD || op == REQ_OP_WRITE_ZEROES || zeroes) {
 		trim = drbd_prepare_command(peer_device, sizeof(*trim), DATA_STREAM);
 		if (!trim)
 			return -EIO;
@@ -2121,6 +2325,8 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 	p->block_id = (unsigned long)req;
 	p->seq_num = cpu_to_be32(atomic_inc_return(&peer_device->packet_seq));
 	dp_flags = bio_flags_to_wire(peer_device->connection, req->master_bio);
+	if (zeroes)
+		dp_flags |= DP_ZEROES;
 	if (peer_device->repl_state[NOW] >= L_SYNC_SOURCE && peer_device->repl_state[NOW] <= L_PAUSED_SYNC_T)
 		dp_flags |= DP_MAY_SET_IN_SYNC;
 	if (s & RQ_EXP_RECEIVE_ACK)
@@ -2146,7 +2352,11 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 					bio_iovec(req->master_bio).bv_len);
 		err = __send_command(peer_device->connection, device->vnr, P_WSAME, DATA_STREAM);
 	} else {
-		additional_size_command(peer_device->connection, DATA_STREAM, req->i.size);
+		compressed = drbd_compress_bio(peer_device->connection, req->master_bio);
+		if (compressed)
+			p->dp_flags = cpu_to_be32(dp_flags | DP_COMPRESSED);
+		additional_size_command(peer_device->connection, DATA_STREAM,
+					compressed ?: req->i.size);
 		err = __send_command(peer_device->connection, device->vnr, P_DATA, DATA_STREAM);
 	}
 	if (!err) {
@@ -2160,8 +2370,12 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 		 * won't change the data on the wire, thus if the digest checks
 		 * out ok after sending on this side, but does not fit on the
 		 * receiving side, we sure have detected corruption elsewhere.
+		 *
+		 * A compressed payload is a copy already.
 		 */
-		if (!(s & (RQ_EXP_RECEIVE_ACK | RQ_EXP_WRITE_ACK)) || digest_size)
+		if (compressed)
+			err = _drbd_send_compressed(peer_device, compressed, req->i.size);
+		else if (!(s & (RQ_EXP_RECEIVE_ACK | RQ_EXP_WRITE_ACK)) || digest_size)
 			err = _drbd_send_bio(peer_device, req->master_bio);
 		else
 			err = _drbd_send_zc_bio(peer_device, req->master_bio);
@@ -2190,6 +2404,7 @@ int drbd_send_block(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
 		    struct drbd_peer_request *peer_req)
 {
 	struct p_data *p;
+	unsigned int compressed;
 	int err;
 	int digest_size;
 
@@ -2206,10 +2421,17 @@ int drbd_send_block(struct drbd_peer_device *peer_device, enum drbd_packet cmd,
 	p->dp_flags = 0;
 	if (digest_size)
 		drbd_csum_pages(peer_device->connection->integrity_tfm, peer_req->page_chain.head, p + 1);
-	additional_size_command(peer_device->connection, DATA_STREAM, peer_req->i.size);
+	compressed = drbd_compress_pages(peer_device->connection,
+					 peer_req->page_chain.head, peer_req->i.size);
+	if (compressed)
+		p->dp_flags = cpu_to_be32(DP_COMPRESSED);
+	additional_size_command(peer_device->connection, DATA_STREAM,
+				compressed ?: peer_req->i.size);
 	err = __send_command(peer_device->connection,
 			     peer_device->device->vnr, cmd, DATA_STREAM);
-	if (!err)
+	if (!err && compressed)
+		err = _drbd_send_compressed(peer_device, compressed, peer_req->i.size);
+	else if (!err)
 		err = _drbd_send_zc_ee(peer_device, peer_req);
 	mutex_unlock(&peer_device->connection->mutex[DATA_STREAM]);
 
@@ -2228,6 +2450,136 @@ int drbd_send_out_of_sync(struct drbd_peer_device *peer_device, sector_t sector,
 	return drbd_send_command(peer_device, P_OUT_OF_SYNC, DATA_STREAM);
 }
 
+static int drbd_send_out_of_sync_ranges(struct drbd_peer_device *peer_device,
+					unsigned long ext, unsigned long *bits)
+{
+	struct p_block_desc *p;
+	struct p_oos_range *r;
+	unsigned int first, end, n = 0;
+
+	/* at most every other bit starts a range */
+	p = drbd_prepare_command(peer_device,
+				 sizeof(*p) + DRBD_OOS_EXTENT_BITS / 2 * sizeof(*r), DATA_STREAM);
+	if (!p)
+		return -EIO;
+	r = (struct p_oos_range *)(p + 1);
+
+	first = find_first_bit(bits, DRBD_OOS_EXTENT_BITS);
+	while (first < DRBD_OOS_EXTENT_BITS) {
+		end = find_next_zero_bit(bits, DRBD_OOS_EXTENT_BITS, first);
+		r[n].first = cpu_to_be16(first);
+		r[n].count = cpu_to_be16(end - first);
+		n++;
+		first = find_next_bit(bits, DRBD_OOS_EXTENT_BITS, end);
+	}
+
+	p->sector = cpu_to_be64(BM_BIT_TO_SECT(ext << DRBD_OOS_EXTENT_BITS_SHIFT));
+	p->blksize = 0;
+	resize_prepared_command(peer_device->connection, DATA_STREAM, sizeof(*p) + n * sizeof(*r));
+	return drbd_send_command(peer_device, P_OUT_OF_SYNC, DATA_STREAM);
+}
+
+/**
+ * drbd_queue_out_of_sync() - Tell the peer about blocks we did not replicate
+ * @peer_device:	DRBD peer device, Ahead of the peer.
+ * @sector:	start sector of the write.
+ * @size:	size of the write in bytes.
+ *
+ * Only called from the sender.  If the peer supports DRBD_FF_OOS_RANGES,
+ * the blocks are only noted, and sent later, together with the ones of
+ * other writes to the same extents.  That happens when the sender runs out
+ * of requests, when more than DRBD_OOS_BATCH_EXTENTS extents are pending,
+ * after DRBD_OOS_BATCH_DELAY, and before we leave Ahead mode.
+ */
+int drbd_queue_out_of_sync(struct drbd_peer_device *peer_device, sector_t sector, unsigned int size)
+{
+	struct drbd_oos_batch *b = &peer_device->oos_batch;
+	unsigned long bit, last, ext, end;
+	unsigned int i;
+	int err;
+
+	if (!drbd_oos_batch || !size ||
+	    !(peer_device->connection->agreed_features & DRBD_FF_OOS_RANGES))
+		return drbd_send_out_of_sync(peer_device, sector, size);
+
+	bit = BM_SECT_TO_BIT(sector);
+	last = BM_SECT_TO_BIT(sector + (size >> 9) - 1);
+	while (bit <= last) {
+		ext = bit >> DRBD_OOS_EXTENT_BITS_SHIFT;
+		end = min(last, ((ext + 1) << DRBD_OOS_EXTENT_BITS_SHIFT) - 1);
+
+		spin_lock(&b->lock);
+		for (i = 0; i < b->nr; i++) {
+			if (b->ext[i].nr == ext)
+				break;
+		}
+		if (i == b->nr) {
+			if (b->nr == DRBD_OOS_BATCH_EXTENTS) {
+				spin_unlock(&b->lock);
+				err = drbd_flush_out_of_sync(peer_device);
+				if (err)
+					return err;
+				continue;
+			}
+			if (!b->nr)
+				b->start_jif = jiffies;
+			b->ext[i].nr = ext;
+			bitmap_zero(b->ext[i].bits, DRBD_OOS_EXTENT_BITS);
+			b->nr++;
+		}
+		bitmap_set(b->ext[i].bits, bit & (DRBD_OOS_EXTENT_BITS - 1), end - bit + 1);
+		spin_unlock(&b->lock);
+		bit = end + 1;
+	}
+	spin_lock(&b->lock);
+	b->writes++;
+	spin_unlock(&b->lock);
+
+	if (time_after(jiffies, READ_ONCE(b->start_jif) + DRBD_OOS_BATCH_DELAY))
+		return drbd_flush_out_of_sync(peer_device);
+	return 0;
+}
+
+/* Send what drbd_queue_out_of_sync() noted.  May also be called from the
+ * worker, to make sure the peer knows before we go SyncSource. */
+int drbd_flush_out_of_sync(struct drbd_peer_device *peer_device)
+{
+	struct drbd_oos_batch *b = &peer_device->oos_batch;
+	DECLARE_BITMAP(bits, DRBD_OOS_EXTENT_BITS);
+	unsigned long ext;
+	int err;
+
+	while (READ_ONCE(b->nr)) {
+		spin_lock(&b->lock);
+		if (!b->nr) {
+			spin_unlock(&b->lock);
+			break;
+		}
+		b->nr--;
+		ext = b->ext[b->nr].nr;
+		bitmap_copy(bits, b->ext[b->nr].bits, DRBD_OOS_EXTENT_BITS);
+		b->packets++;
+		spin_unlock(&b->lock);
+
+		err = drbd_send_out_of_sync_ranges(peer_device, ext, bits);
+		if (err) {
+			drbd_clear_out_of_sync_batch(peer_device);
+			return err;
+		}
+	}
+	return 0;
+}
+
+/* On disconnect.  The peer learns about these with the next bitmap exchange. */
+void drbd_clear_out_of_sync_batch(struct drbd_peer_device *peer_device)
+{
+	struct drbd_oos_batch *b = &peer_device->oos_batch;
+
+	spin_lock(&b->lock);
+	b->nr = 0;
+	spin_unlock(&b->lock);
+}
+
 int drbd_send_dagtag(struct drbd_connection *connection, u64 dagtag)
 {
 	struct p_dagtag *p;
@@ -2601,6 +2953,22 @@ void drbd_cleanup_device(struct drbd_device *device)
 static void drbd_destroy_mempools(void)
 {
 	struct page *page;
+	int cpu;
+
+	if (drbd_pp_caches) {
+		for_each_possible_cpu(cpu) {
+			struct drbd_pp_cache *cache = per_cpu_ptr(drbd_pp_caches, cpu);
+
+			while (cache->pages) {
+				page = cache->pages;
+				cache->pages = page_chain_next(page);
+				__free_page(page);
+			}
+			cache->count = 0;
+		}
+		free_percpu(drbd_pp_caches);
+		drbd_pp_caches = NULL;
+	}
 
 	while (drbd_pp_pool) {
 		page = drbd_pp_pool;
@@ -2637,7 +3005,7 @@ static int drbd_create_mempools(void)
 {
 	struct page *page;
 	const int number = (DRBD_MAX_BIO_SIZE/PAGE_SIZE) * drbd_minor_count;
-	int i, ret;
+	int i, ret, cpu;
 
 	/* caches */
 	drbd_request_cache = kmem_cache_create(
@@ -2686,6 +3054,12 @@ static int drbd_create_mempools(void)
 	/* drbd's page pool */
 	spin_lock_init(&drbd_pp_lock);
 
+	drbd_pp_caches = alloc_percpu(struct drbd_pp_cache);
+	if (!drbd_pp_caches)
+		goto Enomem;
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(drbd_pp_caches, cpu)->lock);
+
 	for (i = 0; i < number; i++) {
 		page = alloc_page(GFP_HIGHUSER);
 		if (!page)
@@ -2726,6 +3100,9 @@ static void drbd_device_finalize_work_fn(struct work_struct *work)
 		device->bitmap = NULL;
 	}
 
+	free_percpu(device->submit.queues);
+	drbd_csum_cache_free(device);
+
 	put_disk(device->vdisk);
 	blk_cleanup_queue(device->rq_queue);
 
@@ -2905,6 +3282,10 @@ static void drbd_cleanup(void)
 
 	if (retry.wq)
 		destroy_workqueue(retry.wq);
+	if (drbd_peer_submit_wq)
+		destroy_workqueue(drbd_peer_submit_wq);
+	if (drbd_csum_wq)
+		destroy_workqueue(drbd_csum_wq);
 
 	drbd_genl_unregister();
 	drbd_debugfs_cleanup();
@@ -3040,28 +3421,41 @@ static void drbd_put_send_buffers(struct drbd_connection *connection)
 	unsigned int i;
 
 	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
-		if (connection->send_buffer[i].page) {
-			put_page(connection->send_buffer[i].page);
-			connection->send_buffer[i].page = NULL;
+		struct drbd_send_buffer *sbuf = &connection->send_buffer[i];
+		unsigned int slot;
+
+		for (slot = 0; slot < DRBD_SEND_BUFFER_PAGES_MAX; slot++) {
+			if (sbuf->ring[slot]) {
+				put_page(sbuf->ring[slot]);
+				sbuf->ring[slot] = NULL;
+			}
 		}
+		sbuf->page = NULL;
 	}
 }
 
 static int drbd_alloc_send_buffers(struct drbd_connection *connection)
 {
+	unsigned int ring_size = clamp_t(unsigned int, drbd_send_buffer_pages,
+					 1, DRBD_SEND_BUFFER_PAGES_MAX);
 	unsigned int i;
 
 	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
-		struct page *page;
+		struct drbd_send_buffer *sbuf = &connection->send_buffer[i];
+		unsigned int slot;
+
+		for (slot = 0; slot < ring_size; slot++) {
+			struct page *page;
 
-		page = alloc_page(GFP_KERNEL);
-		if (!page) {
-			drbd_put_send_buffers(connection);
-			return -ENOMEM;
+			page = alloc_page(GFP_KERNEL);
+			if (!page) {
+				drbd_put_send_buffers(connection);
+				return -ENOMEM;
+			}
+			sbuf->ring[slot] = page;
 		}
-		connection->send_buffer[i].page = page;
-		connection->send_buffer[i].unsent =
-		connection->send_buffer[i].pos = page_address(page);
+		sbuf->ring_size = ring_size;
+		use_send_buffer_slot(sbuf, 0);
 	}
 
 	return 0;
@@ -3097,6 +3491,7 @@ void conn_free_crypto(struct drbd_connection *connection)
 
 	connection->csums_tfm = NULL;
 	connection->verify_tfm = NULL;
+	connection->verify_zero.size = 0;
 	connection->cram_hmac_tfm = NULL;
 	connection->integrity_tfm = NULL;
 	connection->peer_integrity_tfm = NULL;
@@ -3246,6 +3641,10 @@ struct drbd_resource *drbd_create_resource(const char *name,
 	spin_lock_init(&resource->queued_twopc_lock);
 	timer_setup(&resource->queued_twopc_timer, queued_twopc_timer_fn, 0);
 	drbd_init_workqueue(&resource->work);
+	spin_lock_init(&resource->al_group_lock);
+	INIT_LIST_HEAD(&resource->al_group_list);
+	INIT_LIST_HEAD(&resource->al_group_leaders);
+	init_waitqueue_head(&resource->al_group_wait);
 	drbd_thread_init(resource, &resource->worker, drbd_worker, "worker");
 	drbd_thread_start(&resource->worker);
 	spin_lock_init(&resource->current_tle_lock);
@@ -3307,6 +3706,7 @@ struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 
 	INIT_LIST_HEAD(&connection->connect_timer_work.list);
 	timer_setup(&connection->connect_timer, connect_timer_fn, 0);
+	timer_setup(&connection->request_timer, connection_request_timer_fn, 0);
 
 	drbd_thread_init(resource, &connection->receiver, drbd_receiver, "receiver");
 	connection->receiver.connection = connection;
@@ -3315,6 +3715,7 @@ struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 	drbd_thread_init(resource, &connection->ack_receiver, drbd_ack_receiver, "ack_recv");
 	connection->ack_receiver.connection = connection;
 	spin_lock_init(&connection->peer_reqs_lock);
+	spin_lock_init(&connection->cong.lock);
 	INIT_LIST_HEAD(&connection->peer_requests);
 	INIT_LIST_HEAD(&connection->connections);
 	INIT_LIST_HEAD(&connection->active_ee);
@@ -3323,6 +3724,7 @@ struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 	INIT_LIST_HEAD(&connection->net_ee);
 	INIT_LIST_HEAD(&connection->done_ee);
 	init_waitqueue_head(&connection->ee_wait);
+	init_waitqueue_head(&connection->pp_wait);
 
 	kref_init(&connection->kref);
 	kref_debug_init(&connection->kref_debug, &connection->kref, &kref_class_connection);
@@ -3431,6 +3833,7 @@ struct drbd_peer_device *create_peer_device(struct drbd_device *device, struct d
 	peer_device->propagate_uuids_work.cb = w_send_uuids;
 
 	mutex_init(&peer_device->resync_next_bit_mutex);
+	spin_lock_init(&peer_device->oos_batch.lock);
 
 	atomic_set(&peer_device->ap_pending_cnt, 0);
 	atomic_set(&peer_device->unacked_cnt, 0);
@@ -3446,15 +3849,31 @@ struct drbd_peer_device *create_peer_device(struct drbd_device *device, struct d
 
 static int init_submitter(struct drbd_device *device)
 {
+	int cpu;
+
+	device->submit.queues = alloc_percpu(struct drbd_submit_queue);
+	if (!device->submit.queues)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		struct drbd_submit_queue *q = per_cpu_ptr(device->submit.queues, cpu);
+
+		spin_lock_init(&q->lock);
+		INIT_LIST_HEAD(&q->writes);
+	}
+
 	/* opencoded create_singlethread_workqueue(),
 	 * to be able to use format string arguments */
 	device->submit.wq =
 		alloc_ordered_workqueue("drbd%u_submit", WQ_MEM_RECLAIM, device->minor);
-	if (!device->submit.wq)
+	if (!device->submit.wq) {
+		free_percpu(device->submit.queues);
+		device->submit.queues = NULL;
 		return -ENOMEM;
+	}
 	INIT_WORK(&device->submit.worker, do_submit);
-	INIT_LIST_HEAD(&device->submit.writes);
 	INIT_LIST_HEAD(&device->submit.peer_writes);
+	INIT_WORK(&device->submit.peer_submit, do_peer_submit);
+	INIT_LIST_HEAD(&device->submit.peer_ready);
 	spin_lock_init(&device->submit.lock);
 	return 0;
 }
@@ -3470,7 +3889,7 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	struct request_queue *q;
 	LIST_HEAD(peer_devices);
 	LIST_HEAD(tmp);
-	int id;
+	int id, i;
 	int vnr = adm_ctx->volume;
 	enum drbd_ret_code err = ERR_NOMEM;
 	bool locked = false;
@@ -3507,12 +3926,18 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	atomic_set(&device->wait_for_actlog_ecnt, 0);
 	atomic_set(&device->local_cnt, 0);
 	atomic_set(&device->rs_sect_ev, 0);
+	device->rb_target = -1;
+	drbd_csum_cache_init(device);
 	atomic_set(&device->md_io.in_use, 0);
 
 #ifdef CONFIG_DRBD_TIMING_STATS
 	spin_lock_init(&device->timing_lock);
 #endif
 	spin_lock_init(&device->al_lock);
+	for (i = 0; i < DRBD_AL_PINS; i++)
+		atomic_set(&device->al_pins[i].refs, AL_PIN_DEAD);
+	atomic_set(&device->al_pins_idle, 0);
+	device->al_extent_shift = AL_EXTENT_SHIFT;
 
 	spin_lock_init(&device->pending_completion_lock);
 	INIT_LIST_HEAD(&device->pending_master_completion[0]);
@@ -3694,6 +4119,7 @@ out_no_q:
 		/* kref debugging wants an extra put, see has_refs() */
 	kref_debug_put(&device->kref_debug, 4);
 	kref_debug_destroy(&device->kref_debug);
+	drbd_csum_cache_free(device);
 	kfree(device);
 	return err;
 }
@@ -3724,6 +4150,7 @@ void drbd_unregister_device(struct drbd_device *device)
 	drbd_debugfs_device_cleanup(device);
 	del_gendisk(device->vdisk);
 
+	flush_work(&device->submit.peer_submit);
 	destroy_workqueue(device->submit.wq);
 	device->submit.wq = NULL;
 	del_timer_sync(&device->request_timer);
@@ -3774,6 +4201,7 @@ void drbd_unregister_connection(struct drbd_connection *connection)
 	drbd_debugfs_connection_cleanup(connection);
 
 	del_connect_timer(connection);
+	del_timer_sync(&connection->request_timer);
 
 	rr = drbd_free_peer_reqs(connection, &connection->done_ee, false);
 	if (rr)
@@ -3785,6 +4213,7 @@ void drbd_unregister_connection(struct drbd_connection *connection)
 
 	drbd_transport_shutdown(connection, DESTROY_TRANSPORT);
 	drbd_put_send_buffers(connection);
+	drbd_compress_free(connection);
 	conn_free_crypto(connection);
 }
 
@@ -3901,6 +4330,23 @@ static int __init drbd_init(void)
 	spin_lock_init(&retry.lock);
 	INIT_LIST_HEAD(&retry.writes);
 
+	/* unbound: a work item never runs concurrently with itself,
+	 * so writes to one volume stay in order, but volumes do not
+	 * wait for each other */
+	drbd_peer_submit_wq = alloc_workqueue("drbd_peer_submit", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!drbd_peer_submit_wq) {
+		pr_err("unable to create peer submit workqueue\n");
+		goto fail;
+	}
+
+	/* digests for checksum based resync and online verify,
+	 * see drbd_csum_work_fn() */
+	drbd_csum_wq = alloc_workqueue("drbd_csum", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!drbd_csum_wq) {
+		pr_err("unable to create checksum workqueue\n");
+		goto fail;
+	}
+
 	drbd_debugfs_init();
 
 	pr_info("initialized. "
@@ -3929,7 +4375,8 @@ void drbd_md_encode(struct drbd_device *device, struct meta_data_on_disk_9 *buff
 	buffer->effective_size = cpu_to_be64(device->ldev->md.effective_size);
 	buffer->current_uuid = cpu_to_be64(device->ldev->md.current_uuid);
 	buffer->flags = cpu_to_be32(device->ldev->md.flags);
-	buffer->magic = cpu_to_be32(DRBD_MD_MAGIC_09);
+	buffer->magic = cpu_to_be32(device->ldev->md.al_extent_shift == AL_EXTENT_SHIFT ?
+				    DRBD_MD_MAGIC_09 : DRBD_MD_MAGIC_09_AL_EXT);
 
 	buffer->md_size_sect  = cpu_to_be32(device->ldev->md.md_size_sect);
 	buffer->al_offset     = cpu_to_be32(device->ldev->md.al_offset);
@@ -4183,14 +4630,15 @@ int drbd_md_decode(struct drbd_device *device,
 
 	magic = be32_to_cpu(buffer->magic);
 	flags = be32_to_cpu(buffer->flags);
-	if (magic == DRBD_MD_MAGIC_09 && !(flags & MDF_AL_CLEAN)) {
+	if ((magic == DRBD_MD_MAGIC_09 || magic == DRBD_MD_MAGIC_09_AL_EXT) &&
+	    !(flags & MDF_AL_CLEAN)) {
 			/* btw: that's Activity Log clean, not "all" clean. */
 		drbd_err(device, "Found unclean meta data. Did you \"drbdadm apply-al\"?\n");
 		rv = ERR_MD_UNCLEAN;
 		goto err;
 	}
 	rv = ERR_MD_INVALID;
-	if (magic != DRBD_MD_MAGIC_09) {
+	if (magic != DRBD_MD_MAGIC_09 && magic != DRBD_MD_MAGIC_09_AL_EXT) {
 		if (magic == DRBD_MD_MAGIC_07 ||
 		    magic == DRBD_MD_MAGIC_08 ||
 		    magic == DRBD_MD_MAGIC_84_UNCLEAN)
@@ -4206,6 +4654,19 @@ int drbd_md_decode(struct drbd_device *device,
 		goto err;
 	}
 
+	/* chosen at create-md time, 0 is the traditional 4 MiB */
+	bdev->md.al_extent_shift = AL_EXTENT_SHIFT +
+		((flags & MDF_AL_EXTENT_SHIFT_MASK) >> MDF_AL_EXTENT_SHIFT_FIRST);
+	if ((magic == DRBD_MD_MAGIC_09_AL_EXT) != (bdev->md.al_extent_shift != AL_EXTENT_SHIFT)) {
+		drbd_err(device, "meta data magic does not match the activity log extent size\n");
+		goto err;
+	}
+	if (bdev->md.al_extent_shift > AL_EXTENT_SHIFT_MAX) {
+		drbd_err(device, "unsupported activity log extent size: 2^%u byte\n",
+			 bdev->md.al_extent_shift);
+		goto err;
+	}
+
 	if (check_activity_log_stripe_size(device, buffer, &bdev->md))
 		goto err;
 	if (check_offsets_and_sizes(device, buffer, bdev))
@@ -1034,6 +1034,7 @@ retry:
 		idr_for_each_entry(&resource->devices, device, vnr) {
 			fsync_bdev(device->this_bdev);
 			flush_workqueue(device->submit.wq);
+			flush_work(&device->submit.peer_submit);
 		}
 
 		if (start_new_tl_epoch(resource)) {
@@ -1914,6 +1915,8 @@ static int drbd_check_al_size(struct drbd_device *device, struct disk_conf *dc)
 		lc_destroy(t);
 		device->al_writ_cnt = 0;
 		memset(device->al_histogram, 0, sizeof(device->al_histogram));
+		memset(device->al_group_histogram, 0, sizeof(device->al_group_histogram));
+		memset(device->al_latency_histogram, 0, sizeof(device->al_latency_histogram));
 	}
 	drbd_md_mark_dirty(device); /* we changed device->act_log->nr_elemens */
 	return 0;
@@ -2954,6 +2957,12 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 	nbc = NULL;
 	new_disk_conf = NULL;
 
+	/* Nothing used the activity log while we were diskless */
+	device->al_extent_shift = device->ldev->md.al_extent_shift;
+	if (device->al_extent_shift != AL_EXTENT_SHIFT)
+		drbd_msg_sprintf_info(adm_ctx.reply_skb, "activity log extents of %u MiB",
+				      1U << (device->al_extent_shift - 20));
+
 	if (drbd_md_dax_active(device->ldev)) {
 		/* The on-disk activity log is always initialized with the
 		 * non-pmem format. We have now decided to access it using
@@ -3068,6 +3077,11 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 		retcode = ERR_IO_MD_DISK;
 		goto force_diskless_dec;
 	}
+	if (!(device->bitmap->bm_flags & BM_ON_DAX_PMEM))
+		drbd_msg_sprintf_info(adm_ctx.reply_skb,
+			"bitmap of %u pages read in %u ms with %u requests",
+			device->bitmap->bm_read_pages, device->bitmap->bm_read_ms,
+			device->bitmap->bm_read_bios);
 
 	for_each_peer_device(peer_device, device) {
 		if ((test_bit(CRASHED_PRIMARY, &device->flags) &&
@@ -3459,6 +3473,7 @@ int drbd_adm_net_opts(struct sk_buff *skb, struct genl_info *info)
 	if (!ovr) {
 		crypto_free_shash(connection->verify_tfm);
 		connection->verify_tfm = crypto.verify_tfm;
+		connection->verify_zero.size = 0;
 		crypto.verify_tfm = NULL;
 	}
 
@@ -3482,6 +3497,10 @@ int drbd_adm_net_opts(struct sk_buff *skb, struct genl_info *info)
 
 		idr_for_each_entry(&connection->peer_devices, peer_device, vnr)
 			drbd_send_sync_param(peer_device);
+
+		/* the timer stopped if ko-count or timeout was 0, or may
+		 * sleep for the old, longer timeout */
+		mod_timer(&connection->request_timer, jiffies + HZ);
 	}
 
 	goto out;
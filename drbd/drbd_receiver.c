@@ -39,7 +39,8 @@
 #include "drbd_req.h"
 #include "drbd_vli.h"
 
-#define PRO_FEATURES (DRBD_FF_TRIM|DRBD_FF_THIN_RESYNC|DRBD_FF_WSAME|DRBD_FF_WZEROES)
+#define PRO_FEATURES (DRBD_FF_TRIM|DRBD_FF_THIN_RESYNC|DRBD_FF_WSAME|DRBD_FF_WZEROES| \
+		      DRBD_FF_COMPRESS|DRBD_FF_OV_TREE|DRBD_FF_OOS_RANGES)
 
 struct flush_work {
 	struct drbd_work w;
@@ -286,23 +287,150 @@ static void page_chain_add(struct page **head,
 	*head = chain_first;
 }
 
-static struct page *__drbd_alloc_pages(unsigned int number, gfp_t gfp_mask)
+/* Refill the local cache from drbd_pp_pool, so that it holds at least
+ * @number pages. Takes a whole batch if the global pool has one to spare.
+ * Caller holds cache->lock. Lock order: cache->lock, then drbd_pp_lock. */
+static void pp_cache_refill(struct drbd_pp_cache *cache, unsigned int number)
 {
-	struct page *page = NULL;
-	struct page *tmp = NULL;
-	unsigned int i = 0;
+	unsigned int needed = number - cache->count;
+	unsigned int n = max_t(unsigned int, needed, DRBD_PP_BATCH);
+	struct page *page, *tmp;
 
 	/* Yes, testing drbd_pp_vacant outside the lock is racy.
 	 * So what. It saves a spin_lock. */
-	if (drbd_pp_vacant >= number) {
+	if (drbd_pp_vacant < needed)
+		return;
+
+	spin_lock(&drbd_pp_lock);
+	n = min_t(unsigned int, n, drbd_pp_vacant);
+	page = n >= needed ? page_chain_del(&drbd_pp_pool, n) : NULL;
+	if (page)
+		drbd_pp_vacant -= n;
+	spin_unlock(&drbd_pp_lock);
+
+	if (!page)
+		return;
+	tmp = page_chain_tail(page, NULL);
+	page_chain_add(&cache->pages, page, tmp);
+	cache->count += n;
+	cache->refills++;
+}
+
+/* Take @number pages from the caches of the CPUs, ours included, before we
+ * resort to alloc_page(): up to DRBD_PP_CACHE_HIGH pages per CPU may sit in
+ * caches that drbd_pp_vacant does not count.  If even all of them together
+ * are too few, what we gathered goes back to drbd_pp_pool.
+ * Offline CPUs are visited too, their caches would be stranded otherwise.
+ * We never hold two cache locks at the same time. */
+static struct page *pp_cache_steal(unsigned int number)
+{
+	struct page *page = NULL, *tmp;
+	unsigned int got = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct drbd_pp_cache *cache = per_cpu_ptr(drbd_pp_caches, cpu);
+		unsigned int n;
+
+		if (!READ_ONCE(cache->count))
+			continue;
+		spin_lock(&cache->lock);
+		n = min(cache->count, number - got);
+		tmp = n ? page_chain_del(&cache->pages, n) : NULL;
+		if (tmp)
+			cache->count -= n;
+		spin_unlock(&cache->lock);
+		if (!tmp)
+			continue;
+		page_chain_add(&page, tmp, page_chain_tail(tmp, NULL));
+		got += n;
+		if (got == number)
+			return page;
+	}
+
+	if (page) {
+		tmp = page_chain_tail(page, NULL);
 		spin_lock(&drbd_pp_lock);
-		page = page_chain_del(&drbd_pp_pool, number);
-		if (page)
-			drbd_pp_vacant -= number;
+		page_chain_add(&drbd_pp_pool, page, tmp);
+		drbd_pp_vacant += got;
 		spin_unlock(&drbd_pp_lock);
+	}
+	return NULL;
+}
+
+static struct page *drbd_pp_cache_get(unsigned int number)
+{
+	struct drbd_pp_cache *cache;
+	struct page *page = NULL;
+
+	cache = get_cpu_ptr(drbd_pp_caches);
+	spin_lock(&cache->lock);
+	if (cache->count < number)
+		pp_cache_refill(cache, number);
+	if (cache->count >= number) {
+		page = page_chain_del(&cache->pages, number);
+		cache->count -= number;
+		cache->hits++;
+	}
+	spin_unlock(&cache->lock);
+
+	if (!page) {
+		page = pp_cache_steal(number);
+		spin_lock(&cache->lock);
 		if (page)
-			return page;
+			cache->steals++;
+		else
+			cache->misses++;
+		spin_unlock(&cache->lock);
+	}
+	put_cpu_ptr(drbd_pp_caches);
+	return page;
+}
+
+/* Give a page chain to the local cache. If that grows beyond
+ * DRBD_PP_CACHE_HIGH, hand the surplus back to drbd_pp_pool.
+ * Returns the number of pages in the chain. */
+static int drbd_pp_cache_put(struct page *page)
+{
+	struct drbd_pp_cache *cache;
+	struct page *surplus = NULL;
+	struct page *tmp;
+	int i, n = 0;
+
+	tmp = page_chain_tail(page, &i);
+
+	cache = get_cpu_ptr(drbd_pp_caches);
+	spin_lock(&cache->lock);
+	page_chain_add(&cache->pages, page, tmp);
+	cache->count += i;
+	if (cache->count > DRBD_PP_CACHE_HIGH) {
+		n = cache->count - 2 * DRBD_PP_BATCH;
+		surplus = page_chain_del(&cache->pages, n);
+		cache->count -= n;
+		cache->drains++;
 	}
+	spin_unlock(&cache->lock);
+	put_cpu_ptr(drbd_pp_caches);
+
+	if (surplus) {
+		tmp = page_chain_tail(surplus, NULL);
+		spin_lock(&drbd_pp_lock);
+		page_chain_add(&drbd_pp_pool, surplus, tmp);
+		drbd_pp_vacant += n;
+		spin_unlock(&drbd_pp_lock);
+	}
+	return i;
+}
+
+static struct page *__drbd_alloc_pages(unsigned int number, gfp_t gfp_mask)
+{
+	struct page *page = NULL;
+	struct page *tmp = NULL;
+	unsigned int i = 0;
+
+	page = drbd_pp_cache_get(number);
+	if (page)
+		return page;
 
 	for (i = 0; i < number; i++) {
 		tmp = alloc_page(gfp_mask);
@@ -318,13 +446,8 @@ static struct page *__drbd_alloc_pages(unsigned int number, gfp_t gfp_mask)
 	/* Not enough pages immediately available this time.
 	 * No need to jump around here, drbd_alloc_pages will retry this
 	 * function "soon". */
-	if (page) {
-		tmp = page_chain_tail(page, NULL);
-		spin_lock(&drbd_pp_lock);
-		page_chain_add(&drbd_pp_pool, page, tmp);
-		drbd_pp_vacant += i;
-		spin_unlock(&drbd_pp_lock);
-	}
+	if (page)
+		drbd_pp_cache_put(page);
 	return NULL;
 }
 
@@ -394,6 +517,7 @@ struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int num
 {
 	struct drbd_connection *connection =
 		container_of(transport, struct drbd_connection, transport);
+	wait_queue_head_t *wq = NULL;
 	struct page *page = NULL;
 	DEFINE_WAIT(wait);
 	unsigned int mxb;
@@ -411,7 +535,13 @@ struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int num
 		drbd_reclaim_net_peer_reqs(connection);
 
 	while (page == NULL) {
-		prepare_to_wait(&drbd_pp_wait, &wait, TASK_INTERRUPTIBLE);
+		/* Wait for our own connection to give back pages if we are
+		 * throttled by max_buffers, for anyone if the pool is empty. */
+		if (wq)
+			finish_wait(wq, &wait);
+		wq = atomic_read(&connection->pp_in_use) < mxb ?
+			&drbd_pp_wait : &connection->pp_wait;
+		prepare_to_wait(wq, &wait, TASK_INTERRUPTIBLE);
 
 		drbd_reclaim_net_peer_reqs(connection);
 
@@ -432,7 +562,8 @@ struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int num
 		if (schedule_timeout(HZ/10) == 0)
 			mxb = UINT_MAX;
 	}
-	finish_wait(&drbd_pp_wait, &wait);
+	if (wq)
+		finish_wait(wq, &wait);
 
 	if (page)
 		atomic_add(number, &connection->pp_in_use);
@@ -440,7 +571,7 @@ struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int num
 }
 
 /* Must not be used from irq, as that may deadlock: see drbd_alloc_pages.
- * Either links the page chain back to the global pool,
+ * Either links the page chain back to the local page cache,
  * or returns all pages to the system. */
 void drbd_free_pages(struct drbd_transport *transport, struct page *page, int is_net)
 {
@@ -454,19 +585,19 @@ void drbd_free_pages(struct drbd_transport *transport, struct page *page, int is
 
 	if (drbd_pp_vacant > (DRBD_MAX_BIO_SIZE/PAGE_SIZE) * drbd_minor_count)
 		i = page_chain_free(page);
-	else {
-		struct page *tmp;
-		tmp = page_chain_tail(page, &i);
-		spin_lock(&drbd_pp_lock);
-		page_chain_add(&drbd_pp_pool, page, tmp);
-		drbd_pp_vacant += i;
-		spin_unlock(&drbd_pp_lock);
-	}
+	else
+		i = drbd_pp_cache_put(page);
 	i = atomic_sub_return(i, a);
 	if (i < 0)
 		drbd_warn(connection, "ASSERTION FAILED: %s: %d < 0\n",
 			is_net ? "pp_in_use_by_net" : "pp_in_use", i);
-	wake_up(&drbd_pp_wait);
+
+	/* atomic_sub_return() implies a full barrier,
+	 * pairing with prepare_to_wait() in drbd_alloc_pages() */
+	if (waitqueue_active(&connection->pp_wait))
+		wake_up(&connection->pp_wait);
+	if (waitqueue_active(&drbd_pp_wait))
+		wake_up(&drbd_pp_wait);
 }
 
 /* normal: payload_size == request size (bi_size)
@@ -506,6 +637,7 @@ void __drbd_free_peer_req(struct drbd_peer_request *peer_req, int is_net)
 	might_sleep();
 	if (peer_req->flags & EE_HAS_DIGEST)
 		kfree(peer_req->digest);
+	kfree(peer_req->csum);
 	D_ASSERT(peer_device, atomic_read(&peer_req->pending_bios) == 0);
 	D_ASSERT(peer_device, drbd_interval_empty(&peer_req->i));
 	drbd_free_page_chain(&peer_device->connection->transport, &peer_req->page_chain, is_net);
@@ -671,6 +803,7 @@ int drbd_connected(struct drbd_peer_device *peer_device)
 	clear_bit(USE_DEGR_WFC_T, &peer_device->flags);
 	clear_bit(RESIZE_PENDING, &peer_device->flags);
 	mod_timer(&device->request_timer, jiffies + HZ); /* just start it here. */
+	mod_timer(&peer_device->connection->request_timer, jiffies + HZ);
 	return err;
 }
 
@@ -1623,9 +1756,14 @@ int drbd_submit_peer_request(struct drbd_peer_request *peer_req)
 	unsigned nr_pages = peer_req->page_chain.nr_pages;
 	int err = -ENOMEM;
 
-	if (peer_req->flags & EE_SET_OUT_OF_SYNC)
+	if (peer_req_op(peer_req) != REQ_OP_READ)
+		drbd_csum_cache_invalidate(device, sector, data_size);
+
+	if (peer_req->flags & EE_SET_OUT_OF_SYNC) {
+		drbd_bm_sparse_prepare(device, sector, data_size);
 		drbd_set_out_of_sync(peer_req->peer_device,
 				peer_req->i.sector, peer_req->i.size);
+	}
 
 	/* TRIM/DISCARD: for now, always use the helper function
 	 * blkdev_issue_zeroout(..., discard=true).
@@ -1943,6 +2081,106 @@ static void p_req_detail_from_pi(struct drbd_connection *connection,
 	d->digest_size = digest_size;
 }
 
+/* Reads the p_compressed header behind the digest of a DP_COMPRESSED
+ * packet.  @payload is what follows the digest. */
+static int recv_compressed_header(struct drbd_connection *connection,
+				  unsigned int *size, unsigned int payload)
+{
+	struct drbd_compress *c = &connection->compress;
+	struct p_compressed p;
+	int err;
+
+	if (payload < sizeof(p))
+		return -EIO;
+	err = drbd_recv_into(connection, &p, sizeof(p));
+	if (err)
+		return err;
+	err = drbd_compress_peer_alg(connection, p.alg);
+	if (err)
+		return err;
+
+	*size = be32_to_cpu(p.size);
+	c->peer_raw_bytes += *size;
+	c->peer_wire_bytes += payload;
+	return 0;
+}
+
+/* Receives one chunk of a compressed payload into @dst, @len being its
+ * uncompressed size.  Stored chunks go into @dst directly. */
+static int recv_compressed_chunk(struct drbd_connection *connection,
+				 void *dst, unsigned int len, unsigned int *payload)
+{
+	void *src = connection->compress.peer_buf;
+	unsigned int clen;
+	__be16 h;
+	int err;
+
+	if (*payload < sizeof(h))
+		return -EIO;
+	err = drbd_recv_into(connection, &h, sizeof(h));
+	if (err)
+		return err;
+	*payload -= sizeof(h);
+
+	clen = be16_to_cpu(h);
+	if (!clen) {
+		if (*payload < len)
+			return -EIO;
+		*payload -= len;
+		return drbd_recv_into(connection, dst, len);
+	}
+
+	if (clen > *payload || clen >= DRBD_COMPRESS_CHUNK)
+		return -EIO;
+	err = drbd_recv_into(connection, src, clen);
+	if (err)
+		return err;
+	*payload -= clen;
+	return drbd_decompress_chunk(connection, src, clen, dst, len);
+}
+
+/* The DP_COMPRESSED counterpart of tr_ops->recv_pages(): decompress
+ * straight into the page chain */
+static int recv_compressed_pages(struct drbd_connection *connection,
+				 struct drbd_page_chain_head *chain,
+				 unsigned int size, unsigned int payload)
+{
+	struct drbd_transport *transport = &connection->transport;
+	struct page *page;
+	int err = 0;
+
+	drbd_alloc_page_chain(transport, chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
+	page = chain->head;
+	if (!page)
+		return -ENOMEM;
+
+	page_chain_for_each(page) {
+		unsigned int l = min_t(unsigned int, size, PAGE_SIZE);
+		unsigned int off;
+		char *data;
+
+		set_page_chain_offset(page, 0);
+		set_page_chain_size(page, l);
+		data = kmap(page);
+		for (off = 0; off < l && !err; off += DRBD_COMPRESS_CHUNK)
+			err = recv_compressed_chunk(connection, data + off,
+					min_t(unsigned int, l - off, DRBD_COMPRESS_CHUNK),
+					&payload);
+		kunmap(page);
+		if (err)
+			goto fail;
+		size -= l;
+	}
+	if (payload) {
+		err = -EIO;
+		goto fail;
+	}
+	return 0;
+fail:
+	drbd_free_page_chain(transport, chain, 0);
+	return err;
+}
+
 /* used from receive_RSDataReply (recv_resync_read)
  * and from receive_Data.
  * data_size: actual payload ("data in")
@@ -1970,6 +2208,13 @@ read_in_block(struct drbd_peer_device *peer_device, struct drbd_peer_request_det
 			return NULL;
 	}
 
+	if (d->dp_flags & DP_COMPRESSED) {
+		err = recv_compressed_header(peer_device->connection, &d->bi_size,
+					     d->length - d->digest_size);
+		if (err)
+			return NULL;
+	}
+
 	if (!expect(peer_device, IS_ALIGNED(d->bi_size, 512)))
 		return NULL;
 	if (d->dp_flags & (DP_WSAME|DP_DISCARD|DP_ZEROES)) {
@@ -1998,7 +2243,11 @@ read_in_block(struct drbd_peer_device *peer_device, struct drbd_peer_request_det
 	if (d->length == 0)
 		return peer_req;
 
-	err = tr_ops->recv_pages(transport, &peer_req->page_chain, d->length - d->digest_size);
+	if (d->dp_flags & DP_COMPRESSED)
+		err = recv_compressed_pages(peer_device->connection, &peer_req->page_chain,
+				d->bi_size, d->length - d->digest_size - sizeof(struct p_compressed));
+	else
+		err = tr_ops->recv_pages(transport, &peer_req->page_chain, d->length - d->digest_size);
 	if (err)
 		goto fail;
 
@@ -2045,8 +2294,74 @@ static int ignore_remaining_packet(struct drbd_connection *connection, int size)
 	return 0;
 }
 
+/* Skip the data of a P_DATA or P_RS_DATA_REPLY packet we can not write.
+ * Of a compressed one, we need the header for d->bi_size. */
+static int ignore_remaining_data(struct drbd_connection *connection,
+				 struct drbd_peer_request_details *d)
+{
+	unsigned int size = d->length;
+	int err;
+
+	if (d->dp_flags & DP_COMPRESSED) {
+		err = ignore_remaining_packet(connection, d->digest_size);
+		if (err)
+			return err;
+		size -= d->digest_size;
+		err = recv_compressed_header(connection, &d->bi_size, size);
+		if (err)
+			return err;
+		size -= sizeof(struct p_compressed);
+	}
+
+	return ignore_remaining_packet(connection, size);
+}
+
+/* The DP_COMPRESSED part of recv_dless_read().  The bio segments are not
+ * aligned to chunks, decompress into peer_buf and copy from there. */
+static int recv_compressed_bio(struct drbd_connection *connection, struct bio *bio,
+			       unsigned int size, unsigned int payload)
+{
+	char *chunk = connection->compress.peer_buf + DRBD_COMPRESS_CHUNK;
+	unsigned int avail = 0, pos = 0;
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	int err = 0;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		char *mapped = kmap(bvec.bv_page) + bvec.bv_offset;
+		unsigned int len = bvec.bv_len;
+
+		while (len) {
+			unsigned int l;
+
+			if (pos == avail) {
+				if (!size) {
+					err = -EIO;
+					break;
+				}
+				avail = min_t(unsigned int, size, DRBD_COMPRESS_CHUNK);
+				err = recv_compressed_chunk(connection, chunk, avail, &payload);
+				if (err)
+					break;
+				size -= avail;
+				pos = 0;
+			}
+			l = min(len, avail - pos);
+			memcpy(mapped, chunk + pos, l);
+			mapped += l;
+			pos += l;
+			len -= l;
+		}
+		kunmap(bvec.bv_page);
+		if (err)
+			return err;
+	}
+
+	return size || pos != avail || payload ? -EIO : 0;
+}
+
 static int recv_dless_read(struct drbd_peer_device *peer_device, struct drbd_request *req,
-			   sector_t sector, int data_size)
+			   sector_t sector, int data_size, unsigned int dp_flags)
 {
 	struct bio_vec bvec;
 	struct bvec_iter iter;
@@ -2064,13 +2379,30 @@ static int recv_dless_read(struct drbd_peer_device *peer_device, struct drbd_req
 		data_size -= digest_size;
 	}
 
+	bio = req->master_bio;
+	D_ASSERT(peer_device->device, sector == bio->bi_iter.bi_sector);
+
+	if (dp_flags & DP_COMPRESSED) {
+		unsigned int size;
+
+		err = recv_compressed_header(peer_device->connection, &size, data_size);
+		if (err)
+			return err;
+		if (size != bio->bi_iter.bi_size)
+			return -EIO;
+		peer_device->recv_cnt += size >> 9;
+		err = recv_compressed_bio(peer_device->connection, bio, size,
+					  data_size - sizeof(struct p_compressed));
+		if (err)
+			return err;
+		data_size = 0;
+		goto verify;
+	}
+
 	/* optimistically update recv_cnt.  if receiving fails below,
 	 * we disconnect anyways, and counters will be reset. */
 	peer_device->recv_cnt += data_size >> 9;
 
-	bio = req->master_bio;
-	D_ASSERT(peer_device->device, sector == bio->bi_iter.bi_sector);
-
 	bio_for_each_segment(bvec, bio, iter) {
 		void *mapped = kmap(bvec.bv_page) + bvec.bv_offset;
 		expect = min_t(int, data_size, bvec.bv_len);
@@ -2081,6 +2413,7 @@ static int recv_dless_read(struct drbd_peer_device *peer_device, struct drbd_req
 		data_size -= expect;
 	}
 
+verify:
 	if (digest_size) {
 		drbd_csum_bio(peer_device->connection->peer_integrity_tfm, bio, dig_vv);
 		if (memcmp(dig_in, dig_vv, digest_size)) {
@@ -2225,9 +2558,11 @@ static int receive_DataReply(struct drbd_connection *connection, struct packet_i
 	if (unlikely(!req))
 		return -EIO;
 
-	err = recv_dless_read(peer_device, req, sector, pi->size);
-	if (!err)
+	err = recv_dless_read(peer_device, req, sector, pi->size, be32_to_cpu(p->dp_flags));
+	if (!err) {
+		drbd_rb_account(&peer_device->rb_stats, req);
 		req_mod(req, DATA_RECEIVED, peer_device);
+	}
 	/* else: nothing. handled from drbd_disconnect...
 	 * I don't think we may complete this just yet
 	 * in case we are "on-disconnect: freeze" */
@@ -2327,7 +2662,7 @@ static int receive_RSDataReply(struct drbd_connection *connection, struct packet
 		if (drbd_ratelimit())
 			drbd_err(device, "Can not write resync data to local disk.\n");
 
-		err = ignore_remaining_packet(connection, pi->size);
+		err = ignore_remaining_data(connection, &d);
 
 		drbd_send_ack_dp(peer_device, P_NEG_ACK, &d);
 	}
@@ -2752,6 +3087,36 @@ static void drbd_queue_peer_request(struct drbd_device *device, struct drbd_peer
 	wake_up(&device->al_wait);
 }
 
+/* The peer request is already in the activity log.
+ * Hand it to the per-volume submitter, see drbd_parallel_peer_submit. */
+static void drbd_queue_peer_submit(struct drbd_device *device, struct drbd_peer_request *peer_req)
+{
+	spin_lock(&device->submit.lock);
+	list_add_tail(&peer_req->wait_for_actlog, &device->submit.peer_ready);
+	spin_unlock(&device->submit.lock);
+	queue_work(drbd_peer_submit_wq, &device->submit.peer_submit);
+}
+
+void do_peer_submit(struct work_struct *ws)
+{
+	struct drbd_device *device = container_of(ws, struct drbd_device, submit.peer_submit);
+	struct drbd_peer_request *peer_req, *tmp;
+	struct blk_plug plug;
+	LIST_HEAD(ready);
+
+	spin_lock(&device->submit.lock);
+	list_splice_init(&device->submit.peer_ready, &ready);
+	spin_unlock(&device->submit.lock);
+
+	blk_start_plug(&plug);
+	list_for_each_entry_safe(peer_req, tmp, &ready, wait_for_actlog) {
+		list_del_init(&peer_req->wait_for_actlog);
+		if (drbd_submit_peer_request(peer_req))
+			drbd_cleanup_after_failed_submit_peer_request(peer_req);
+	}
+	blk_finish_plug(&plug);
+}
+
 /* FIXME
  * TODO grab the device->al_lock *once*, and check:
  *     if possible, non-blocking get the reference(s),
@@ -2770,7 +3135,7 @@ prepare_activity_log(struct drbd_peer_request *peer_req)
 	struct drbd_device *device = peer_device->device;
 
 	struct lru_cache *al;
-	int nr_al_extents = interval_to_al_extents(&peer_req->i);
+	int nr_al_extents = interval_to_al_extents(device, &peer_req->i);
 	int nr, used, ecnt;
 	int ret = DRBD_PAL_SUBMIT;
 
@@ -2781,7 +3146,7 @@ prepare_activity_log(struct drbd_peer_request *peer_req)
 	spin_lock_irq(&device->al_lock);
 	al = device->act_log;
 	nr = al->nr_elements;
-	used = al->used;
+	used = drbd_al_used(device);
 	spin_unlock_irq(&device->al_lock);
 
 	/* note: due to the slight delay between being accounted in "used" after
@@ -2835,9 +3200,9 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 		int err2;
 
 		err = wait_for_and_update_peer_seq(peer_device, d.peer_seq);
+		err2 = ignore_remaining_data(connection, &d);
 		drbd_send_ack_dp(peer_device, P_NEG_ACK, &d);
 		atomic_inc(&connection->current_epoch->epoch_size);
-		err2 = ignore_remaining_packet(connection, pi->size);
 		if (!err)
 			err = err2;
 		return err;
@@ -3008,6 +3373,14 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 		return 0;
 	}
 
+	/* Epoch accounting is already done above, so completion of the
+	 * peer request still finishes its epoch in drbd_may_finish_epoch(),
+	 * no matter which context submits it. */
+	if (drbd_parallel_peer_submit) {
+		drbd_queue_peer_submit(device, peer_req);
+		return 0;
+	}
+
 	err = drbd_submit_peer_request(peer_req);
 	if (!err)
 		return 0;
@@ -3081,7 +3454,7 @@ void drbd_cleanup_peer_requests_wfa(struct drbd_device *device, struct list_head
 	write_unlock_irq(&device->resource->state_rwlock);
 
 	list_for_each_entry_safe(peer_req, pr_tmp, cleanup, wait_for_actlog) {
-		atomic_sub(interval_to_al_extents(&peer_req->i), &device->wait_for_actlog_ecnt);
+		atomic_sub(interval_to_al_extents(device, &peer_req->i), &device->wait_for_actlog_ecnt);
 		atomic_dec(&device->wait_for_actlog);
 		dec_unacked(peer_req->peer_device);
 		list_del_init(&peer_req->wait_for_actlog);
@@ -3164,7 +3537,8 @@ bool drbd_rs_c_min_rate_throttle(struct drbd_peer_device *peer_device)
 	return false;
 }
 
-static void verify_skipped_block(struct drbd_peer_device *peer_device,
+/* Only the statistics, the caller accounts for the progress */
+void verify_note_skipped(struct drbd_peer_device *peer_device,
 		const sector_t sector, const unsigned int size)
 {
 	++peer_device->ov_skipped;
@@ -3175,6 +3549,12 @@ static void verify_skipped_block(struct drbd_peer_device *peer_device,
 		peer_device->ov_last_skipped_start = sector;
 		peer_device->ov_last_skipped_size = size>>9;
 	}
+}
+
+void verify_skipped_block(struct drbd_peer_device *peer_device,
+		const sector_t sector, const unsigned int size)
+{
+	verify_note_skipped(peer_device, sector, size);
 	verify_progress(peer_device, sector, size);
 }
 
@@ -3423,7 +3803,7 @@ submit_for_resync:
 submit:
 	update_receiver_timing_details(connection, drbd_submit_peer_request);
 	inc_unacked(peer_device);
-	if (drbd_submit_peer_request(peer_req) == 0)
+	if (drbd_csum_cache_hit(peer_req) || drbd_submit_peer_request(peer_req) == 0)
 		return 0;
 
 	/* don't care for the reason here */
@@ -4553,6 +4933,7 @@ static int receive_SyncParam(struct drbd_connection *connection, struct packet_i
 			new_net_conf->verify_alg_len = strlen(p->verify_alg) + 1;
 			crypto_free_shash(connection->verify_tfm);
 			connection->verify_tfm = verify_tfm;
+			connection->verify_zero.size = 0;
 			drbd_info(device, "using verify-alg: \"%s\"\n", p->verify_alg);
 		}
 		if (csums_tfm) {
@@ -7111,7 +7492,11 @@ static int receive_out_of_sync(struct drbd_connection *connection, struct packet
 	struct drbd_peer_device *peer_device;
 	struct drbd_device *device;
 	struct p_block_desc *p = pi->data;
+	struct p_oos_range *r = NULL;
+	unsigned int i, n = 0;
 	sector_t sector;
+	unsigned int size;
+	int err;
 
 	peer_device = conn_peer_device(connection, pi->vnr);
 	if (!peer_device)
@@ -7119,6 +7504,33 @@ static int receive_out_of_sync(struct drbd_connection *connection, struct packet
 	device = peer_device->device;
 
 	sector = be64_to_cpu(p->sector);
+	size = be32_to_cpu(p->blksize);
+
+	/* the ranges of a coalesced notification, see drbd_queue_out_of_sync() */
+	if (pi->size) {
+		n = pi->size / sizeof(*r);
+		if (!(connection->agreed_features & DRBD_FF_OOS_RANGES) || size ||
+		    pi->size != n * sizeof(*r) || n > DRBD_OOS_EXTENT_BITS / 2 ||
+		    BM_SECT_TO_BIT(sector) & (DRBD_OOS_EXTENT_BITS - 1)) {
+			drbd_err(peer_device, "Unexpected out-of-sync ranges (%u bytes)\n", pi->size);
+			return -EIO;
+		}
+		err = drbd_recv_all_warn(connection, (void **)&r, pi->size);
+		if (err)
+			return err;
+		/* non-empty, ascending and apart, as drbd_send_out_of_sync_ranges()
+		 * builds them; r[0] is the lowest one */
+		for (i = 0; i < n; i++) {
+			unsigned int first = be16_to_cpu(r[i].first);
+			unsigned int count = be16_to_cpu(r[i].count);
+
+			if (!count || first + count > DRBD_OOS_EXTENT_BITS ||
+			    (i && first <= be16_to_cpu(r[i - 1].first) + be16_to_cpu(r[i - 1].count))) {
+				drbd_err(peer_device, "Invalid out-of-sync range %u+%u\n", first, count);
+				return -EIO;
+			}
+		}
+	}
 
 	/* see also process_one_request(), before drbd_send_out_of_sync().
 	 * Make sure any pending write requests that potentially may
@@ -7133,11 +7545,20 @@ static int receive_out_of_sync(struct drbd_connection *connection, struct packet
 
 	if (peer_device->repl_state[NOW] == L_SYNC_TARGET) {
 		unsigned long bit = BM_SECT_TO_BIT(sector);
+
+		if (n)
+			bit += be16_to_cpu(r[0].first);
 		if (bit < peer_device->resync_next_bit)
 			peer_device->resync_next_bit = bit;
 	}
 
-	drbd_set_out_of_sync(peer_device, sector, be32_to_cpu(p->blksize));
+	drbd_bm_sparse_prepare(device, sector, size);
+	if (!n)
+		drbd_set_out_of_sync(peer_device, sector, size);
+	for (i = 0; i < n; i++)
+		drbd_set_out_of_sync(peer_device,
+				     sector + BM_BIT_TO_SECT(be16_to_cpu(r[i].first)),
+				     be16_to_cpu(r[i].count) << BM_BLOCK_SHIFT);
 
 	mutex_unlock(&peer_device->resync_next_bit_mutex);
 
@@ -7427,7 +7848,7 @@ static struct data_cmd drbd_cmd_handler[] = {
 	[P_CSUM_RS_REQUEST] = { 1, sizeof(struct p_block_req), receive_DataRequest },
 	[P_RS_THIN_REQ]     = { 0, sizeof(struct p_block_req), receive_DataRequest },
 	[P_DELAY_PROBE]     = { 0, sizeof(struct p_delay_probe93), receive_skip },
-	[P_OUT_OF_SYNC]     = { 0, sizeof(struct p_block_desc), receive_out_of_sync },
+	[P_OUT_OF_SYNC]     = { 1, sizeof(struct p_block_desc), receive_out_of_sync },
 	[P_PROTOCOL_UPDATE] = { 1, sizeof(struct p_protocol), receive_protocol },
 	[P_TWOPC_PREPARE] = { 0, sizeof(struct p_twopc_request), receive_twopc },
 	[P_TWOPC_PREP_RSZ]  = { 0, sizeof(struct p_twopc_request), receive_twopc },
@@ -7565,6 +7986,7 @@ static void peer_device_disconnected(struct drbd_peer_device *peer_device)
 	drbd_rs_cancel_all(peer_device);
 
 	peer_device->uuids_received = false;
+	drbd_clear_out_of_sync_batch(peer_device);
 
 	if (!drbd_suspended(device)) {
 		struct drbd_resource *resource = device->resource;
@@ -7854,6 +8276,9 @@ int drbd_do_features(struct drbd_connection *connection)
 
 	connection->agreed_pro_version = min_t(int, PRO_VERSION_MAX, p->protocol_max);
 	connection->agreed_features = PRO_FEATURES & be32_to_cpu(p->feature_flags);
+	connection->verify_zero.size = 0; /* may now be chunked, or no longer */
+	if (connection->agreed_features & DRBD_FF_COMPRESS)
+		drbd_compress_init(connection);
 
 	if (be32_to_cpu(p->sender_node_id) != connection->peer_node_id) {
 		drbd_err(connection, "Peer presented a node_id of %d instead of %d\n",
@@ -7871,11 +8296,13 @@ int drbd_do_features(struct drbd_connection *connection)
 			connection->peer_node_id,
 			connection->agreed_pro_version);
 
-	drbd_info(connection, "Feature flags enabled on protocol level: 0x%x%s%s%s%s.\n",
+	drbd_info(connection, "Feature flags enabled on protocol level: 0x%x%s%s%s%s%s%s.\n",
 		  connection->agreed_features,
 		  connection->agreed_features & DRBD_FF_TRIM ? " TRIM" : "",
 		  connection->agreed_features & DRBD_FF_THIN_RESYNC ? " THIN_RESYNC" : "",
 		  connection->agreed_features & DRBD_FF_WSAME ? " WRITE_SAME" : "",
+		  connection->agreed_features & DRBD_FF_COMPRESS ? " COMPRESS" : "",
+		  connection->agreed_features & DRBD_FF_OV_TREE ? " OV_TREE" : "",
 		  connection->agreed_features & DRBD_FF_WZEROES ? " WRITE_ZEROES" :
 		  connection->agreed_features ? "" : " none");
 
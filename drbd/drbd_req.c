@@ -773,8 +773,10 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 	if (!(old_net & RQ_NET_DONE) && (set & RQ_NET_DONE)) {
 		atomic_t *ap_in_flight = &peer_device->connection->ap_in_flight;
 
-		if (old_net & RQ_NET_SENT)
+		if (old_net & RQ_NET_SENT) {
 			atomic_sub(req_payload_sectors(req), ap_in_flight);
+			atomic64_add(req_payload_sectors(req), &peer_device->connection->cong.drained);
+		}
 		if (old_net & RQ_EXP_BARR_ACK)
 			kref_put(&req->kref, drbd_req_destroy);
 		ktime_get_accounting(req->net_done_kt[peer_device->node_id]);
@@ -1308,6 +1310,165 @@ static void complete_conflicting_writes(struct drbd_request *req)
 	finish_wait(&device->misc_wait, &wait);
 }
 
+/* Called with connection->cong.lock and rcu_read_lock() held */
+static void drbd_cong_sample(struct drbd_connection *connection)
+{
+	struct drbd_cong_model *cm = &connection->cong;
+	struct drbd_transport *transport = &connection->transport;
+	u64 dagtag_sector = READ_ONCE(connection->resource->dagtag_sector);
+	u64 drained = atomic64_read(&cm->drained);
+	unsigned long now = jiffies, dt = now - cm->sample_jif;
+	unsigned int backlog, rate;
+
+	if (cm->sample_jif && dt < HZ / 10)
+		return;
+
+	backlog = atomic_read(&connection->ap_in_flight) +
+		atomic_read(&connection->rs_in_flight);
+	if (cm->sample_jif) {
+		rate = min_t(u64, div_u64((dagtag_sector - cm->last_dagtag_sector) * HZ, dt), UINT_MAX);
+		/* after a pause, what was written before does not count */
+		if (dt > HZ)
+			cm->write_rate = rate;
+		else
+			cm->write_rate = cm->write_rate - cm->write_rate / 4 + rate / 4;
+
+		/* Without a backlog we only learn how much was written, not
+		 * how much the link could have taken. */
+		if (cm->backlog && backlog) {
+			rate = min_t(u64, div_u64((drained - cm->last_drained) * HZ, dt), UINT_MAX);
+			if (cm->drain_rate)
+				cm->drain_rate = cm->drain_rate - cm->drain_rate / 4 + rate / 4;
+			else
+				cm->drain_rate = rate;
+		}
+	}
+	cm->sample_jif = now;
+	cm->last_dagtag_sector = dagtag_sector;
+	cm->last_drained = drained;
+	cm->backlog = backlog;
+
+	cm->sndbuf_used = 0;
+	cm->sndbuf_size = 0;
+	if (transport->ops->stream_ok(transport, DATA_STREAM)) {
+		struct drbd_transport_stats transport_stats = {};
+
+		transport->ops->stats(transport, &transport_stats);
+		cm->sndbuf_used = transport_stats.send_buffer_used;
+		cm->sndbuf_size = transport_stats.send_buffer_size;
+	}
+}
+
+static void drbd_cong_record(struct drbd_cong_model *cm, enum drbd_cong_decision what,
+			     unsigned int eta_ms)
+{
+	struct drbd_cong_event *ev = &cm->history[(cm->events - 1) % DRBD_CONG_HISTORY];
+
+	/* while we keep staying Ahead, only update the latest entry */
+	if (!cm->events || what != CONG_STAY_AHEAD || ev->what != what)
+		ev = &cm->history[cm->events++ % DRBD_CONG_HISTORY];
+
+	ev->jif = jiffies;
+	ev->what = what;
+	ev->backlog = cm->backlog;
+	ev->write_rate = cm->write_rate;
+	ev->drain_rate = cm->drain_rate;
+	ev->eta_ms = eta_ms;
+}
+
+static void drbd_cong_threshold(struct drbd_connection *connection, enum drbd_cong_decision what)
+{
+	spin_lock(&connection->cong.lock);
+	drbd_cong_record(&connection->cong, what, 0);
+	spin_unlock(&connection->cong.lock);
+}
+
+/* Milliseconds until @sectors are used up at @rate sectors per second */
+static unsigned int drbd_cong_eta_ms(u64 sectors, unsigned int rate)
+{
+	if (!rate)
+		return UINT_MAX;
+	return min_t(u64, div_u64(sectors * MSEC_PER_SEC, rate), UINT_MAX);
+}
+
+/* The thresholds only trigger once the backlog is there, and with protocol A
+ * a full send buffer already stalls the application.  If writes come in
+ * faster than the peer acknowledges them, pull ahead before that happens. */
+static bool drbd_cong_predicted(struct drbd_device *device, struct drbd_connection *connection,
+				u32 cong_fill, unsigned int horizon_ms)
+{
+	struct drbd_cong_model *cm = &connection->cong;
+	unsigned int eta_ms = UINT_MAX, write_rate, drain_rate;
+	bool congested = false;
+
+	spin_lock(&cm->lock);
+	drbd_cong_sample(connection);
+	write_rate = cm->write_rate;
+	drain_rate = cm->drain_rate;
+	if (cm->backlog && drain_rate && write_rate > drain_rate) {
+		unsigned int growth = write_rate - drain_rate;
+
+		if (cong_fill)
+			eta_ms = drbd_cong_eta_ms(cong_fill - min(cm->backlog, cong_fill), growth);
+		if (cm->sndbuf_size) {
+			unsigned int room = cm->sndbuf_size - min(cm->sndbuf_used, cm->sndbuf_size);
+
+			eta_ms = min(eta_ms, drbd_cong_eta_ms(room >> 9, growth));
+		}
+		congested = eta_ms < horizon_ms;
+	}
+	if (congested)
+		drbd_cong_record(cm, CONG_PREDICTED, eta_ms);
+	spin_unlock(&cm->lock);
+
+	if (congested)
+		drbd_info(device, "Congestion predicted in %u ms (writes %u KiB/s, acked %u KiB/s)\n",
+			  eta_ms, write_rate / 2, drain_rate / 2);
+	return congested;
+}
+
+/**
+ * drbd_cong_catch_up() - Whether to go from Ahead to SyncSource now
+ * @peer_device:	DRBD peer device that is Ahead.
+ *
+ * Resyncing while the application writes more than what the link could
+ * drain before we pulled ahead would soon have us pull ahead again.  Stay
+ * Ahead until the out-of-sync blocks of all volumes of the connection are
+ * projected to be resynced within ahead_catch_up_ms.
+ */
+bool drbd_cong_catch_up(struct drbd_peer_device *peer_device)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	struct drbd_cong_model *cm = &connection->cong;
+	struct drbd_peer_device *pd;
+	unsigned int eta_ms = UINT_MAX;
+	u64 out_of_sync = 0;
+	bool catch_up;
+	int vnr;
+
+	if (!drbd_ahead_catch_up_ms)
+		return true;
+
+	rcu_read_lock();
+	idr_for_each_entry(&connection->peer_devices, pd, vnr) {
+		if (pd->repl_state[NOW] == L_AHEAD)
+			out_of_sync += drbd_bm_total_weight(pd);
+	}
+
+	spin_lock_irq(&cm->lock);
+	drbd_cong_sample(connection);
+	if (cm->drain_rate > cm->write_rate)
+		eta_ms = drbd_cong_eta_ms(out_of_sync << (BM_BLOCK_SHIFT - 9),
+					  cm->drain_rate - cm->write_rate);
+	/* If we never saw the link busy, we can not tell; do not stay Ahead */
+	catch_up = !cm->drain_rate || eta_ms <= drbd_ahead_catch_up_ms;
+	drbd_cong_record(cm, catch_up ? CONG_CATCH_UP : CONG_STAY_AHEAD, eta_ms);
+	spin_unlock_irq(&cm->lock);
+	rcu_read_unlock();
+
+	return catch_up;
+}
+
 static void __maybe_pull_ahead(struct drbd_device *device, struct drbd_connection *connection)
 {
 	struct net_conf *nc;
@@ -1351,15 +1512,22 @@ static void __maybe_pull_ahead(struct drbd_device *device, struct drbd_connectio
 		if (n >= cong_fill) {
 			drbd_info(device, "Congestion-fill threshold reached (%d >= %d)\n", n, cong_fill);
 			congested = true;
+			drbd_cong_threshold(connection, CONG_FILL);
 		}
 	}
 
-	if (!congested && device->act_log->used >= cong_extents) {
-		drbd_info(device, "Congestion-extents threshold reached (%d >= %d)\n",
-			device->act_log->used, cong_extents);
+	if (!congested && drbd_al_used(device) >= cong_extents) {
+		drbd_info(device, "Congestion-extents threshold reached (%u >= %u)\n",
+			drbd_al_used(device), cong_extents);
 		congested = true;
+		drbd_cong_threshold(connection, CONG_EXTENTS);
 	}
 
+	/* sampled here as well when only ahead_catch_up_ms is set */
+	if (!congested && (drbd_cong_horizon_ms || drbd_ahead_catch_up_ms))
+		congested = drbd_cong_predicted(device, connection, cong_fill,
+				on_congestion == OC_PULL_AHEAD ? drbd_cong_horizon_ms : 0);
+
 	if (congested) {
 		set_bit(CONN_CONGESTED, &connection->flags);
 		drbd_peer_device_post_work(peer_device, HANDLE_CONGESTION);
@@ -1395,6 +1563,25 @@ bool drbd_should_do_remote(struct drbd_peer_device *peer_device, enum which_stat
 	   states. */
 }
 
+/* Will completing this write set bits for some peer?  Then let a sparse
+ * bitmap get the pages for that now, while we may still sleep. */
+static bool drbd_write_may_set_bits(struct drbd_device *device)
+{
+	struct drbd_peer_device *peer_device;
+	bool may_set = false;
+
+	rcu_read_lock();
+	for_each_peer_device_rcu(peer_device, device) {
+		if (peer_device->bitmap_index != -1 &&
+		    !drbd_should_do_remote(peer_device, NOW)) {
+			may_set = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	return may_set;
+}
+
 static bool drbd_should_send_out_of_sync(struct drbd_peer_device *peer_device)
 {
 	return peer_device->repl_state[NOW] == L_AHEAD || peer_device->repl_state[NOW] == L_WF_BITMAP_S;
@@ -1430,6 +1617,147 @@ static u64 calc_nodes_to_read_from(struct drbd_device *device)
 	return 0;
 }
 
+/* Called when a read completed successfully on the target it was sent to
+ * by find_peer_device_for_read_adaptive() */
+void drbd_rb_account(struct drbd_rb_stats *s, struct drbd_request *req)
+{
+	unsigned long latency, ns;
+	unsigned int depth;
+
+	if (!ktime_to_ns(req->rb_start_kt))
+		return;
+	ns = ktime_to_ns(ktime_sub(ktime_get(), req->rb_start_kt));
+	req->rb_start_kt = ktime_set(0, 0);
+
+	latency = READ_ONCE(s->latency_ns);
+	depth = READ_ONCE(s->depth);
+	if (READ_ONCE(s->reads)) {
+		latency = latency - latency / 8 + ns / 8;
+		depth = depth - depth / 8 + (req->rb_depth << 4) / 8;
+	} else {
+		latency = ns;
+		depth = req->rb_depth << 4;
+	}
+	WRITE_ONCE(s->latency_ns, latency);
+	WRITE_ONCE(s->depth, depth);
+	WRITE_ONCE(s->last_jif, jiffies);
+	WRITE_ONCE(s->probe_jif, 0);
+	WRITE_ONCE(s->reads, s->reads + 1);
+}
+
+/* The latencies we measured come with the queue depth they were measured
+ * at; by Little's law, scale them to the current queue depth. */
+static u64 rb_expected_ns(struct drbd_rb_stats *s, unsigned int depth)
+{
+	return div_u64((u64)READ_ONCE(s->latency_ns) * ((depth + 1) << 4),
+		       READ_ONCE(s->depth) + 16);
+}
+
+/* A target we did not hear from for a second gets one read, so that we
+ * notice when it got faster again.  One read, not all reads until the first
+ * of them completed: while the probe is in flight, the target is scored by
+ * what we measured before, if anything.  Failed reads are not accounted,
+ * so a probe not back after a second is given up. */
+static bool rb_probe(struct drbd_rb_stats *s)
+{
+	unsigned long probe = READ_ONCE(s->probe_jif);
+
+	if (READ_ONCE(s->reads) && !time_after(jiffies, READ_ONCE(s->last_jif) + HZ))
+		return false;
+	if (probe && !time_after(jiffies, probe + HZ))
+		return false;
+	return cmpxchg(&s->probe_jif, probe, jiffies ?: 1) == probe;
+}
+
+/* Pick the expected-fastest of the local disk and the UpToDate peers.  To
+ * avoid flapping between targets of similar speed, we stay with the one we
+ * picked last time unless another one is expected to be faster by more
+ * than an eighth. */
+static struct drbd_peer_device *find_peer_device_for_read_adaptive(struct drbd_request *req)
+{
+	struct drbd_device *device = req->device;
+	struct drbd_peer_device *peer_device, *best = NULL, *least = NULL;
+	u64 nodes = calc_nodes_to_read_from(device);
+	int target = device->rb_target;
+	u64 best_ns = U64_MAX, target_ns = U64_MAX;
+	unsigned int best_depth = 0, least_depth = UINT_MAX, depth;
+	bool local = req->private_bio != NULL;
+
+	if (local) {
+		depth = atomic_read(&device->local_cnt);
+		best_depth = depth;
+		if (rb_probe(&device->rb_local))
+			goto out;
+		if (READ_ONCE(device->rb_local.reads)) {
+			best_ns = rb_expected_ns(&device->rb_local, depth);
+			if (target == -1)
+				target_ns = best_ns;
+		}
+	}
+
+	for_each_peer_device(peer_device, device) {
+		struct drbd_rb_stats *s = &peer_device->rb_stats;
+		u64 ns;
+
+		if (!(nodes & NODE_MASK(peer_device->node_id)) ||
+		    peer_device->disk_state[NOW] != D_UP_TO_DATE)
+			continue;
+		depth = atomic_read(&peer_device->ap_pending_cnt) +
+			atomic_read(&peer_device->rs_pending_cnt);
+		if (depth < least_depth) {
+			least = peer_device;
+			least_depth = depth;
+		}
+		if (rb_probe(s)) {
+			best = peer_device;
+			best_depth = depth;
+			goto out;
+		}
+		if (!READ_ONCE(s->reads))
+			continue;
+		ns = rb_expected_ns(s, depth);
+		if (peer_device->node_id == target)
+			target_ns = ns;
+		if (ns < best_ns) {
+			best_ns = ns;
+			best = peer_device;
+			best_depth = depth;
+		}
+	}
+
+	if (target_ns != U64_MAX && best_ns + best_ns / 8 >= target_ns &&
+	    (best ? best->node_id : -1) != target) {
+		/* not worth switching */
+		if (target == -1) {
+			best = NULL;
+			best_depth = atomic_read(&device->local_cnt);
+		} else {
+			best = peer_device_by_node_id(device, target);
+			best_depth = atomic_read(&best->ap_pending_cnt) +
+				atomic_read(&best->rs_pending_cnt);
+		}
+	}
+	if (!best && !local) {
+		/* Nothing measured yet, and the probes are out: without a
+		 * disk of our own, read from the least busy one anyway */
+		if (!least)
+			return NULL;
+		best = least;
+		best_depth = least_depth;
+	}
+out:
+	device->rb_target = best ? best->node_id : -1;
+	req->rb_start_kt = ktime_get();
+	req->rb_depth = best_depth;
+
+	if (best && req->private_bio) {
+		bio_put(req->private_bio);
+		req->private_bio = NULL;
+		put_ldev(device);
+	}
+	return best;
+}
+
 /* If this returns NULL, and req->private_bio is still set,
  * the request should be submitted locally.
  *
@@ -1463,6 +1791,9 @@ static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *r
 		}
 	}
 
+	if (drbd_adaptive_read_balancing && (rbm == RB_LEAST_PENDING || !req->private_bio))
+		return find_peer_device_for_read_adaptive(req);
+
 	/* TODO: improve read balancing decisions, allow user to configure node weights */
 	while (true) {
 		if (!device->read_nodes)
@@ -1551,6 +1882,8 @@ drbd_submit_req_private_bio(struct drbd_request *req)
 	 * stable storage, and this is a WRITE, we may not even submit
 	 * this bio. */
 	if (get_ldev(device)) {
+		if (type == DRBD_FAULT_DT_WR)
+			drbd_csum_cache_invalidate(device, req->i.sector, req->i.size);
 		if (drbd_insert_fault(device, type)) {
 			bio->bi_status = BLK_STS_IOERR;
 			bio_endio(bio);
@@ -1571,11 +1904,18 @@ drbd_submit_req_private_bio(struct drbd_request *req)
 
 static void drbd_queue_write(struct drbd_device *device, struct drbd_request *req)
 {
+	struct drbd_submit_queue *q;
+
 	if (req->private_bio)
 		atomic_inc(&device->ap_actlog_cnt);
-	spin_lock(&device->submit.lock);
-	list_add_tail(&req->list, &device->submit.writes);
-	spin_unlock(&device->submit.lock);
+	q = get_cpu_ptr(device->submit.queues);
+	spin_lock(&q->lock);
+	if (list_empty(&q->writes))
+		q->first_kt = ktime_get();
+	list_add_tail(&req->list, &q->writes);
+	q->nr++;
+	spin_unlock(&q->lock);
+	put_cpu_ptr(device->submit.queues);
 	spin_lock_irq(&device->pending_completion_lock);
 	list_add_tail(&req->req_pending_master_completion,
 			&device->pending_master_completion[1 /* WRITE */]);
@@ -1601,7 +1941,7 @@ static void drbd_req_in_actlog(struct drbd_request *req)
 {
 	req->local_rq_state |= RQ_IN_ACT_LOG;
 	ktime_get_accounting(req->in_actlog_kt);
-	atomic_sub(interval_to_al_extents(&req->i), &req->device->wait_for_actlog_ecnt);
+	atomic_sub(interval_to_al_extents(req->device, &req->i), &req->device->wait_for_actlog_ecnt);
 }
 
 /* returns the new drbd_request pointer, if the caller is expected to
@@ -1651,7 +1991,7 @@ drbd_request_prepare(struct drbd_device *device, struct bio *bio,
 	 * in receive_Data() { ... prepare_activity_log(); ... }
 	 */
 	if (req->private_bio)
-		atomic_add(interval_to_al_extents(&req->i), &device->wait_for_actlog_ecnt);
+		atomic_add(interval_to_al_extents(device, &req->i), &device->wait_for_actlog_ecnt);
 
 	/* process discards always from our submitter thread */
 	if ((bio_op(bio) == REQ_OP_WRITE_ZEROES) ||
@@ -1776,6 +2116,9 @@ static void drbd_send_and_submit(struct drbd_device *device, struct drbd_request
 	bool no_remote = false;
 	bool submit_private_bio = false;
 
+	if (rw == WRITE && req->private_bio && drbd_write_may_set_bits(device))
+		drbd_bm_sparse_prepare(device, req->i.sector, req->i.size);
+
 	read_lock_irq(&resource->state_rwlock);
 
 	if (rw == WRITE) {
@@ -2033,7 +2376,7 @@ static void __drbd_submit_peer_request(struct drbd_peer_request *peer_req)
 	int err;
 
 	peer_req->flags |= EE_IN_ACTLOG;
-	atomic_sub(interval_to_al_extents(&peer_req->i), &device->wait_for_actlog_ecnt);
+	atomic_sub(interval_to_al_extents(device, &peer_req->i), &device->wait_for_actlog_ecnt);
 	atomic_dec(&device->wait_for_actlog);
 	list_del_init(&peer_req->wait_for_actlog);
 
@@ -2161,17 +2504,65 @@ static void send_and_submit_pending(struct drbd_device *device, struct waiting_f
 	blk_finish_plug(&plug);
 }
 
+/* It is ok to look outside the locks, it's only an optimization anyways */
+static bool submit_queues_empty(struct drbd_device *device)
+{
+	int cpu;
+
+	if (!list_empty(&device->submit.peer_writes))
+		return false;
+	for_each_possible_cpu(cpu) {
+		if (!list_empty(&per_cpu_ptr(device->submit.queues, cpu)->writes))
+			return false;
+	}
+	return true;
+}
+
+static void account_submit_batch(struct submit_worker *submit, unsigned int nr, ktime_t oldest)
+{
+	u64 wait_us = ktime_us_delta(ktime_get(), oldest);
+
+	submit->batches++;
+	submit->batched_writes += nr;
+	submit->batch_hist[min_t(unsigned int, ilog2(nr), DRBD_SUBMIT_BATCH_HIST - 1)]++;
+	submit->wait_us_total += wait_us;
+	if (wait_us > submit->wait_us_max)
+		submit->wait_us_max = wait_us;
+}
+
 /* more: for non-blocking fill-up # of updates in the transaction */
 static bool grab_new_incoming_requests(struct drbd_device *device, struct waiting_for_act_log *wfa, bool more)
 {
 	/* grab new incoming requests */
 	struct list_head *reqs = more ? &wfa->requests.more_incoming : &wfa->requests.incoming;
 	struct list_head *peer_reqs = more ? &wfa->peer_requests.more_incoming : &wfa->peer_requests.incoming;
+	ktime_t oldest = KTIME_MAX;
+	unsigned int nr = 0;
 	bool found_new = false;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct drbd_submit_queue *q = per_cpu_ptr(device->submit.queues, cpu);
+
+		if (list_empty(&q->writes))
+			continue;
+
+		spin_lock(&q->lock);
+		if (!list_empty(&q->writes)) {
+			if (ktime_before(q->first_kt, oldest))
+				oldest = q->first_kt;
+			nr += q->nr;
+			q->nr = 0;
+			list_splice_tail_init(&q->writes, reqs);
+		}
+		spin_unlock(&q->lock);
+	}
+	if (nr) {
+		account_submit_batch(&device->submit, nr, oldest);
+		found_new = true;
+	}
 
 	spin_lock(&device->submit.lock);
-	found_new = !list_empty(&device->submit.writes);
-	list_splice_tail_init(&device->submit.writes, reqs);
 	found_new |= !list_empty(&device->submit.peer_writes);
 	list_splice_tail_init(&device->submit.peer_writes, peer_reqs);
 	spin_unlock(&device->submit.lock);
@@ -2271,10 +2662,7 @@ void do_submit(struct work_struct *ws)
 		 */
 
 		while (wfa_lists_empty(&wfa, incoming)) {
-			/* It is ok to look outside the lock,
-			 * it's only an optimization anyways */
-			if (list_empty(&device->submit.writes) &&
-			    list_empty(&device->submit.peer_writes))
+			if (submit_queues_empty(device))
 				break;
 
 			if (!grab_new_incoming_requests(device, &wfa, true))
@@ -2340,14 +2728,6 @@ blk_qc_t drbd_make_request(struct request_queue *q, struct bio *bio)
 	return BLK_QC_T_NONE;
 }
 
-static unsigned long time_min_in_future(unsigned long now,
-		unsigned long t1, unsigned long t2)
-{
-	t1 = time_after(now, t1) ? now : t1;
-	t2 = time_after(now, t2) ? now : t2;
-	return time_after(t1, t2) ? t2 : t1;
-}
-
 static bool net_timeout_reached(struct drbd_request *net_req,
 		struct drbd_peer_device *peer_device,
 		unsigned long now, unsigned long ent,
@@ -2425,14 +2805,12 @@ static bool net_timeout_reached(struct drbd_request *net_req,
 void request_timer_fn(struct timer_list *t)
 {
 	struct drbd_device *device = from_timer(device, t, request_timer);
-	struct drbd_connection *connection;
 	struct drbd_request *req_read, *req_write;
 	unsigned long oldest_submit_jif;
+	unsigned long write_pre_submit_jif, read_pre_submit_jif;
 	unsigned long dt = 0;
-	unsigned long et = 0;
 	unsigned long now = jiffies;
-	unsigned long next_trigger_time = now;
-	bool restart_timer = false;
+	unsigned long next;
 
 	rcu_read_lock();
 	if (get_ldev(device)) { /* implicit state.disk >= D_INCONSISTENT */
@@ -2441,105 +2819,120 @@ void request_timer_fn(struct timer_list *t)
 	}
 	rcu_read_unlock();
 
-	/* FIXME right now, this basically does a full transfer log walk *every time* */
-	read_lock_irq(&device->resource->state_rwlock);
-	if (dt) {
-		unsigned long write_pre_submit_jif, read_pre_submit_jif;
+	/* The network timeouts are checked per connection,
+	 * in connection_request_timer_fn() */
+	if (!dt)
+		return;
 
-		spin_lock(&device->pending_completion_lock); /* local irq already disabled */
-		req_read = list_first_entry_or_null(&device->pending_completion[0], struct drbd_request, req_pending_local);
-		req_write = list_first_entry_or_null(&device->pending_completion[1], struct drbd_request, req_pending_local);
-		spin_unlock(&device->pending_completion_lock);
+	/* The lists are in submission order, so we only look at their heads */
+	spin_lock_irq(&device->pending_completion_lock);
+	req_read = list_first_entry_or_null(&device->pending_completion[0], struct drbd_request, req_pending_local);
+	req_write = list_first_entry_or_null(&device->pending_completion[1], struct drbd_request, req_pending_local);
+	if (req_write)
+		write_pre_submit_jif = req_write->pre_submit_jif;
+	if (req_read)
+		read_pre_submit_jif = req_read->pre_submit_jif;
+	spin_unlock_irq(&device->pending_completion_lock);
 
-		if (req_write)
-			write_pre_submit_jif = req_write->pre_submit_jif;
-		if (req_read)
-			read_pre_submit_jif = req_read->pre_submit_jif;
-		oldest_submit_jif =
-			(req_write && req_read)
-			? ( time_before(write_pre_submit_jif, read_pre_submit_jif)
-			  ? write_pre_submit_jif : read_pre_submit_jif )
-			: req_write ? write_pre_submit_jif
-			: req_read ? read_pre_submit_jif : now;
+	oldest_submit_jif =
+		(req_write && req_read)
+		? ( time_before(write_pre_submit_jif, read_pre_submit_jif)
+		  ? write_pre_submit_jif : read_pre_submit_jif )
+		: req_write ? write_pre_submit_jif
+		: req_read ? read_pre_submit_jif : now;
 
+	if (time_after(now, oldest_submit_jif + dt) &&
+	    !time_in_range(now, device->last_reattach_jif, device->last_reattach_jif + dt)) {
+		read_lock_irq(&device->resource->state_rwlock);
 		if (device->disk_state[NOW] > D_FAILED) {
-			et = min_not_zero(et, dt);
-			next_trigger_time = time_min_in_future(now,
-					next_trigger_time, oldest_submit_jif + dt);
-			restart_timer = true;
-		}
-
-		if (time_after(now, oldest_submit_jif + dt) &&
-		    !time_in_range(now, device->last_reattach_jif, device->last_reattach_jif + dt)) {
 			drbd_warn(device, "Local backing device failed to meet the disk-timeout\n");
 			__drbd_chk_io_error(device, DRBD_FORCE_DETACH);
 		}
+		read_unlock_irq(&device->resource->state_rwlock);
 	}
-	for_each_connection(connection, device->resource) {
-		struct drbd_peer_device *peer_device = conn_peer_device(connection, device->vnr);
-		struct net_conf *nc;
-		struct drbd_request *req;
-		unsigned long ent = 0;
-		unsigned long pre_send_jif = 0;
-		unsigned int ko_count = 0, timeout = 0;
-
-		/* maybe the oldest request waiting for the peer is in fact still
-		 * blocking in tcp sendmsg.  That's ok, though, that's handled via the
-		 * socket send timeout, requesting a ping, and bumping ko-count in
-		 * we_should_drop_the_connection().
-		 */
 
-		/* check the oldest request we did successfully sent,
-		 * but which is still waiting for an ACK. */
-		req = connection->req_ack_pending;
+	if (READ_ONCE(device->disk_state[NOW]) <= D_FAILED)
+		return;
+	next = oldest_submit_jif + dt;
+	if (!time_after(next, now)) /* recently reattached */
+		next = device->last_reattach_jif + dt + 1;
+	if (!time_after(next, now))
+		next = now + dt;
+	mod_timer(&device->request_timer, next);
+}
 
-		/* if we don't have such request (e.g. protocol A)
-		 * check the oldest requests which is still waiting on its epoch
-		 * closing barrier ack. */
-		if (!req)
-			req = connection->req_not_net_done;
+/* The oldest request we did successfully send, but which is still waiting
+ * for an ACK.  If we don't have such a request (e.g. protocol A), the oldest
+ * request which is still waiting on its epoch closing barrier ack.
+ * Both are kept up to date in mod_rq_state(), as requests are sent and
+ * acked.  Caller holds rcu_read_lock() or the state_rwlock. */
+static struct drbd_request *oldest_net_request(struct drbd_connection *connection)
+{
+	struct drbd_request *req = READ_ONCE(connection->req_ack_pending);
 
-		/* evaluate the oldest peer request only in one timer! */
-		if (req && req->device != device)
-			req = NULL;
-		if (!req)
-			continue;
+	return req ?: READ_ONCE(connection->req_not_net_done);
+}
 
-		rcu_read_lock();
-		nc = rcu_dereference(connection->transport.net_conf);
-		if (nc) {
-			/* effective timeout = ko_count * timeout */
-			if (connection->cstate[NOW] == C_CONNECTED) {
-				ko_count = nc->ko_count;
-				timeout = nc->timeout;
-			}
-		}
+/* The transfer log is ordered by the time the requests were sent, so the
+ * only deadline we need to look at is the one of the oldest request.
+ * As long as it is in the future, we do not touch the state_rwlock, and
+ * we do not look at any device.
+ *
+ * Maybe the oldest request waiting for the peer is in fact still blocking
+ * in tcp sendmsg.  That's ok, though, that's handled via the socket send
+ * timeout, requesting a ping, and bumping ko-count in
+ * we_should_drop_the_connection(). */
+void connection_request_timer_fn(struct timer_list *t)
+{
+	struct drbd_connection *connection = from_timer(connection, t, request_timer);
+	struct drbd_resource *resource = connection->resource;
+	struct drbd_peer_device *peer_device;
+	struct drbd_request *req;
+	unsigned int ko_count = 0, timeout = 0;
+	unsigned long now = jiffies;
+	unsigned long ent, deadline;
+	struct net_conf *nc;
+
+	rcu_read_lock();
+	nc = rcu_dereference(connection->transport.net_conf);
+	if (nc && connection->cstate[NOW] == C_CONNECTED) {
+		ko_count = nc->ko_count;
+		timeout = nc->timeout;
+	}
+
+	/* effective timeout = ko_count * timeout */
+	ent = timeout * HZ/10 * ko_count;
+	connection->req_timeout_jif = ent;
+	if (!ent) {
+		/* started again when we get connected */
 		rcu_read_unlock();
+		connection->req_deadline_jif = 0;
+		return;
+	}
 
-		if (!timeout)
-			continue;
+	req = oldest_net_request(connection);
+	deadline = req ? req->pre_send_jif[connection->peer_node_id] + ent : 0;
+	connection->req_deadline_jif = deadline;
+	rcu_read_unlock();
 
-		pre_send_jif = req->pre_send_jif[connection->peer_node_id];
-
-		ent = timeout * HZ/10 * ko_count;
-		et = min_not_zero(et, ent);
-		next_trigger_time = time_min_in_future(now,
-				next_trigger_time, pre_send_jif + ent);
-		restart_timer = true;
-
-		if (net_timeout_reached(req, peer_device, now, ent, ko_count, timeout)) {
-			dynamic_drbd_dbg(peer_device, "Request at %llus+%u timed out\n",
-					(unsigned long long) req->i.sector,
-					req->i.size);
-			begin_state_change_locked(device->resource, CS_VERBOSE | CS_HARD);
-			__change_cstate(connection, C_TIMEOUT);
-			end_state_change_locked(device->resource);
-		}
+	if (!req || time_before_eq(now, deadline)) {
+		mod_timer(&connection->request_timer, req ? deadline + 1 : now + ent);
+		return;
 	}
-	read_unlock_irq(&device->resource->state_rwlock);
 
-	if (restart_timer) {
-		next_trigger_time = time_min_in_future(now, next_trigger_time, now + et);
-		mod_timer(&device->request_timer, next_trigger_time);
+	read_lock_irq(&resource->state_rwlock);
+	req = oldest_net_request(connection);
+	peer_device = req ? conn_peer_device(connection, req->device->vnr) : NULL;
+	if (peer_device && net_timeout_reached(req, peer_device, now, ent, ko_count, timeout)) {
+		dynamic_drbd_dbg(peer_device, "Request at %llus+%u timed out\n",
+				(unsigned long long) req->i.sector,
+				req->i.size);
+		begin_state_change_locked(resource, CS_VERBOSE | CS_HARD);
+		__change_cstate(connection, C_TIMEOUT);
+		end_state_change_locked(resource);
 	}
+	read_unlock_irq(&resource->state_rwlock);
+
+	/* recently reconnected, or the P_BARRIER is still young */
+	mod_timer(&connection->request_timer, now + timeout * HZ/10);
 }
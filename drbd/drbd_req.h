@@ -290,6 +290,7 @@ extern void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 extern void complete_master_bio(struct drbd_device *device,
 		struct bio_and_error *m);
 extern void request_timer_fn(struct timer_list *t);
+extern void connection_request_timer_fn(struct timer_list *t);
 extern void tl_walk(struct drbd_connection *connection, enum drbd_req_event what);
 extern void _tl_walk(struct drbd_connection *connection, enum drbd_req_event what);
 extern void __tl_walk(struct drbd_resource *const resource,
@@ -300,6 +301,8 @@ extern int w_queue_peer_ack(struct drbd_work *w, int cancel);
 extern void drbd_queue_peer_ack(struct drbd_resource *resource, struct drbd_request *req);
 extern bool drbd_should_do_remote(struct drbd_peer_device *, enum which_state);
 extern void drbd_reclaim_req(struct rcu_head *rp);
+extern void drbd_rb_account(struct drbd_rb_stats *s, struct drbd_request *req);
+extern bool drbd_cong_catch_up(struct drbd_peer_device *peer_device);
 
 /* this is in drbd_main.c */
 extern void drbd_restart_request(struct drbd_request *req);
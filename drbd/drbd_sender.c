@@ -36,6 +36,7 @@ static int make_resync_request(struct drbd_peer_device *, int);
 static bool should_send_barrier(struct drbd_connection *, unsigned int epoch);
 static void maybe_send_barrier(struct drbd_connection *, unsigned int);
 static unsigned long get_work_bits(const unsigned long mask, unsigned long *flags);
+static int w_e_send_csum(struct drbd_work *, int);
 
 /* endio handlers:
  *   drbd_md_endio (defined here)
@@ -88,7 +89,7 @@ void drbd_md_endio(struct bio *bio)
 /* reads on behalf of the partner,
  * "submitted" by the receiver
  */
-static void drbd_endio_read_sec_final(struct drbd_peer_request *peer_req) __releases(local)
+static void __drbd_endio_read_sec_final(struct drbd_peer_request *peer_req) __releases(local)
 {
 	unsigned long flags = 0;
 	struct drbd_peer_device *peer_device = peer_req->peer_device;
@@ -108,6 +109,164 @@ static void drbd_endio_read_sec_final(struct drbd_peer_request *peer_req) __rele
 	put_ldev(device);
 }
 
+/* The digest of a chunked online verify block, one digest per chunk */
+static void drbd_csum_pages_chunked(struct crypto_shash *tfm, struct page *page,
+				    unsigned int size, unsigned int chunk, u8 *digest)
+{
+	unsigned int digest_size = crypto_shash_digestsize(tfm);
+	unsigned int left = chunk;
+	SHASH_DESC_ON_STACK(desc, tfm);
+
+	desc->tfm = tfm;
+
+	crypto_shash_init(desc);
+
+	page_chain_for_each(page) {
+		unsigned int len = min_t(unsigned int, size, PAGE_SIZE);
+		unsigned int off = 0;
+		u8 *src;
+
+		size -= len;
+		src = kmap_atomic(page);
+		while (len) {
+			unsigned int l = min(len, left);
+
+			crypto_shash_update(desc, src + off, l);
+			off += l;
+			len -= l;
+			left -= l;
+			if (!left) {
+				crypto_shash_final(desc, digest);
+				digest += digest_size;
+				crypto_shash_init(desc);
+				left = chunk;
+			}
+		}
+		kunmap_atomic(src);
+	}
+	if (left != chunk)
+		crypto_shash_final(desc, digest);
+	shash_desc_zero(desc);
+}
+
+static unsigned int drbd_ov_digest_size(struct drbd_connection *connection, unsigned int size)
+{
+	unsigned int chunk = drbd_ov_tree_chunk(connection, size);
+
+	return crypto_shash_digestsize(connection->verify_tfm) * DIV_ROUND_UP(size, chunk);
+}
+
+static void drbd_ov_csum(struct drbd_connection *connection,
+			 struct drbd_peer_request *peer_req, void *digest)
+{
+	unsigned int size = peer_req->i.size;
+	unsigned int chunk = drbd_ov_tree_chunk(connection, size);
+
+	if (chunk == size)
+		drbd_csum_pages(connection->verify_tfm, peer_req->page_chain.head, digest);
+	else
+		drbd_csum_pages_chunked(connection->verify_tfm, peer_req->page_chain.head,
+					size, chunk, digest);
+}
+
+/* The digest for checksum based resync and online verify, if the sender
+ * callback of this read is going to need one */
+static struct crypto_shash *csum_tfm_for(struct drbd_peer_request *peer_req)
+{
+	struct drbd_connection *connection = peer_req->peer_device->connection;
+
+	if (peer_req->w.cb == w_e_send_csum || peer_req->w.cb == w_e_end_csum_rs_req)
+		return connection->csums_tfm;
+	if (peer_req->w.cb == w_e_end_ov_req || peer_req->w.cb == w_e_end_ov_reply)
+		return connection->verify_tfm;
+	return NULL;
+}
+
+/* Hashing is the expensive part of checksum based resync and online verify.
+ * Instead of doing it one block after the other in the sender thread, it
+ * is done here, on an unbound workqueue, for as many blocks in parallel
+ * as there are reads in flight.
+ * The peer request stays on read_ee until we are done with it, so that
+ * drbd_disconnect() waits for us as it waits for the read itself. */
+static void drbd_csum_work_fn(struct work_struct *ws)
+{
+	struct drbd_peer_request *peer_req = container_of(ws, struct drbd_peer_request, csum_work);
+	struct drbd_connection *connection = peer_req->peer_device->connection;
+	struct crypto_shash *tfm = csum_tfm_for(peer_req);
+	bool verify = tfm && tfm == connection->verify_tfm;
+	struct digest_info *di;
+	int digest_size;
+
+	/* the sender has a cache for all zero blocks during verify */
+	if (!tfm || (verify && drbd_peer_req_all_zero(peer_req)))
+		goto out;
+
+	digest_size = verify ? drbd_ov_digest_size(connection, peer_req->i.size) :
+		crypto_shash_digestsize(tfm);
+	di = kmalloc(sizeof(*di) + digest_size, GFP_NOIO);
+	if (!di)
+		goto out; /* the sender computes it then */
+
+	di->digest_size = digest_size;
+	di->digest = di + 1;
+	if (verify)
+		drbd_ov_csum(connection, peer_req, di->digest);
+	else
+		drbd_csum_pages(tfm, peer_req->page_chain.head, di->digest);
+	peer_req->csum = di;
+out:
+	__drbd_endio_read_sec_final(peer_req);
+}
+
+static void drbd_endio_read_sec_final(struct drbd_peer_request *peer_req) __releases(local)
+{
+	if (drbd_csum_wq && !test_bit(__EE_WAS_ERROR, &peer_req->flags) &&
+	    csum_tfm_for(peer_req)) {
+		INIT_WORK(&peer_req->csum_work, drbd_csum_work_fn);
+		queue_work(drbd_csum_wq, &peer_req->csum_work);
+		return;
+	}
+	__drbd_endio_read_sec_final(peer_req);
+}
+
+/**
+ * drbd_csum_cache_hit() - Complete a verify or csum read from the csum cache
+ * @peer_req:	the read, on read_ee, about to be submitted.
+ *
+ * Returns true if the digest was found in the csum cache.  The read is then
+ * completed right away, without reading anything.
+ * Not for P_CSUM_RS_REQUEST: if the digests differ, we need the data.
+ */
+bool drbd_csum_cache_hit(struct drbd_peer_request *peer_req)
+{
+	struct drbd_connection *connection = peer_req->peer_device->connection;
+	struct crypto_shash *tfm = csum_tfm_for(peer_req);
+	int digest_size;
+
+	if (!tfm || peer_req->w.cb == w_e_end_csum_rs_req)
+		return false;
+
+	digest_size = tfm == connection->verify_tfm ?
+		drbd_ov_digest_size(connection, peer_req->i.size) :
+		crypto_shash_digestsize(tfm);
+	if (!drbd_csum_cache_lookup(peer_req, tfm, digest_size))
+		return false;
+
+	__drbd_endio_read_sec_final(peer_req);
+	return true;
+}
+
+/* Use the digest drbd_csum_work_fn() computed for us, if there is one */
+static bool take_csum(struct drbd_peer_request *peer_req, int digest_size, void *digest)
+{
+	struct digest_info *di = peer_req->csum;
+
+	if (!di || di->digest_size != digest_size)
+		return false;
+	memcpy(digest, di->digest, di->digest_size);
+	return true;
+}
+
 static int is_failed_barrier(int ee_flags)
 {
 	return (ee_flags & (EE_IS_BARRIER|EE_WAS_ERROR|EE_RESUBMITTED|EE_TRIM|EE_ZEROOUT))
@@ -126,6 +285,8 @@ void drbd_endio_write_sec_final(struct drbd_peer_request *peer_req) __releases(l
 	int do_wake;
 	u64 block_id;
 
+	drbd_csum_cache_invalidate(device, peer_req->i.sector, peer_req->i.size);
+
 	/* if this is a failed barrier request, disable use of barriers,
 	 * and schedule for resubmission */
 	if (is_failed_barrier(peer_req->flags)) {
@@ -299,7 +460,11 @@ void drbd_request_endio(struct bio *bio)
 		}
 	} else {
 		what = COMPLETED_OK;
+		if (bio_op(bio) == REQ_OP_READ)
+			drbd_rb_account(&device->rb_local, req);
 	}
+	if (bio_op(bio) != REQ_OP_READ)
+		drbd_csum_cache_invalidate(device, req->i.sector, req->i.size);
 
 	bio_put(req->private_bio);
 	req->private_bio = ERR_PTR(blk_status_to_errno(status));
@@ -314,6 +479,70 @@ void drbd_request_endio(struct bio *bio)
 		complete_master_bio(device, &m);
 }
 
+/* Word at a time, eight words per branch.  OR-ing a whole cache line before
+ * testing keeps several loads in flight and the branch predictable.  Using
+ * vector registers would need kernel_fpu_begin(), which costs more than it
+ * saves on request sized buffers, and most non-zero data is rejected within
+ * the first cache line anyway. */
+static bool drbd_mem_is_zero(const void *buf, unsigned int len)
+{
+	const unsigned long *p = buf;
+	unsigned int n;
+
+	if (!IS_ALIGNED((unsigned long)buf | len, sizeof(long)))
+		return !memchr_inv(buf, 0, len);
+
+	for (n = len / (8 * sizeof(long)); n; n--, p += 8) {
+		if (p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7])
+			return false;
+	}
+	for (n = len % (8 * sizeof(long)); n; n -= sizeof(long), p++) {
+		if (*p)
+			return false;
+	}
+	return true;
+}
+
+bool drbd_peer_req_all_zero(struct drbd_peer_request *peer_req)
+{
+	struct page *page = peer_req->page_chain.head;
+	unsigned int len = peer_req->i.size;
+
+	page_chain_for_each(page) {
+		unsigned int l = min_t(unsigned int, len, PAGE_SIZE);
+		bool zero;
+		void *d;
+
+		d = kmap_atomic(page);
+		zero = drbd_mem_is_zero(d, l);
+		kunmap_atomic(d);
+		if (!zero)
+			return false;
+		len -= l;
+	}
+
+	return true;
+}
+
+bool drbd_bio_all_zero(struct bio *bio)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		bool zero;
+		u8 *d;
+
+		d = kmap_atomic(bvec.bv_page);
+		zero = drbd_mem_is_zero(d + bvec.bv_offset, bvec.bv_len);
+		kunmap_atomic(d);
+		if (!zero)
+			return false;
+	}
+
+	return true;
+}
+
 void drbd_csum_pages(struct crypto_shash *tfm, struct page *page, void *digest)
 {
 	SHASH_DESC_ON_STACK(desc, tfm);
@@ -376,7 +605,9 @@ static int w_e_send_csum(struct drbd_work *w, int cancel)
 	digest_size = crypto_shash_digestsize(peer_device->connection->csums_tfm);
 	digest = drbd_prepare_drequest_csum(peer_req, digest_size);
 	if (digest) {
-		drbd_csum_pages(peer_device->connection->csums_tfm, peer_req->page_chain.head, digest);
+		if (!take_csum(peer_req, digest_size, digest))
+			drbd_csum_pages(peer_device->connection->csums_tfm, peer_req->page_chain.head, digest);
+		drbd_csum_cache_store(peer_req, peer_device->connection->csums_tfm, digest, digest_size);
 		/* Free peer_req and pages before send.
 		 * In case we block on congestion, we could otherwise run into
 		 * some distributed deadlock, if the other side blocks on
@@ -430,7 +661,7 @@ static int read_for_csum(struct drbd_peer_device *peer_device, sector_t sector,
 	spin_unlock_irq(&connection->peer_reqs_lock);
 
 	atomic_add(size >> 9, &device->rs_sect_ev);
-	if (drbd_submit_peer_request(peer_req) == 0)
+	if (drbd_csum_cache_hit(peer_req) || drbd_submit_peer_request(peer_req) == 0)
 		return 0;
 
 	/* If it failed because of ENOMEM, retry should help.  If it failed
@@ -864,7 +1095,8 @@ static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 	/* don't let rs_sectors_came_in() re-schedule us "early"
 	 * just because the first reply came "fast", ... */
 	peer_device->rs_in_flight += number * BM_SECT_PER_BIT;
-	for (i = 0; i < number; i++) {
+	/* i counts bitmap bits, as number does */
+	for (i = 0; i < number; ) {
 		if (sector >= capacity)
 			break;
 
@@ -877,19 +1109,30 @@ static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 			break;
 
 		size = BM_BLOCK_SIZE;
+		/* up to the next DRBD_OV_TREE_SIZE boundary, and so never
+		 * across a resync extent; no more than the controller asked for */
+		if (peer_device->connection->agreed_features & DRBD_FF_OV_TREE) {
+			size = DRBD_OV_TREE_SIZE - ((sector << 9) & (DRBD_OV_TREE_SIZE - 1));
+			size = min(size, max(number - i, 1) << BM_BLOCK_SHIFT);
+		}
 
 		if (drbd_try_rs_begin_io(peer_device, sector, true))
 			break;
 
 		if (sector + (size>>9) > capacity)
 			size = (capacity-sector)<<9;
+		if (peer_device->ov_stop_sector < capacity &&
+		    sector + (size>>9) > peer_device->ov_stop_sector)
+			size = max_t(int, BM_BLOCK_SIZE,
+				     round_up((peer_device->ov_stop_sector - sector) << 9, BM_BLOCK_SIZE));
 
 		inc_rs_pending(peer_device);
 		if (drbd_send_ov_request(peer_device, sector, size)) {
 			dec_rs_pending(peer_device);
 			return 0;
 		}
-		sector += BM_SECT_PER_BIT;
+		sector += round_up(size, BM_BLOCK_SIZE) >> 9;
+		i += DIV_ROUND_UP(size, BM_BLOCK_SIZE);
 	}
 	/* ... but do a correction, in case we had to break; ... */
 	peer_device->rs_in_flight -= (number-i) * BM_SECT_PER_BIT;
@@ -1372,28 +1615,30 @@ int w_e_end_data_req(struct drbd_work *w, int cancel)
 	return err;
 }
 
-static bool all_zero(struct drbd_peer_request *peer_req)
+/* Online verify of thinly provisioned or freshly trimmed devices hashes a
+ * lot of zeroes.  Checking for zeroes is much cheaper than any digest, so we
+ * hash an all zero block only once per size and verify_tfm.  Only called from
+ * the sender thread. */
+static void drbd_verify_csum(struct drbd_connection *connection,
+			     struct drbd_peer_request *peer_req, void *digest)
 {
-	struct page *page = peer_req->page_chain.head;
-	unsigned int len = peer_req->i.size;
+	unsigned int size = peer_req->i.size;
+	unsigned int digest_size = drbd_ov_digest_size(connection, size);
 
-	page_chain_for_each(page) {
-		unsigned int l = min_t(unsigned int, len, PAGE_SIZE);
-		unsigned int i, words = l / sizeof(long);
-		unsigned long *d;
+	if (take_csum(peer_req, digest_size, digest))
+		return;
 
-		d = kmap_atomic(page);
-		for (i = 0; i < words; i++) {
-			if (d[i]) {
-				kunmap_atomic(d);
-				return false;
-			}
-		}
-		kunmap_atomic(d);
-		len -= l;
+	if (digest_size > sizeof(connection->verify_zero.digest) ||
+	    !drbd_peer_req_all_zero(peer_req)) {
+		drbd_ov_csum(connection, peer_req, digest);
+		return;
 	}
 
-	return true;
+	if (connection->verify_zero.size != size) {
+		drbd_ov_csum(connection, peer_req, connection->verify_zero.digest);
+		connection->verify_zero.size = size;
+	}
+	memcpy(digest, connection->verify_zero.digest, digest_size);
 }
 
 /**
@@ -1431,7 +1676,7 @@ int w_e_end_rsdata_req(struct drbd_work *w, int cancel)
 			 * the atomic_sub() in got_BlockAck.
 			 * TODO: to fix that, we'd need a protocol bump. */
 			atomic_add(peer_req->i.size >> 9, &connection->rs_in_flight);
-			if (peer_req->flags & EE_RS_THIN_REQ && all_zero(peer_req)) {
+			if (peer_req->flags & EE_RS_THIN_REQ && drbd_peer_req_all_zero(peer_req)) {
 				err = drbd_send_rs_deallocated(peer_device, peer_req);
 			} else {
 				err = drbd_send_block(peer_device, P_RS_DATA_REPLY, peer_req);
@@ -1494,7 +1739,9 @@ int w_e_end_csum_rs_req(struct drbd_work *w, int cancel)
 			D_ASSERT(device, digest_size == di->digest_size);
 			digest = kmalloc(digest_size, GFP_NOIO);
 			if (digest) {
-				drbd_csum_pages(peer_device->connection->csums_tfm, peer_req->page_chain.head, digest);
+				if (!take_csum(peer_req, digest_size, digest))
+					drbd_csum_pages(peer_device->connection->csums_tfm,
+							peer_req->page_chain.head, digest);
 				eq = !memcmp(digest, di->digest, digest_size);
 				kfree(digest);
 			}
@@ -1538,7 +1785,7 @@ int w_e_end_ov_req(struct drbd_work *w, int cancel)
 	if (unlikely(cancel))
 		goto out;
 
-	digest_size = crypto_shash_digestsize(peer_device->connection->verify_tfm);
+	digest_size = drbd_ov_digest_size(peer_device->connection, peer_req->i.size);
 	/* FIXME if this allocation fails, online verify will not terminate! */
 	digest = drbd_prepare_drequest_csum(peer_req, digest_size);
 	if (!digest) {
@@ -1546,10 +1793,12 @@ int w_e_end_ov_req(struct drbd_work *w, int cancel)
 		goto out;
 	}
 
-	if (!(peer_req->flags & EE_WAS_ERROR))
-		drbd_csum_pages(peer_device->connection->verify_tfm, peer_req->page_chain.head, digest);
-	else
+	if (!(peer_req->flags & EE_WAS_ERROR)) {
+		drbd_verify_csum(peer_device->connection, peer_req, digest);
+		drbd_csum_cache_store(peer_req, peer_device->connection->verify_tfm, digest, digest_size);
+	} else {
 		memset(digest, 0, digest_size);
+	}
 
 	/* Free peer_req and pages before send.
 	 * In case we block on congestion, we could otherwise run into
@@ -1589,26 +1838,72 @@ void verify_progress(struct drbd_peer_device *peer_device,
 	bool stop_sector_reached =
 		(peer_device->repl_state[NOW] == L_VERIFY_S) &&
 		(sector + (size>>9)) >= peer_device->ov_stop_sector;
+	unsigned long bits = DIV_ROUND_UP(size, BM_BLOCK_SIZE);
+	unsigned long old_left = peer_device->ov_left;
 
-	--peer_device->ov_left;
+	/* blocks are larger than one bit with DRBD_FF_OV_TREE, and a
+	 * P_OV_RESULT for a block we descended into may cover nothing */
+	peer_device->ov_left -= min(bits, old_left);
 
 	/* let's advance progress step marks only for every other megabyte */
-	if ((peer_device->ov_left & 0x1ff) == 0)
+	if ((old_left ^ peer_device->ov_left) & ~0x1ffUL)
 		drbd_advance_rs_marks(peer_device, peer_device->ov_left);
 
 	if (peer_device->ov_left == 0 || stop_sector_reached)
 		drbd_peer_device_post_work(peer_device, RS_DONE);
 }
 
+/* Online verify with DRBD_FF_OV_TREE: the chunks of this block which
+ * differ are verified again, each with its own P_OV_REQUEST, until the
+ * chunks are as small as a bitmap bit.  Returns the number of bytes in the
+ * chunks that are done with: found in sync, or skipped.  Both sides count
+ * those as progress through the P_OV_RESULT of this block, so they must
+ * not count them on their own. */
+static unsigned int ov_tree_descend(struct drbd_peer_device *peer_device, sector_t sector,
+				    unsigned int size, unsigned int chunk, unsigned long differ)
+{
+	unsigned int done = 0;
+	unsigned int offset;
+	int i = 0;
+
+	for (offset = 0; offset < size; offset += chunk, i++) {
+		sector_t csector = sector + (offset >> 9);
+		unsigned int csize = min(chunk, size - offset);
+
+		if (!test_bit(i, &differ)) {
+			done += csize;
+			continue;
+		}
+
+		if (drbd_try_rs_begin_io(peer_device, csector, false)) {
+			verify_note_skipped(peer_device, csector, csize);
+			done += csize;
+			continue;
+		}
+		peer_device->rs_in_flight += csize >> 9;
+		inc_rs_pending(peer_device);
+		if (drbd_send_ov_request(peer_device, csector, csize)) {
+			dec_rs_pending(peer_device);
+			drbd_rs_complete_io(peer_device, csector);
+			/* this chunk and the rest will not get a result */
+			done += size - offset;
+			break;
+		}
+	}
+	return done;
+}
+
 int w_e_end_ov_reply(struct drbd_work *w, int cancel)
 {
 	struct drbd_peer_request *peer_req = container_of(w, struct drbd_peer_request, w);
 	struct drbd_peer_device *peer_device = peer_req->peer_device;
 	struct drbd_device *device = peer_device->device;
 	struct digest_info *di;
-	void *digest;
+	u8 *digest;
 	sector_t sector = peer_req->i.sector;
 	unsigned int size = peer_req->i.size;
+	unsigned int chunk = drbd_ov_tree_chunk(peer_device->connection, size);
+	unsigned long differ = 0;
 	int digest_size;
 	int err, eq = 0;
 
@@ -1628,13 +1923,24 @@ int w_e_end_ov_reply(struct drbd_work *w, int cancel)
 	di = peer_req->digest;
 
 	if (likely((peer_req->flags & EE_WAS_ERROR) == 0)) {
-		digest_size = crypto_shash_digestsize(peer_device->connection->verify_tfm);
+		digest_size = drbd_ov_digest_size(peer_device->connection, size);
 		digest = kmalloc(digest_size, GFP_NOIO);
 		if (digest) {
-			drbd_csum_pages(peer_device->connection->verify_tfm, peer_req->page_chain.head, digest);
+			drbd_verify_csum(peer_device->connection, peer_req, digest);
+			drbd_csum_cache_store(peer_req, peer_device->connection->verify_tfm,
+					      digest, digest_size);
 
 			D_ASSERT(device, digest_size == di->digest_size);
 			eq = !memcmp(digest, di->digest, digest_size);
+			if (!eq && chunk != size && digest_size == di->digest_size) {
+				int ds = crypto_shash_digestsize(peer_device->connection->verify_tfm);
+				int i;
+
+				for (i = 0; i * ds < digest_size; i++) {
+					if (memcmp(digest + i * ds, di->digest + i * ds, ds))
+						__set_bit(i, &differ);
+				}
+			}
 			kfree(digest);
 		}
 	}
@@ -1645,6 +1951,16 @@ int w_e_end_ov_reply(struct drbd_work *w, int cancel)
 	 * congestion as well, because our receiver blocks in
 	 * drbd_alloc_pages due to pp_in_use > max_buffers. */
 	drbd_free_peer_req(peer_req);
+
+	if (differ && get_ldev(device)) {
+		/* Only the chunks found in sync or skipped are done with; the
+		 * peer counts the size in this P_OV_RESULT as progress, and the
+		 * chunks we descend into will get their own P_OV_RESULT. */
+		size = ov_tree_descend(peer_device, sector, size, chunk, differ);
+		put_ldev(device);
+		eq = 1;
+	}
+
 	if (!eq)
 		drbd_ov_out_of_sync_found(peer_device, sector, size);
 	else
@@ -1990,6 +2306,18 @@ static void do_start_resync(struct drbd_peer_device *peer_device)
 		return;
 	}
 
+	if (test_bit(AHEAD_TO_SYNC_SOURCE, &peer_device->flags) &&
+	    peer_device->repl_state[NOW] == L_AHEAD &&
+	    !drbd_cong_catch_up(peer_device)) {
+		peer_device->start_resync_timer.expires = jiffies + HZ;
+		add_timer(&peer_device->start_resync_timer);
+		return;
+	}
+
+	/* the peer should know about all blocks we did not replicate */
+	if (test_bit(AHEAD_TO_SYNC_SOURCE, &peer_device->flags))
+		drbd_flush_out_of_sync(peer_device);
+
 	drbd_start_resync(peer_device, peer_device->start_resync_side);
 	clear_bit(AHEAD_TO_SYNC_SOURCE, &peer_device->flags);
 }
@@ -2228,8 +2556,10 @@ static void drbd_ldev_destroy(struct drbd_device *device)
                 peer_device->resync_lru = NULL;
         }
         rcu_read_unlock();
+        drbd_al_unpin_all(device);
         lc_destroy(device->act_log);
         device->act_log = NULL;
+	drbd_csum_cache_clear(device);
 	__acquire(local);
 	drbd_backing_dev_free(device, device->ldev);
 	device->ldev = NULL;
@@ -2281,6 +2611,26 @@ static void go_diskless(struct drbd_device *device)
 	change_disk_state(device, D_DISKLESS, CS_HARD, NULL);
 }
 
+/* A sparse bitmap failed to record bits, it does not know what is out of
+ * sync anymore.  Have the next resync with each peer be a full one, and give
+ * up the local disk, as when the bitmap could not be written. */
+static void bitmap_lost_bits(struct drbd_device *device)
+{
+	struct drbd_peer_device *peer_device;
+
+	if (!get_ldev_if_state(device, D_DETACHING))
+		return;
+
+	drbd_err(device, "Could not set bits in the sparse bitmap, out of memory\n");
+	rcu_read_lock();
+	for_each_peer_device_rcu(peer_device, device)
+		drbd_md_set_peer_flag(peer_device, MDF_PEER_FULL_SYNC);
+	rcu_read_unlock();
+	drbd_md_sync_if_dirty(device);
+	drbd_chk_io_error(device, 1, DRBD_META_IO_ERROR);
+	put_ldev(device);
+}
+
 static int do_md_sync(struct drbd_device *device)
 {
 	drbd_warn(device, "md_sync_timer expired! Worker calls drbd_md_sync().\n");
@@ -2422,6 +2772,8 @@ static void do_device_work(struct drbd_device *device, const unsigned long todo)
 		drbd_ldev_destroy(device);
 	if (test_bit(MAKE_NEW_CUR_UUID, &todo))
 		make_new_current_uuid(device);
+	if (test_bit(BITMAP_LOST_BITS, &todo))
+		bitmap_lost_bits(device);
 }
 
 static void do_peer_device_work(struct drbd_peer_device *peer_device, const unsigned long todo)
@@ -2445,6 +2797,7 @@ static void do_peer_device_work(struct drbd_peer_device *peer_device, const unsi
 	|(1UL << DESTROY_DISK)	\
 	|(1UL << MD_SYNC)	\
 	|(1UL << MAKE_NEW_CUR_UUID)\
+	|(1UL << BITMAP_LOST_BITS)\
 	)
 
 #define DRBD_PEER_DEVICE_WORK_MASK	\
@@ -2650,6 +3003,7 @@ static void maybe_send_state_afer_ahead(struct drbd_connection *connection)
 		if (test_and_clear_bit(SEND_STATE_AFTER_AHEAD, &peer_device->flags)) {
 			peer_device->todo.was_ahead = false;
 			rcu_read_unlock();
+			drbd_flush_out_of_sync(peer_device);
 			drbd_send_current_state(peer_device);
 			rcu_read_lock();
 		}
@@ -2690,6 +3044,27 @@ static int ap_write_cnt_total(struct drbd_resource *resource)
 	return ap_bio_cnt_total;
 }
 
+static void flush_out_of_sync_batches(struct drbd_connection *connection)
+{
+	struct drbd_peer_device *peer_device;
+	int vnr;
+
+	rcu_read_lock();
+	idr_for_each_entry(&connection->peer_devices, peer_device, vnr) {
+		struct drbd_device *device = peer_device->device;
+
+		if (!READ_ONCE(peer_device->oos_batch.nr))
+			continue;
+
+		kref_get(&device->kref);
+		rcu_read_unlock();
+		drbd_flush_out_of_sync(peer_device);
+		kref_put(&device->kref, drbd_destroy_device);
+		rcu_read_lock();
+	}
+	rcu_read_unlock();
+}
+
 static void wait_for_sender_todo(struct drbd_connection *connection)
 {
 	DEFINE_WAIT(wait);
@@ -2701,6 +3076,9 @@ static void wait_for_sender_todo(struct drbd_connection *connection)
 	if (got_something)
 		return;
 
+	/* out of requests, send what we coalesced in Ahead mode */
+	flush_out_of_sync_batches(connection);
+
 	/* Still nothing to do?
 	 * Maybe we still need to close the current epoch,
 	 * even if no new requests are queued yet.
@@ -2864,6 +3242,10 @@ static int process_one_request(struct drbd_connection *connection)
 			u64 current_dagtag_sector =
 				req->dagtag_sector - (req->i.size >> 9);
 
+			/* what we coalesced while Ahead goes first; if that
+			 * fails, so will sending this write */
+			drbd_flush_out_of_sync(peer_device);
+
 			re_init_if_first_write(connection, req->epoch);
 			maybe_send_barrier(connection, req->epoch);
 			if (current_dagtag_sector != connection->send.current_dagtag_sector)
@@ -2926,7 +3308,7 @@ static int process_one_request(struct drbd_connection *connection)
 			 */
 			if (drbd_set_out_of_sync(peer_device, req->i.sector, req->i.size) ||
 			    is_write_in_flight(peer_device, &req->i))
-				err = drbd_send_out_of_sync(peer_device, req->i.sector, req->i.size);
+				err = drbd_queue_out_of_sync(peer_device, req->i.sector, req->i.size);
 			what = OOS_HANDED_TO_NETWORK; /* Well, most of the time, anyways. */
 		}
 	} else {
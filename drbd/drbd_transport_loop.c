@@ -0,0 +1,776 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+   drbd_transport_loop.c
+
+   This file is part of DRBD.
+
+   Loopback transport: connects two DRBD resources on the same host
+   through rings of page references, without any network stack in
+   between.  Meant for measuring the replication engine itself, and
+   for testing connect, reconnect and resync logic at memory speed.
+
+   The two resources find each other by their paths: a path of one of
+   them has to have as my-address the peer-address of a path of the
+   other one, and vice versa.  The addresses are never bound.
+
+   Sending is zero copy, the ring takes a reference on the page.  Just
+   like with sendpage() on a TCP socket, the sender has to leave the
+   content of a page alone until its page_count() dropped again.  The
+   receiver copies out of the sender's page once, straight into its
+   receive buffer or the pages of the peer request.
+
+*/
+
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/sched/signal.h>
+#include <linux/wait.h>
+#include <linux/drbd_genl_api.h>
+#include <linux/drbd_config.h>
+#include <drbd_protocol.h>
+#include <drbd_transport.h>
+#include "drbd_wrappers.h"
+
+
+MODULE_AUTHOR("Philipp Reisner <philipp.reisner@linbit.com>");
+MODULE_AUTHOR("Lars Ellenberg <lars.ellenberg@linbit.com>");
+MODULE_DESCRIPTION("Loopback transport layer for DRBD");
+MODULE_LICENSE("GPL");
+MODULE_VERSION(REL_VERSION);
+
+/* Chunks per ring, one chunk references (a part of) one page */
+#define DTL_RING_SIZE 512
+
+struct dtl_chunk {
+	struct page *page;
+	unsigned int offset;
+	unsigned int size;
+};
+
+/* One direction of one stream; single producer, single consumer */
+struct dtl_ring {
+	spinlock_t lock;
+	wait_queue_head_t wait;	/* for the producer and the consumer */
+	unsigned int head;	/* next chunk to consume, free running */
+	unsigned int tail;	/* next chunk to fill, free running */
+	unsigned int consumed;	/* bytes of the chunk at head */
+	unsigned int queued;	/* bytes */
+	bool corked;
+	struct dtl_chunk chunk[DTL_RING_SIZE];
+};
+
+/* Shared by the two transports of a connected pair.  Side 0 sends on
+ * ring[0][stream] and receives on ring[1][stream], side 1 the other way
+ * round. */
+struct dtl_link {
+	struct kref kref;
+	bool closed;
+	struct dtl_ring ring[2][2];
+};
+
+struct buffer {
+	void *base;
+	void *pos;
+};
+
+struct drbd_loop_transport {
+	struct drbd_transport transport; /* Must be first! */
+	spinlock_t paths_lock;
+	struct buffer rbuf[2];
+
+	struct list_head connecting;	/* on dtl_connecting */
+	wait_queue_head_t connect_wait;
+	struct dtl_link *link;
+	struct drbd_path *path;		/* the one link was established on */
+	int side;
+	long rcvtimeo[2];
+	long sndtimeo;
+};
+
+struct dtl_path {
+	struct drbd_path path;
+};
+
+static int dtl_init(struct drbd_transport *transport);
+static void dtl_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op);
+static int dtl_connect(struct drbd_transport *transport);
+static int dtl_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags);
+static int dtl_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size);
+static void dtl_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats);
+static void dtl_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout);
+static long dtl_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream);
+static int dtl_send_page(struct drbd_transport *transport, enum drbd_stream, struct page *page,
+		int offset, size_t size, unsigned msg_flags);
+static int dtl_send_zc_bio(struct drbd_transport *, struct bio *bio);
+static bool dtl_stream_ok(struct drbd_transport *transport, enum drbd_stream stream);
+static bool dtl_hint(struct drbd_transport *transport, enum drbd_stream stream, enum drbd_tr_hints hint);
+static void dtl_debugfs_show(struct drbd_transport *transport, struct seq_file *m);
+static int dtl_add_path(struct drbd_transport *, struct drbd_path *path);
+static int dtl_remove_path(struct drbd_transport *, struct drbd_path *);
+
+static struct drbd_transport_class loop_transport_class = {
+	.name = "loop",
+	.instance_size = sizeof(struct drbd_loop_transport),
+	.path_instance_size = sizeof(struct dtl_path),
+	.listener_instance_size = 0,
+	.module = THIS_MODULE,
+	.init = dtl_init,
+	.list = LIST_HEAD_INIT(loop_transport_class.list),
+};
+
+static struct drbd_transport_ops dtl_ops = {
+	.free = dtl_free,
+	.connect = dtl_connect,
+	.recv = dtl_recv,
+	.recv_pages = dtl_recv_pages,
+	.stats = dtl_stats,
+	.set_rcvtimeo = dtl_set_rcvtimeo,
+	.get_rcvtimeo = dtl_get_rcvtimeo,
+	.send_page = dtl_send_page,
+	.send_zc_bio = dtl_send_zc_bio,
+	.stream_ok = dtl_stream_ok,
+	.hint = dtl_hint,
+	.debugfs_show = dtl_debugfs_show,
+	.add_path = dtl_add_path,
+	.remove_path = dtl_remove_path,
+};
+
+/* Transports waiting in dtl_connect() for their peer */
+static LIST_HEAD(dtl_connecting);
+static DEFINE_MUTEX(dtl_connecting_mutex);
+
+static int dtl_init(struct drbd_transport *transport)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	enum drbd_stream i;
+
+	spin_lock_init(&loop_transport->paths_lock);
+	INIT_LIST_HEAD(&loop_transport->connecting);
+	init_waitqueue_head(&loop_transport->connect_wait);
+	loop_transport->transport.ops = &dtl_ops;
+	loop_transport->transport.class = &loop_transport_class;
+	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
+		void *buffer = (void *)__get_free_page(GFP_KERNEL);
+		if (!buffer)
+			goto fail;
+		loop_transport->rbuf[i].base = buffer;
+		loop_transport->rbuf[i].pos = buffer;
+		loop_transport->rcvtimeo[i] = MAX_SCHEDULE_TIMEOUT;
+	}
+	loop_transport->sndtimeo = MAX_SCHEDULE_TIMEOUT;
+
+	return 0;
+fail:
+	free_page((unsigned long)loop_transport->rbuf[0].base);
+	return -ENOMEM;
+}
+
+static struct dtl_link *dtl_alloc_link(void)
+{
+	struct dtl_link *link;
+	int side, stream;
+
+	link = kvzalloc(sizeof(*link), GFP_KERNEL);
+	if (!link)
+		return NULL;
+
+	kref_init(&link->kref);
+	kref_get(&link->kref); /* one reference per side */
+	for (side = 0; side < 2; side++) {
+		for (stream = DATA_STREAM; stream <= CONTROL_STREAM; stream++) {
+			struct dtl_ring *ring = &link->ring[side][stream];
+
+			spin_lock_init(&ring->lock);
+			init_waitqueue_head(&ring->wait);
+		}
+	}
+	return link;
+}
+
+static void dtl_destroy_link(struct kref *kref)
+{
+	kvfree(container_of(kref, struct dtl_link, kref));
+}
+
+/* Drop everything still queued, the peer sees the end of its streams */
+static void dtl_close_link(struct dtl_link *link)
+{
+	int side, stream;
+
+	for (side = 0; side < 2; side++) {
+		for (stream = DATA_STREAM; stream <= CONTROL_STREAM; stream++) {
+			struct dtl_ring *ring = &link->ring[side][stream];
+
+			spin_lock(&ring->lock);
+			link->closed = true;
+			while (ring->head != ring->tail) {
+				put_page(ring->chunk[ring->head % DTL_RING_SIZE].page);
+				ring->head++;
+			}
+			ring->consumed = 0;
+			ring->queued = 0;
+			spin_unlock(&ring->lock);
+			wake_up(&ring->wait);
+		}
+	}
+}
+
+static void dtl_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct dtl_link *link;
+	enum drbd_stream i;
+
+	mutex_lock(&dtl_connecting_mutex);
+	list_del_init(&loop_transport->connecting);
+	link = loop_transport->link;
+	loop_transport->link = NULL;
+	mutex_unlock(&dtl_connecting_mutex);
+
+	if (link) {
+		dtl_close_link(link);
+		kref_put(&link->kref, dtl_destroy_link);
+	}
+
+	if (loop_transport->path) {
+		loop_transport->path->established = false;
+		drbd_path_event(transport, loop_transport->path);
+		kref_put(&loop_transport->path->kref, drbd_destroy_path);
+		loop_transport->path = NULL;
+	}
+
+	if (free_op == DESTROY_TRANSPORT) {
+		struct drbd_path *drbd_path, *tmp;
+
+		for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
+			free_page((unsigned long)loop_transport->rbuf[i].base);
+			loop_transport->rbuf[i].base = NULL;
+		}
+		spin_lock(&loop_transport->paths_lock);
+		list_for_each_entry_safe(drbd_path, tmp, &transport->paths, list) {
+			list_del_init(&drbd_path->list);
+			kref_put(&drbd_path->kref, drbd_destroy_path);
+		}
+		spin_unlock(&loop_transport->paths_lock);
+	}
+}
+
+static bool dtl_addr_equal(const struct sockaddr_storage *addr1, int len1,
+			   const struct sockaddr_storage *addr2, int len2)
+{
+	return len1 == len2 && !memcmp(addr1, addr2, len1);
+}
+
+/* Find a path of @peer that is the mirror image of one of ours.
+ * Called with dtl_connecting_mutex held. */
+static bool dtl_match_paths(struct drbd_loop_transport *loop_transport,
+			    struct drbd_loop_transport *peer,
+			    struct drbd_path **ret_path, struct drbd_path **ret_peer_path)
+{
+	struct drbd_path *path, *peer_path;
+	bool found = false;
+
+	spin_lock(&loop_transport->paths_lock);
+	spin_lock_nested(&peer->paths_lock, SINGLE_DEPTH_NESTING);
+	list_for_each_entry(path, &loop_transport->transport.paths, list) {
+		list_for_each_entry(peer_path, &peer->transport.paths, list) {
+			if (dtl_addr_equal(&path->my_addr, path->my_addr_len,
+					   &peer_path->peer_addr, peer_path->peer_addr_len) &&
+			    dtl_addr_equal(&path->peer_addr, path->peer_addr_len,
+					   &peer_path->my_addr, peer_path->my_addr_len)) {
+				kref_get(&path->kref);
+				kref_get(&peer_path->kref);
+				*ret_path = path;
+				*ret_peer_path = peer_path;
+				found = true;
+				goto out;
+			}
+		}
+	}
+out:
+	spin_unlock(&peer->paths_lock);
+	spin_unlock(&loop_transport->paths_lock);
+	return found;
+}
+
+/* Called by each side for itself, once link, side and path are set */
+static void dtl_established(struct drbd_loop_transport *loop_transport)
+{
+	struct drbd_transport *transport = &loop_transport->transport;
+	struct drbd_path *path = loop_transport->path;
+	struct net_conf *nc;
+	enum drbd_stream i;
+
+	rcu_read_lock();
+	nc = rcu_dereference(transport->net_conf);
+	loop_transport->sndtimeo = nc ? nc->timeout * HZ / 10 : MAX_SCHEDULE_TIMEOUT;
+	rcu_read_unlock();
+
+	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++)
+		loop_transport->rbuf[i].pos = loop_transport->rbuf[i].base;
+	path->established = true;
+	drbd_path_event(transport, path);
+}
+
+/* The transport that comes second pairs up with the one that is waiting.
+ * Which side is which has no meaning, the DRBD handshake on top sorts out
+ * the roles.  */
+static int dtl_connect(struct drbd_transport *transport)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct drbd_loop_transport *peer;
+	struct drbd_path *path, *peer_path;
+	struct dtl_link *link;
+	struct net_conf *nc;
+	int connect_int;
+
+	if (list_empty(&transport->paths))
+		return -EDESTADDRREQ;
+
+	rcu_read_lock();
+	nc = rcu_dereference(transport->net_conf);
+	if (!nc) {
+		rcu_read_unlock();
+		return -EINVAL;
+	}
+	connect_int = nc->connect_int;
+	rcu_read_unlock();
+
+	link = dtl_alloc_link();
+	if (!link)
+		return -ENOMEM;
+
+	mutex_lock(&dtl_connecting_mutex);
+	list_for_each_entry(peer, &dtl_connecting, connecting) {
+		if (peer == loop_transport)
+			continue;
+		if (dtl_match_paths(loop_transport, peer, &path, &peer_path)) {
+			list_del_init(&peer->connecting);
+			peer->side = 1;
+			peer->path = peer_path;
+			peer->link = link;
+			loop_transport->side = 0;
+			loop_transport->path = path;
+			loop_transport->link = link;
+			mutex_unlock(&dtl_connecting_mutex);
+			wake_up(&peer->connect_wait);
+			dtl_established(loop_transport);
+			return 0;
+		}
+	}
+	list_add_tail(&loop_transport->connecting, &dtl_connecting);
+	mutex_unlock(&dtl_connecting_mutex);
+	kvfree(link);
+
+	wait_event_interruptible_timeout(loop_transport->connect_wait,
+					 READ_ONCE(loop_transport->link),
+					 connect_int * HZ);
+
+	/* the peer might have paired up with us just after the timeout */
+	mutex_lock(&dtl_connecting_mutex);
+	list_del_init(&loop_transport->connecting);
+	link = loop_transport->link;
+	mutex_unlock(&dtl_connecting_mutex);
+
+	if (!link)
+		return -EAGAIN;
+	dtl_established(loop_transport);
+	return 0;
+}
+
+static struct dtl_ring *dtl_ring(struct drbd_loop_transport *loop_transport, enum drbd_stream stream,
+				 bool rx)
+{
+	return &loop_transport->link->ring[loop_transport->side ^ rx][stream];
+}
+
+static bool dtl_readable(struct dtl_link *link, struct dtl_ring *ring)
+{
+	return READ_ONCE(ring->head) != READ_ONCE(ring->tail) || READ_ONCE(link->closed);
+}
+
+static bool dtl_writable(struct dtl_link *link, struct dtl_ring *ring)
+{
+	return READ_ONCE(ring->tail) - READ_ONCE(ring->head) < DTL_RING_SIZE ||
+		READ_ONCE(link->closed);
+}
+
+/* Like kernel_recvmsg() with MSG_WAITALL: returns less than @size only on
+ * a timeout, a signal or the end of the stream, or with MSG_DONTWAIT. */
+static int dtl_recv_short(struct drbd_loop_transport *loop_transport, enum drbd_stream stream,
+			  void *buf, size_t size, int flags)
+{
+	struct dtl_link *link = loop_transport->link;
+	struct dtl_ring *ring;
+	long timeo = loop_transport->rcvtimeo[stream];
+	size_t received = 0;
+	int rv = 0;
+
+	if (!link)
+		return -ENOTCONN;
+	ring = dtl_ring(loop_transport, stream, true);
+
+	while (received < size) {
+		struct dtl_chunk *chunk;
+		struct page *page;
+		unsigned int offset;
+		size_t len;
+		void *src;
+
+		spin_lock(&ring->lock);
+		if (ring->head == ring->tail) {
+			bool closed = link->closed;
+
+			spin_unlock(&ring->lock);
+			if (closed || (flags & MSG_DONTWAIT)) {
+				rv = closed ? 0 : -EAGAIN;
+				break;
+			}
+			timeo = wait_event_interruptible_timeout(ring->wait,
+								 dtl_readable(link, ring), timeo);
+			if (timeo <= 0) {
+				rv = timeo ? -EINTR : -EAGAIN;
+				break;
+			}
+			continue;
+		}
+		chunk = &ring->chunk[ring->head % DTL_RING_SIZE];
+		page = chunk->page;
+		offset = chunk->offset + ring->consumed;
+		len = min_t(size_t, size - received, chunk->size - ring->consumed);
+		get_page(page); /* dtl_close_link() might drop the ring's reference */
+		spin_unlock(&ring->lock);
+
+		src = kmap_atomic(page);
+		memcpy(buf + received, src + offset, len);
+		kunmap_atomic(src);
+		received += len;
+
+		spin_lock(&ring->lock);
+		if (!link->closed) {
+			ring->consumed += len;
+			ring->queued -= len;
+			if (ring->consumed == chunk->size) {
+				put_page(page);
+				ring->consumed = 0;
+				ring->head++;
+				wake_up(&ring->wait);
+			}
+		}
+		spin_unlock(&ring->lock);
+		put_page(page);
+	}
+
+	return received ?: rv;
+}
+
+static int dtl_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	void *buffer;
+	int rv;
+
+	if (flags & CALLER_BUFFER) {
+		buffer = *buf;
+		rv = dtl_recv_short(loop_transport, stream, buffer, size, flags & ~CALLER_BUFFER);
+	} else if (flags & GROW_BUFFER) {
+		TR_ASSERT(transport, *buf == loop_transport->rbuf[stream].base);
+		buffer = loop_transport->rbuf[stream].pos;
+		TR_ASSERT(transport, (buffer - *buf) + size <= PAGE_SIZE);
+
+		rv = dtl_recv_short(loop_transport, stream, buffer, size, flags & ~GROW_BUFFER);
+	} else {
+		buffer = loop_transport->rbuf[stream].base;
+
+		rv = dtl_recv_short(loop_transport, stream, buffer, size, flags);
+		if (rv > 0)
+			*buf = buffer;
+	}
+
+	if (rv > 0)
+		loop_transport->rbuf[stream].pos = buffer + rv;
+
+	return rv;
+}
+
+/* The pages of the peer request go back to drbd_pp_pool, so we cannot take
+ * over the sender's pages, we copy into ours. */
+static int dtl_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct page *page;
+	int err;
+
+	if (!loop_transport->link)
+		return -ENOTCONN;
+
+	drbd_alloc_page_chain(transport, chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
+	page = chain->head;
+	if (!page)
+		return -ENOMEM;
+
+	page_chain_for_each(page) {
+		size_t len = min_t(size_t, size, PAGE_SIZE);
+		void *data = kmap(page);
+
+		set_page_chain_offset(page, 0);
+		set_page_chain_size(page, len);
+		err = dtl_recv_short(loop_transport, DATA_STREAM, data, len, 0);
+		kunmap(page);
+		if (err != len) {
+			if (err >= 0)
+				err = -ECONNRESET;
+			goto fail;
+		}
+		size -= len;
+	}
+	return 0;
+fail:
+	drbd_free_page_chain(transport, chain, 0);
+	return err;
+}
+
+static void dtl_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	if (!loop_transport->link)
+		return;
+
+	stats->unread_received = READ_ONCE(dtl_ring(loop_transport, DATA_STREAM, true)->queued);
+	stats->unacked_send = READ_ONCE(dtl_ring(loop_transport, DATA_STREAM, false)->queued);
+	stats->send_buffer_size = DTL_RING_SIZE * PAGE_SIZE;
+	stats->send_buffer_used = stats->unacked_send;
+}
+
+static void dtl_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	loop_transport->rcvtimeo[stream] = timeout;
+}
+
+static long dtl_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	if (!loop_transport->link)
+		return -ENOTCONN;
+
+	return loop_transport->rcvtimeo[stream];
+}
+
+static bool dtl_stream_ok(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct dtl_link *link = loop_transport->link;
+
+	return link && !READ_ONCE(link->closed);
+}
+
+static void dtl_update_congested(struct drbd_loop_transport *loop_transport, struct dtl_ring *ring)
+{
+	if (ring->tail - ring->head > DTL_RING_SIZE * 4 / 5)
+		set_bit(NET_CONGESTED, &loop_transport->transport.flags);
+}
+
+static int __dtl_send_page(struct drbd_loop_transport *loop_transport, enum drbd_stream stream,
+			   struct page *page, int offset, size_t size)
+{
+	struct drbd_transport *transport = &loop_transport->transport;
+	struct dtl_link *link = loop_transport->link;
+	struct dtl_ring *ring = dtl_ring(loop_transport, stream, false);
+	struct dtl_chunk *chunk;
+	bool full;
+	long timeo;
+
+	if (!size)
+		return 0;
+
+	spin_lock(&ring->lock);
+	while (ring->tail - ring->head == DTL_RING_SIZE && !link->closed) {
+		spin_unlock(&ring->lock);
+		/* corked or not, the receiver has to make room */
+		wake_up(&ring->wait);
+		timeo = wait_event_interruptible_timeout(ring->wait, dtl_writable(link, ring),
+							 loop_transport->sndtimeo);
+		if (timeo < 0)
+			return -EINTR;
+		if (timeo == 0 && drbd_stream_send_timed_out(transport, stream))
+			return -EAGAIN;
+		spin_lock(&ring->lock);
+	}
+	if (link->closed) {
+		spin_unlock(&ring->lock);
+		return -ECONNRESET;
+	}
+	get_page(page);
+	chunk = &ring->chunk[ring->tail % DTL_RING_SIZE];
+	chunk->page = page;
+	chunk->offset = offset;
+	chunk->size = size;
+	ring->tail++;
+	ring->queued += size;
+	full = ring->tail - ring->head == DTL_RING_SIZE;
+	spin_unlock(&ring->lock);
+
+	if (!ring->corked || full)
+		wake_up(&ring->wait);
+
+	return 0;
+}
+
+static int dtl_send_page(struct drbd_transport *transport, enum drbd_stream stream,
+			 struct page *page, int offset, size_t size, unsigned msg_flags)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	int err;
+
+	if (!loop_transport->link)
+		return -ENOTCONN;
+
+	dtl_update_congested(loop_transport, dtl_ring(loop_transport, stream, false));
+	err = __dtl_send_page(loop_transport, stream, page, offset, size);
+	clear_bit(NET_CONGESTED, &transport->flags);
+
+	return err;
+}
+
+static int dtl_send_zc_bio(struct drbd_transport *transport, struct bio *bio)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	int err = 0;
+
+	if (!loop_transport->link)
+		return -ENOTCONN;
+
+	dtl_update_congested(loop_transport, dtl_ring(loop_transport, DATA_STREAM, false));
+	bio_for_each_segment(bvec, bio, iter) {
+		err = __dtl_send_page(loop_transport, DATA_STREAM, bvec.bv_page,
+				      bvec.bv_offset, bvec.bv_len);
+		if (err)
+			break;
+
+		/* WRITE_SAME has only one segment */
+		if (bio_op(bio) == REQ_OP_WRITE_SAME)
+			break;
+	}
+	clear_bit(NET_CONGESTED, &transport->flags);
+
+	return err;
+}
+
+/* CORK holds back the wakeups of the receiver until UNCORK, the counterpart
+ * of not pushing out partial frames.  It only delays them for a partly
+ * filled ring: the sender stays corked as long as it has work, so a full
+ * ring always wakes the receiver, see __dtl_send_page().  Nothing else
+ * applies to a ring. */
+static bool dtl_hint(struct drbd_transport *transport, enum drbd_stream stream,
+		enum drbd_tr_hints hint)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	struct dtl_ring *ring;
+
+	if (!loop_transport->link)
+		return false;
+
+	ring = dtl_ring(loop_transport, stream, false);
+	switch (hint) {
+	case CORK:
+		ring->corked = true;
+		break;
+	case UNCORK:
+		ring->corked = false;
+		wake_up(&ring->wait);
+		break;
+	default: /* not implemented, but should not trigger error handling */
+		return true;
+	}
+
+	return true;
+}
+
+static void dtl_debugfs_show(struct drbd_transport *transport, struct seq_file *m)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+	enum drbd_stream i;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	if (!loop_transport->link)
+		return;
+
+	seq_printf(m, "side: %d\n", loop_transport->side);
+	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
+		struct dtl_ring *tx = dtl_ring(loop_transport, i, false);
+		struct dtl_ring *rx = dtl_ring(loop_transport, i, true);
+
+		seq_printf(m, "%s stream\n", i == DATA_STREAM ? "data" : "control");
+		seq_printf(m, "unread receive ring: %u Byte in %u chunks\n",
+			   READ_ONCE(rx->queued), READ_ONCE(rx->tail) - READ_ONCE(rx->head));
+		seq_printf(m, "unread send ring: %u Byte in %u chunks\n",
+			   READ_ONCE(tx->queued), READ_ONCE(tx->tail) - READ_ONCE(tx->head));
+	}
+}
+
+static int dtl_add_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	drbd_path->established = false;
+
+	spin_lock(&loop_transport->paths_lock);
+	list_add_tail(&drbd_path->list, &transport->paths);
+	spin_unlock(&loop_transport->paths_lock);
+
+	return 0;
+}
+
+static int dtl_remove_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	struct drbd_loop_transport *loop_transport =
+		container_of(transport, struct drbd_loop_transport, transport);
+
+	if (drbd_path->established)
+		return -EBUSY;
+
+	spin_lock(&loop_transport->paths_lock);
+	list_del_init(&drbd_path->list);
+	spin_unlock(&loop_transport->paths_lock);
+
+	return 0;
+}
+
+static int __init dtl_initialize(void)
+{
+	return drbd_register_transport_class(&loop_transport_class,
+					     DRBD_TRANSPORT_API_VERSION,
+					     sizeof(struct drbd_transport));
+}
+
+static void __exit dtl_cleanup(void)
+{
+	drbd_unregister_transport_class(&loop_transport_class);
+}
+
+module_init(dtl_initialize)
+module_exit(dtl_cleanup)
@@ -38,12 +38,66 @@ struct buffer {
 
 #define DTT_CONNECTING 1
 
+/* With data_lanes > 1, the data stream is striped over that many sockets of
+ * the same path, to get past what a single TCP flow can do on fast links.
+ * With multipath, there are that many lanes on each of the configured paths.
+ * The byte stream is cut into frames, each frame goes to the lane that
+ * promises to deliver it first.  The header of a frame names the lane of the
+ * next one, so the receiver knows where to look for it.  If that lane dies
+ * before the next frame is sent, the frame goes to the first lane that is
+ * left, where the receiver looks for it once it finds the lane dead.  Frames
+ * are not retransmitted: if a lane dies with data the peer did not get, the
+ * connection fails and gets established anew, as without lanes. */
+#define DTT_LANES_MAX 8
+#define DTT_LANE_FRAME_MAX (64 << 10)
+
+/* Before a lane measured its delivery rate, assume 1 Gbit/s */
+#define DTT_LANE_RATE_GUESS (125 * 1000 * 1000)
+
+/* Keepalive probes of a lane, ping-int apart, before it counts as lost */
+#define DTT_LANE_KEEPCNT 3
+
+/* p_header80.length of the first packet of an additional data lane;
+ * the one of P_INITIAL_DATA and P_INITIAL_META carries the number of lanes,
+ * with more than one or-ed with DTT_LANE_HINTS.  Earlier versions framed
+ * without naming the next lane; they do not set it, and we refuse them
+ * rather than misread their frames. */
+#define DTT_LANE_SOCKET 0x100
+#define DTT_LANE_HINTS 0x200
+#define DTT_LANES_MASK 0xff
+
+static unsigned int dtt_data_lanes = 1;
+MODULE_PARM_DESC(data_lanes, "number of sockets the data stream of new connections is striped over (1-8)");
+module_param_named(data_lanes, dtt_data_lanes, uint, 0644);
+
+static bool dtt_multipath;
+MODULE_PARM_DESC(multipath, "put data lanes on all configured paths, not only on the one the connection got established on");
+module_param_named(multipath, dtt_multipath, bool, 0644);
+
+struct dtt_frame {
+	__be32 seq;
+	__be32 size;
+	__be32 next;	/* lane of frame seq + 1 */
+} __packed;
+
 struct drbd_tcp_transport {
 	struct drbd_transport transport; /* Must be first! */
 	spinlock_t paths_lock;
 	unsigned long flags;
 	struct socket *stream[2];
 	struct buffer rbuf[2];
+
+	/* additional data stream sockets, lane 0 is stream[DATA_STREAM] */
+	struct socket *lane[DTT_LANES_MAX];
+	unsigned int nr_lanes;
+	unsigned long lost_lanes;	/* we no longer send on these */
+	unsigned long rx_lost_lanes;	/* we found these dead when receiving */
+	u32 tx_frame;
+	unsigned int tx_lane;	/* of frame tx_frame */
+	u32 rx_frame;
+	unsigned int rx_lane;	/* of frame rx_frame */
+	unsigned int rx_next;	/* lane of frame rx_frame + 1 */
+	u32 rx_left;	/* of frame rx_frame */
 };
 
 struct dtt_listener {
@@ -158,6 +212,22 @@ static void dtt_nodelay(struct socket *socket)
 	(void) kernel_setsockopt(socket, SOL_TCP, TCP_NODELAY, (char *)&val, sizeof(val));
 }
 
+static struct socket *dtt_lane(struct drbd_tcp_transport *tcp_transport, unsigned int i)
+{
+	return i ? tcp_transport->lane[i] : tcp_transport->stream[DATA_STREAM];
+}
+
+#define for_each_lane(socket, i, tcp_transport)				\
+	for (i = 0; i < max(tcp_transport->nr_lanes, 1U); i++)		\
+		if ((socket = dtt_lane(tcp_transport, i)))
+
+static bool dtt_lane_ok(struct socket *socket)
+{
+	struct sock *sk = socket->sk;
+
+	return !sk->sk_err && sk->sk_state == TCP_ESTABLISHED;
+}
+
 static int dtt_init(struct drbd_transport *transport)
 {
 	struct drbd_tcp_transport *tcp_transport =
@@ -195,6 +265,7 @@ static void dtt_free(struct drbd_transport *transport, enum drbd_tr_free_op free
 	struct drbd_tcp_transport *tcp_transport =
 		container_of(transport, struct drbd_tcp_transport, transport);
 	enum drbd_stream i;
+	unsigned int lane;
 	struct drbd_path *drbd_path;
 	/* free the socket specific stuff,
 	 * mutexes are handled by caller */
@@ -205,6 +276,21 @@ static void dtt_free(struct drbd_transport *transport, enum drbd_tr_free_op free
 			tcp_transport->stream[i] = NULL;
 		}
 	}
+	for (lane = 1; lane < DTT_LANES_MAX; lane++) {
+		if (tcp_transport->lane[lane]) {
+			dtt_free_one_sock(tcp_transport->lane[lane]);
+			tcp_transport->lane[lane] = NULL;
+		}
+	}
+	tcp_transport->nr_lanes = 0;
+	tcp_transport->lost_lanes = 0;
+	tcp_transport->rx_lost_lanes = 0;
+	tcp_transport->tx_frame = 0;
+	tcp_transport->tx_lane = 0;
+	tcp_transport->rx_frame = 0;
+	tcp_transport->rx_lane = 0;
+	tcp_transport->rx_next = 0;
+	tcp_transport->rx_left = 0;
 
 	for_each_path_ref(drbd_path, transport) {
 		bool was_established = drbd_path->established;
@@ -252,8 +338,8 @@ static int _dtt_send(struct drbd_tcp_transport *tcp_transport, struct socket *so
 		if (rv == -EAGAIN) {
 			struct drbd_transport *transport = &tcp_transport->transport;
 			enum drbd_stream stream =
-				tcp_transport->stream[DATA_STREAM] == socket ?
-					DATA_STREAM : CONTROL_STREAM;
+				tcp_transport->stream[CONTROL_STREAM] == socket ?
+					CONTROL_STREAM : DATA_STREAM;
 
 			if (drbd_stream_send_timed_out(transport, stream))
 				break;
@@ -290,6 +376,107 @@ static int dtt_recv_short(struct socket *socket, void *buf, size_t size, int fla
 	return kernel_recvmsg(socket, &msg, &iov, 1, size, msg.msg_flags);
 }
 
+/* The lane we expect the next frame on is dead.  The sender sends it on the
+ * first lane it has left, see dtt_start_frame(); look there.  Returns false
+ * if the lane is alive after all, or if there is none left. */
+static bool dtt_rx_lane_lost(struct drbd_tcp_transport *tcp_transport, struct socket *socket)
+{
+	struct drbd_transport *transport = &tcp_transport->transport;
+	struct socket *csocket = tcp_transport->stream[CONTROL_STREAM];
+	unsigned int i;
+
+	if (dtt_lane_ok(socket))
+		return false;
+	/* not just a lane, the whole connection is going away */
+	if (!csocket || !dtt_lane_ok(csocket))
+		return false;
+	set_bit(tcp_transport->rx_lane, &tcp_transport->rx_lost_lanes);
+	for (i = 0; i < tcp_transport->nr_lanes; i++) {
+		if (!test_bit(i, &tcp_transport->rx_lost_lanes) && dtt_lane(tcp_transport, i))
+			break;
+	}
+	if (i == tcp_transport->nr_lanes)
+		return false;
+	tr_warn(transport, "Lost data lane %u (%d), expecting frame %u on lane %u\n",
+		tcp_transport->rx_lane, socket->sk->sk_err, tcp_transport->rx_frame, i);
+	tcp_transport->rx_lane = i;
+	return true;
+}
+
+/* Receive from the data lanes, frame by frame */
+static int dtt_recv_lanes(struct drbd_tcp_transport *tcp_transport, void *buf, size_t size, int flags)
+{
+	struct drbd_transport *transport = &tcp_transport->transport;
+	size_t received = 0;
+	int rv = 0;
+
+	while (received < size) {
+		struct socket *socket = dtt_lane(tcp_transport, tcp_transport->rx_lane);
+		size_t len;
+
+		if (!socket)
+			return -ENOTCONN;
+
+		if (!tcp_transport->rx_left) {
+			struct dtt_frame f;
+
+			/* do not consume a partial frame header */
+			if (flags & MSG_DONTWAIT) {
+				rv = dtt_recv_short(socket, &f, sizeof(f), flags | MSG_PEEK);
+				if (rv != sizeof(f)) {
+					if (rv <= 0 && dtt_rx_lane_lost(tcp_transport, socket))
+						continue;
+					if (rv > 0)
+						rv = -EAGAIN;
+					break;
+				}
+			}
+			rv = dtt_recv_short(socket, &f, sizeof(f), 0);
+			if (rv != sizeof(f)) {
+				/* nothing of the frame consumed, it may be elsewhere */
+				if (rv <= 0 && dtt_rx_lane_lost(tcp_transport, socket))
+					continue;
+				if (rv > 0)
+					rv = -EIO;
+				break;
+			}
+			if (be32_to_cpu(f.seq) != tcp_transport->rx_frame || !f.size ||
+			    be32_to_cpu(f.next) >= tcp_transport->nr_lanes) {
+				tr_err(transport, "Unexpected frame %u (%u bytes, next on %u), expected %u\n",
+				       be32_to_cpu(f.seq), be32_to_cpu(f.size), be32_to_cpu(f.next),
+				       tcp_transport->rx_frame);
+				return -EPROTO;
+			}
+			tcp_transport->rx_left = be32_to_cpu(f.size);
+			tcp_transport->rx_next = be32_to_cpu(f.next);
+		}
+
+		len = min_t(size_t, size - received, tcp_transport->rx_left);
+		rv = dtt_recv_short(socket, buf + received, len, flags);
+		if (rv <= 0)
+			break;
+		received += rv;
+		tcp_transport->rx_left -= rv;
+		if (!tcp_transport->rx_left) {
+			tcp_transport->rx_frame++;
+			tcp_transport->rx_lane = tcp_transport->rx_next;
+		}
+		if (rv < len)
+			break;
+	}
+
+	return received ?: rv;
+}
+
+static int dtt_recv_stream(struct drbd_tcp_transport *tcp_transport, enum drbd_stream stream,
+			   void *buf, size_t size, int flags)
+{
+	if (stream == DATA_STREAM && tcp_transport->nr_lanes > 1)
+		return dtt_recv_lanes(tcp_transport, buf, size, flags);
+
+	return dtt_recv_short(tcp_transport->stream[stream], buf, size, flags);
+}
+
 static int dtt_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags)
 {
 	struct drbd_tcp_transport *tcp_transport =
@@ -303,17 +490,17 @@ static int dtt_recv(struct drbd_transport *transport, enum drbd_stream stream, v
 
 	if (flags & CALLER_BUFFER) {
 		buffer = *buf;
-		rv = dtt_recv_short(socket, buffer, size, flags & ~CALLER_BUFFER);
+		rv = dtt_recv_stream(tcp_transport, stream, buffer, size, flags & ~CALLER_BUFFER);
 	} else if (flags & GROW_BUFFER) {
 		TR_ASSERT(transport, *buf == tcp_transport->rbuf[stream].base);
 		buffer = tcp_transport->rbuf[stream].pos;
 		TR_ASSERT(transport, (buffer - *buf) + size <= PAGE_SIZE);
 
-		rv = dtt_recv_short(socket, buffer, size, flags & ~GROW_BUFFER);
+		rv = dtt_recv_stream(tcp_transport, stream, buffer, size, flags & ~GROW_BUFFER);
 	} else {
 		buffer = tcp_transport->rbuf[stream].base;
 
-		rv = dtt_recv_short(socket, buffer, size, flags);
+		rv = dtt_recv_stream(tcp_transport, stream, buffer, size, flags);
 		if (rv > 0)
 			*buf = buffer;
 	}
@@ -324,11 +511,22 @@ static int dtt_recv(struct drbd_transport *transport, enum drbd_stream stream, v
 	return rv;
 }
 
+/* Number of pages we receive into with one call to sock_recvmsg() */
+#define DTT_RECV_BVECS 16
+
+/*
+ * We receive straight into the peer request's page chain, several pages per
+ * sock_recvmsg() call.  We cannot take over the page fragments of the skbs
+ * instead: page->private of our pages links the page chain, and the pages go
+ * back into drbd_pp_pool when freed, neither of which we may do to pages
+ * owned by the network driver.
+ */
 static int dtt_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size)
 {
 	struct drbd_tcp_transport *tcp_transport =
 		container_of(transport, struct drbd_tcp_transport, transport);
 	struct socket *socket = tcp_transport->stream[DATA_STREAM];
+	struct bio_vec bvec[DTT_RECV_BVECS];
 	struct page *page;
 	int err;
 
@@ -340,16 +538,54 @@ static int dtt_recv_pages(struct drbd_transport *transport, struct drbd_page_cha
 	if (!page)
 		return -ENOMEM;
 
-	page_chain_for_each(page) {
-		size_t len = min_t(int, size, PAGE_SIZE);
-		void *data = kmap(page);
-		err = dtt_recv_short(socket, data, len, 0);
-		kunmap(page);
-		set_page_chain_offset(page, 0);
-		set_page_chain_size(page, len);
+	if (tcp_transport->nr_lanes > 1) {
+		page_chain_for_each(page) {
+			size_t len = min_t(size_t, size, PAGE_SIZE);
+			void *data = kmap(page);
+
+			set_page_chain_offset(page, 0);
+			set_page_chain_size(page, len);
+			err = dtt_recv_lanes(tcp_transport, data, len, 0);
+			kunmap(page);
+			if (err != len) {
+				if (err >= 0)
+					err = -ECONNRESET;
+				goto fail;
+			}
+			size -= len;
+		}
+		return 0;
+	}
+
+	while (size) {
+		struct msghdr msg = {
+			.msg_flags = MSG_WAITALL | MSG_NOSIGNAL
+		};
+		size_t batch = 0;
+		unsigned int n = 0;
+
+		while (page && n < DTT_RECV_BVECS && batch < size) {
+			size_t len = min_t(size_t, size - batch, PAGE_SIZE);
+
+			set_page_chain_offset(page, 0);
+			set_page_chain_size(page, len);
+			bvec[n].bv_page = page;
+			bvec[n].bv_offset = 0;
+			bvec[n].bv_len = len;
+			batch += len;
+			n++;
+			page = page_chain_next(page);
+		}
+
+		iov_iter_bvec(&msg.msg_iter, READ, bvec, n, batch);
+		err = sock_recvmsg(socket, &msg, msg.msg_flags);
 		if (err < 0)
 			goto fail;
-		size -= len;
+		if (err != batch) {
+			err = -ECONNRESET;
+			goto fail;
+		}
+		size -= batch;
 	}
 	return 0;
 fail:
@@ -362,16 +598,22 @@ static void dtt_stats(struct drbd_transport *transport, struct drbd_transport_st
 	struct drbd_tcp_transport *tcp_transport =
 		container_of(transport, struct drbd_tcp_transport, transport);
 
-	struct socket *socket = tcp_transport->stream[DATA_STREAM];
-
-	if (socket) {
+	struct socket *socket;
+	unsigned int i;
+
+	/* summed up over the data lanes */
+	stats->unread_received = 0;
+	stats->unacked_send = 0;
+	stats->send_buffer_size = 0;
+	stats->send_buffer_used = 0;
+	for_each_lane(socket, i, tcp_transport) {
 		struct sock *sk = socket->sk;
 		struct tcp_sock *tp = tcp_sk(sk);
 
-		stats->unread_received = tp->rcv_nxt - tp->copied_seq;
-		stats->unacked_send = tp->write_seq - tp->snd_una;
-		stats->send_buffer_size = sk->sk_sndbuf;
-		stats->send_buffer_used = sk->sk_wmem_queued;
+		stats->unread_received += tp->rcv_nxt - tp->copied_seq;
+		stats->unacked_send += tp->write_seq - tp->snd_una;
+		stats->send_buffer_size += sk->sk_sndbuf;
+		stats->send_buffer_used += sk->sk_wmem_queued;
 	}
 }
 
@@ -489,7 +731,7 @@ out:
 }
 
 static int dtt_send_first_packet(struct drbd_tcp_transport *tcp_transport, struct socket *socket,
-			     enum drbd_packet cmd, enum drbd_stream stream)
+			     enum drbd_packet cmd, enum drbd_stream stream, u16 arg)
 {
 	struct p_header80 h;
 	int msg_flags = 0;
@@ -500,7 +742,7 @@ static int dtt_send_first_packet(struct drbd_tcp_transport *tcp_transport, struc
 
 	h.magic = cpu_to_be32(DRBD_MAGIC);
 	h.command = cpu_to_be16(cmd);
-	h.length = 0;
+	h.length = cpu_to_be16(arg);
 
 	err = _dtt_send(tcp_transport, socket, &h, sizeof(h), msg_flags);
 
@@ -630,6 +872,8 @@ retry:
 	if (timeo <= 0)
 		return -EAGAIN;
 
+	/* the connection may be waiting on the listener of another path */
+	listener = container_of(path->path.listener, struct dtt_listener, listener);
 	spin_lock_bh(&listener->listener.waiters_lock);
 	socket_c = list_first_entry_or_null(&path->sockets, struct dtt_socket_container, list);
 	if (socket_c) {
@@ -707,7 +951,8 @@ retry_locked:
 	goto retry;
 }
 
-static int dtt_receive_first_packet(struct drbd_tcp_transport *tcp_transport, struct socket *socket)
+static int dtt_receive_first_packet(struct drbd_tcp_transport *tcp_transport, struct socket *socket,
+				    unsigned int *arg)
 {
 	struct drbd_transport *transport = &tcp_transport->transport;
 	struct p_header80 *h = tcp_transport->rbuf[DATA_STREAM].base;
@@ -735,6 +980,7 @@ static int dtt_receive_first_packet(struct drbd_tcp_transport *tcp_transport, st
 			 be32_to_cpu(h->magic));
 		return -EINVAL;
 	}
+	*arg = be16_to_cpu(h->length);
 	return be16_to_cpu(h->command);
 }
 
@@ -865,6 +1111,146 @@ static void dtt_put_listeners(struct drbd_transport *transport)
 	}
 }
 
+/* An additional data lane the peer connected to us over @path, keep it if
+ * it fits */
+static void dtt_add_lane(struct drbd_transport *transport, struct socket *s, unsigned int arg,
+			 struct dtt_path *path, struct socket **lanes, struct dtt_path **lanes_from,
+			 unsigned int nr_lanes)
+{
+	unsigned int i = arg & ~DTT_LANE_SOCKET;
+
+	if (i == 0 || i >= nr_lanes || lanes[i]) {
+		tr_warn(transport, "Unexpected data lane %u\n", i);
+		dtt_socket_free(&s);
+		return;
+	}
+	lanes[i] = s;
+	lanes_from[i] = path;
+}
+
+/* The peer connected the lanes over the paths in its order, which has to be
+ * ours, see dtt_get_lane_paths() */
+static int dtt_check_lane_paths(struct drbd_transport *transport, struct dtt_path **lane_path,
+				struct dtt_path **lanes_from, unsigned int nr_lanes)
+{
+	unsigned int i;
+
+	for (i = 1; i < nr_lanes; i++) {
+		if (lanes_from[i] != lane_path[i]) {
+			tr_err(transport, "Data lane %u came in over another path than expected, "
+			       "are the paths configured in the same order on both nodes?\n", i);
+			return -EAGAIN;
+		}
+	}
+	return 0;
+}
+
+static void dtt_free_lanes(struct socket **lanes)
+{
+	unsigned int i;
+
+	for (i = 1; i < DTT_LANES_MAX; i++)
+		dtt_socket_free(&lanes[i]);
+}
+
+/* With multipath, lane i goes over the (i % n)th of the n paths, counting
+ * from the one the connection got established on, the others in the order
+ * they were configured in.  Both sides need the same order. */
+static void dtt_get_lane_paths(struct drbd_tcp_transport *tcp_transport, struct dtt_path *first,
+			       struct dtt_path **lane_path, unsigned int nr_lanes)
+{
+	struct drbd_transport *transport = &tcp_transport->transport;
+	struct dtt_path *paths[DTT_LANES_MAX];
+	struct drbd_path *drbd_path;
+	unsigned int n = 1, i;
+
+	paths[0] = first;
+	spin_lock(&tcp_transport->paths_lock);
+	if (dtt_multipath) {
+		list_for_each_entry(drbd_path, &transport->paths, list) {
+			struct dtt_path *path = container_of(drbd_path, struct dtt_path, path);
+
+			if (path != first && n < nr_lanes)
+				paths[n++] = path;
+		}
+	}
+	for (i = 0; i < nr_lanes; i++) {
+		lane_path[i] = paths[i % n];
+		kref_get(&lane_path[i]->path.kref);
+	}
+	spin_unlock(&tcp_transport->paths_lock);
+}
+
+static void dtt_put_lane_paths(struct dtt_path **lane_path, unsigned int nr_lanes)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_lanes; i++)
+		kref_put(&lane_path[i]->path.kref, drbd_destroy_path);
+}
+
+/* The side that connected the data socket connects the additional lanes */
+static int dtt_connect_lanes(struct drbd_tcp_transport *tcp_transport, struct dtt_path **lane_path,
+			     struct socket **lanes, unsigned int nr_lanes)
+{
+	struct drbd_transport *transport = &tcp_transport->transport;
+	unsigned int i;
+	int err;
+
+	for (i = 1; i < nr_lanes; i++) {
+		err = dtt_try_connect(transport, lane_path[i], &lanes[i]);
+		if (err < 0) {
+			tr_warn(transport, "Connecting data lane %u failed (%d), "
+				"does the peer use data_lanes=%u and multipath=%d?\n",
+				i, err, dtt_data_lanes, dtt_multipath);
+			return err;
+		}
+		err = dtt_send_first_packet(tcp_transport, lanes[i], P_INITIAL_DATA,
+					    DATA_STREAM, DTT_LANE_SOCKET | i);
+		if (err < 0)
+			return err;
+	}
+	return 0;
+}
+
+/* Lanes may come in over any of our paths, we wait on the one we expect */
+static int dtt_accept_lanes(struct drbd_tcp_transport *tcp_transport, struct dtt_path **lane_path,
+			    struct socket **lanes, struct dtt_path **lanes_from, unsigned int nr_lanes)
+{
+	struct drbd_transport *transport = &tcp_transport->transport;
+	unsigned int i, arg;
+	int err, fp;
+
+	for (i = 1; i < nr_lanes; i++) {
+		while (!lanes[i]) {
+			struct dtt_path *path2 = lane_path[i];
+			struct socket *s = NULL;
+
+			err = dtt_wait_for_connect(transport, lane_path[i]->path.listener, &s, &path2);
+			if (err < 0)
+				return err;
+			fp = dtt_receive_first_packet(tcp_transport, s, &arg);
+			if (fp != P_INITIAL_DATA || !(arg & DTT_LANE_SOCKET)) {
+				dtt_socket_free(&s);
+				continue;
+			}
+			dtt_add_lane(transport, s, arg, path2, lanes, lanes_from, nr_lanes);
+		}
+	}
+	return dtt_check_lane_paths(transport, lane_path, lanes_from, nr_lanes);
+}
+
+/* So that we notice the loss of an idle path within a few ping intervals,
+ * and not after the two hours TCP waits by default */
+static void dtt_lane_keepalive(struct socket *socket, int ping_int)
+{
+	int cnt = DTT_LANE_KEEPCNT;
+
+	kernel_setsockopt(socket, SOL_TCP, TCP_KEEPIDLE, (char *)&ping_int, sizeof(ping_int));
+	kernel_setsockopt(socket, SOL_TCP, TCP_KEEPINTVL, (char *)&ping_int, sizeof(ping_int));
+	kernel_setsockopt(socket, SOL_TCP, TCP_KEEPCNT, (char *)&cnt, sizeof(cnt));
+}
+
 static struct dtt_path *dtt_next_path(struct drbd_tcp_transport *tcp_transport, struct dtt_path *path)
 {
 	struct drbd_transport *transport = &tcp_transport->transport;
@@ -887,15 +1273,19 @@ static int dtt_connect(struct drbd_transport *transport)
 	struct drbd_path *drbd_path;
 	struct dtt_path *connect_to_path, *first_path = NULL;
 	struct socket *dsocket, *csocket;
+	struct socket *lanes[DTT_LANES_MAX] = { };
+	struct dtt_path *lanes_from[DTT_LANES_MAX] = { };
+	struct dtt_path *lane_path[DTT_LANES_MAX];
+	unsigned int nr_lanes, lanes_arg, nr_paths = 0, i;
+	bool dsocket_mine = false;
 	struct net_conf *nc;
-	int timeout, err;
+	int timeout, ping_int, err;
 	int one = 1;
 	bool ok;
 
 	dsocket = NULL;
 	csocket = NULL;
 
-
 	for_each_path_ref(drbd_path, transport) {
 		struct dtt_path *path = container_of(drbd_path, struct dtt_path, path);
 
@@ -928,6 +1318,13 @@ static int dtt_connect(struct drbd_transport *transport)
 		}
 	}
 
+	list_for_each_entry(drbd_path, &transport->paths, list)
+		nr_paths++;
+	nr_lanes = clamp_t(unsigned int, dtt_data_lanes, 1, DTT_LANES_MAX);
+	if (dtt_multipath)
+		nr_lanes = min_t(unsigned int, nr_lanes * nr_paths, DTT_LANES_MAX);
+	lanes_arg = nr_lanes > 1 ? nr_lanes | DTT_LANE_HINTS : nr_lanes;
+
 	drbd_path = list_first_entry(&transport->paths, struct drbd_path, list);
 	connect_to_path = container_of(drbd_path, struct dtt_path, path);
 	spin_unlock(&tcp_transport->paths_lock);
@@ -935,6 +1332,7 @@ static int dtt_connect(struct drbd_transport *transport)
 	ok = false;
 	do {
 		struct socket *s = NULL;
+		struct dtt_path *path;
 
 		err = dtt_try_connect(transport, connect_to_path, &s);
 		if (err < 0 && err != -EAGAIN)
@@ -947,6 +1345,7 @@ static int dtt_connect(struct drbd_transport *transport)
 				tr_info(transport, "initial paths crossed A - fail over\n");
 				dtt_socket_free(&dsocket);
 				dtt_socket_free(&csocket);
+				dtt_free_lanes(lanes);
 			}
 
 			first_path = connect_to_path;
@@ -965,11 +1364,14 @@ static int dtt_connect(struct drbd_transport *transport)
 
 			if (use_for_data) {
 				dsocket = s;
-				dtt_send_first_packet(tcp_transport, dsocket, P_INITIAL_DATA, DATA_STREAM);
+				dsocket_mine = true;
+				dtt_send_first_packet(tcp_transport, dsocket, P_INITIAL_DATA, DATA_STREAM,
+						      lanes_arg);
 			} else {
 				clear_bit(RESOLVE_CONFLICTS, &transport->flags);
 				csocket = s;
-				dtt_send_first_packet(tcp_transport, csocket, P_INITIAL_META, CONTROL_STREAM);
+				dtt_send_first_packet(tcp_transport, csocket, P_INITIAL_META, CONTROL_STREAM,
+						      lanes_arg);
 			}
 		} else if (!first_path)
 			connect_to_path = dtt_next_path(tcp_transport, connect_to_path);
@@ -979,17 +1381,42 @@ static int dtt_connect(struct drbd_transport *transport)
 
 retry:
 		s = NULL;
-		err = dtt_wait_for_connect(transport, connect_to_path->path.listener, &s, &connect_to_path);
+		path = connect_to_path;
+		err = dtt_wait_for_connect(transport, connect_to_path->path.listener, &s, &path);
 		if (err < 0 && err != -EAGAIN)
 			goto out;
 
 		if (s) {
-			int fp = dtt_receive_first_packet(tcp_transport, s);
+			unsigned int arg = 0;
+			int fp = dtt_receive_first_packet(tcp_transport, s, &arg);
+
+			if (fp == P_INITIAL_DATA && arg & DTT_LANE_SOCKET) {
+				/* the peer considers us connected already */
+				dtt_add_lane(transport, s, arg, path, lanes, lanes_from, nr_lanes);
+				goto check_established;
+			}
+			connect_to_path = path;
+			/* older versions send 0 */
+			if ((fp == P_INITIAL_DATA || fp == P_INITIAL_META) &&
+			    max(arg & DTT_LANES_MASK, 1U) != nr_lanes) {
+				tr_err(transport, "Peer uses %u data lanes, we use %u\n",
+				       max(arg & DTT_LANES_MASK, 1U), nr_lanes);
+				dtt_socket_free(&s);
+				goto out_eagain;
+			}
+			if ((fp == P_INITIAL_DATA || fp == P_INITIAL_META) &&
+			    (arg & ~DTT_LANES_MASK) != (lanes_arg & ~DTT_LANES_MASK)) {
+				tr_err(transport, "Peer frames the data lanes differently, "
+				       "update DRBD on both nodes\n");
+				dtt_socket_free(&s);
+				goto out_eagain;
+			}
 
 			if (first_path && first_path != connect_to_path) {
 				tr_info(transport, "initial paths crossed P - fail over\n");
 				dtt_socket_free(&dsocket);
 				dtt_socket_free(&csocket);
+				dtt_free_lanes(lanes);
 			}
 
 			first_path = connect_to_path;
@@ -998,11 +1425,13 @@ retry:
 			dtt_socket_ok_or_free(&csocket);
 			switch (fp) {
 			case P_INITIAL_DATA:
+				dsocket_mine = false;
 				if (dsocket) {
 					tr_warn(transport, "initial packet S crossed\n");
 					kernel_sock_shutdown(dsocket, SHUT_RDWR);
 					sock_release(dsocket);
 					dsocket = s;
+					dtt_free_lanes(lanes);
 					goto randomize;
 				}
 				dsocket = s;
@@ -1028,6 +1457,7 @@ randomize:
 			}
 		}
 
+check_established:
 		if (drbd_should_abort_listening(transport))
 			goto out_eagain;
 
@@ -1035,8 +1465,27 @@ randomize:
 	} while (!ok);
 
 	TR_ASSERT(transport, first_path == connect_to_path);
-	connect_to_path->path.established = true;
-	drbd_path_event(transport, &connect_to_path->path);
+
+	dtt_get_lane_paths(tcp_transport, connect_to_path, lane_path, nr_lanes);
+	if (nr_lanes > 1) {
+		err = dsocket_mine ?
+			dtt_connect_lanes(tcp_transport, lane_path, lanes, nr_lanes) :
+			dtt_accept_lanes(tcp_transport, lane_path, lanes, lanes_from, nr_lanes);
+		if (err < 0) {
+			dtt_put_lane_paths(lane_path, nr_lanes);
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nr_lanes; i++) {
+		struct drbd_path *lp = &lane_path[i]->path;
+
+		if (!lp->established) {
+			lp->established = true;
+			drbd_path_event(transport, lp);
+		}
+	}
+	dtt_put_lane_paths(lane_path, nr_lanes);
 	dtt_put_listeners(transport);
 
 	dsocket->sk->sk_reuse = SK_CAN_REUSE; /* SO_REUSEADDR */
@@ -1066,6 +1515,7 @@ randomize:
 	nc = rcu_dereference(transport->net_conf);
 
 	timeout = nc->timeout * HZ / 10;
+	ping_int = max_t(int, nc->ping_int, 1);
 	rcu_read_unlock();
 
 	dsocket->sk->sk_sndtimeo = timeout;
@@ -1074,6 +1524,25 @@ randomize:
 	err = kernel_setsockopt(dsocket, SOL_SOCKET, SO_KEEPALIVE, (char *)&one, sizeof(one));
 	if (err)
 		tr_warn(transport, "Failed to enable SO_KEEPALIVE %d\n", err);
+	if (nr_lanes > 1)
+		dtt_lane_keepalive(dsocket, ping_int);
+
+	for (i = 1; i < nr_lanes; i++) {
+		struct socket *socket = lanes[i];
+
+		socket->sk->sk_reuse = SK_CAN_REUSE;
+		socket->sk->sk_allocation = GFP_NOIO;
+		socket->sk->sk_priority = TC_PRIO_INTERACTIVE_BULK;
+		socket->sk->sk_sndtimeo = timeout;
+		dtt_nodelay(socket);
+		kernel_setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, (char *)&one, sizeof(one));
+		dtt_lane_keepalive(socket, ping_int);
+		tcp_transport->lane[i] = socket;
+	}
+	tcp_transport->nr_lanes = nr_lanes;
+	if (nr_lanes > 1)
+		tr_info(transport, "Data stream striped over %u sockets on %u paths\n", nr_lanes,
+			dtt_multipath ? min(nr_paths, nr_lanes) : 1);
 
 	return 0;
 
@@ -1091,6 +1560,7 @@ out:
 		kernel_sock_shutdown(csocket, SHUT_RDWR);
 		sock_release(csocket);
 	}
+	dtt_free_lanes(lanes);
 
 	return err;
 }
@@ -1100,11 +1570,16 @@ static void dtt_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream
 	struct drbd_tcp_transport *tcp_transport =
 		container_of(transport, struct drbd_tcp_transport, transport);
 	struct socket *socket = tcp_transport->stream[stream];
+	unsigned int i;
 
 	if (!socket)
 		return;
 
 	socket->sk->sk_rcvtimeo = timeout;
+	if (stream == DATA_STREAM) {
+		for_each_lane(socket, i, tcp_transport)
+			socket->sk->sk_rcvtimeo = timeout;
+	}
 }
 
 static long dtt_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream)
@@ -1128,35 +1603,159 @@ static bool dtt_stream_ok(struct drbd_transport *transport, enum drbd_stream str
 	return socket && socket->sk;
 }
 
+/* Congested only if none of the lanes we still send on has room */
 static void dtt_update_congested(struct drbd_tcp_transport *tcp_transport)
 {
-	struct socket *socket = tcp_transport->stream[DATA_STREAM];
-	struct sock *sock;
+	struct socket *socket;
+	unsigned int i;
 
-	if (!socket)
-		return;
+	for_each_lane(socket, i, tcp_transport) {
+		struct sock *sock = socket->sk;
 
-	sock = socket->sk;
-	if (sock->sk_wmem_queued > sock->sk_sndbuf * 4 / 5)
-		set_bit(NET_CONGESTED, &tcp_transport->transport.flags);
+		if (test_bit(i, &tcp_transport->lost_lanes))
+			continue;
+		if (sock->sk_wmem_queued <= sock->sk_sndbuf * 4 / 5)
+			return;
+	}
+	set_bit(NET_CONGESTED, &tcp_transport->transport.flags);
 }
 
-static int dtt_send_page(struct drbd_transport *transport, enum drbd_stream stream,
-			 struct page *page, int offset, size_t size, unsigned msg_flags)
+/* Estimated time in us until a frame queued on @socket now reaches the peer:
+ * half the smoothed RTT, plus what is queued ahead of it at the last measured
+ * delivery rate, or at one congestion window per RTT before there is one,
+ * or at DTT_LANE_RATE_GUESS before even that. */
+static u64 dtt_lane_cost(struct socket *socket)
+{
+	struct tcp_sock *tp = tcp_sk(socket->sk);
+	u64 rtt = tp->srtt_us >> 3;
+	u64 queued = tp->write_seq - tp->snd_una;
+	u64 rate = 0; /* bytes per second */
+
+	if (tp->rate_interval_us)
+		rate = div64_u64((u64)tp->rate_delivered * tp->mss_cache * USEC_PER_SEC,
+				 tp->rate_interval_us);
+	if (!rate && rtt)
+		rate = div64_u64((u64)tcp_snd_cwnd(tp) * tp->mss_cache * USEC_PER_SEC, rtt);
+	if (!rate)
+		rate = DTT_LANE_RATE_GUESS;
+
+	return rtt / 2 + div64_u64(queued * USEC_PER_SEC, rate);
+}
+
+/* Stop sending on lane @i, its socket went bad.  As long as the peer has
+ * everything we sent on it, the connection goes on over the remaining lanes.
+ * Returns false if it does not. */
+static bool dtt_drop_lane(struct drbd_tcp_transport *tcp_transport, unsigned int i)
+{
+	struct drbd_transport *transport = &tcp_transport->transport;
+	struct socket *socket = dtt_lane(tcp_transport, i);
+	struct tcp_sock *tp = tcp_sk(socket->sk);
+
+	set_bit(i, &tcp_transport->lost_lanes);
+	if (tp->snd_una != tp->write_seq) {
+		tr_err(transport, "Lost data lane %u (%d) with %u bytes not delivered\n",
+		       i, socket->sk->sk_err, tp->write_seq - tp->snd_una);
+		return false;
+	}
+	tr_warn(transport, "Lost data lane %u (%d), continuing on %u lanes\n",
+		i, socket->sk->sk_err,
+		tcp_transport->nr_lanes - hweight_long(tcp_transport->lost_lanes));
+	return true;
+}
+
+/* Choose the lane for the frame after the current one.  Ties are broken
+ * round robin, starting after the current lane.  Returns a negative error
+ * if there is no lane left, or if one died with data in flight. */
+static int dtt_pick_lane(struct drbd_tcp_transport *tcp_transport)
+{
+	unsigned int nr_lanes = tcp_transport->nr_lanes;
+	u64 best_cost = U64_MAX;
+	int best = -ENOTCONN;
+	unsigned int n;
+
+	for (n = 1; n <= nr_lanes; n++) {
+		unsigned int i = (tcp_transport->tx_lane + n) % nr_lanes;
+		struct socket *socket = dtt_lane(tcp_transport, i);
+		u64 cost;
+
+		if (!socket || test_bit(i, &tcp_transport->lost_lanes))
+			continue;
+		if (!dtt_lane_ok(socket)) {
+			if (!dtt_drop_lane(tcp_transport, i))
+				return -EIO;
+			continue;
+		}
+		cost = dtt_lane_cost(socket);
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = i;
+		}
+	}
+	return best;
+}
+
+/* The lane announced for this frame died: the first one left, which is
+ * where the receiver looks for the frame, see dtt_rx_lane_lost() */
+static int dtt_first_lane(struct drbd_tcp_transport *tcp_transport)
+{
+	unsigned int i;
+
+	for (i = 0; i < tcp_transport->nr_lanes; i++) {
+		struct socket *socket = dtt_lane(tcp_transport, i);
+
+		if (!socket || test_bit(i, &tcp_transport->lost_lanes))
+			continue;
+		if (dtt_lane_ok(socket))
+			return i;
+		if (!dtt_drop_lane(tcp_transport, i))
+			return -EIO;
+	}
+	return -ENOTCONN;
+}
+
+/* Start the next frame of @size bytes on the data stream, returns the lane
+ * socket its payload has to go to */
+static struct socket *dtt_start_frame(struct drbd_tcp_transport *tcp_transport, size_t size)
+{
+	u32 seq = tcp_transport->tx_frame++;
+	unsigned int lane = tcp_transport->tx_lane;
+	struct socket *socket = dtt_lane(tcp_transport, lane);
+	struct dtt_frame f = {
+		.seq = cpu_to_be32(seq),
+		.size = cpu_to_be32(size),
+	};
+	int next;
+
+	if (socket && !test_bit(lane, &tcp_transport->lost_lanes) &&
+	    !dtt_lane_ok(socket) && !dtt_drop_lane(tcp_transport, lane))
+		return NULL;
+	if (!socket || test_bit(lane, &tcp_transport->lost_lanes)) {
+		next = dtt_first_lane(tcp_transport);
+		if (next < 0)
+			return NULL;
+		tcp_transport->tx_lane = next;
+		socket = dtt_lane(tcp_transport, next);
+	}
+	next = dtt_pick_lane(tcp_transport);
+	if (next < 0)
+		return NULL;
+	tcp_transport->tx_lane = next;
+	f.next = cpu_to_be32(next);
+	if (_dtt_send(tcp_transport, socket, &f, sizeof(f), MSG_MORE) != sizeof(f))
+		return NULL;
+	return socket;
+}
+
+/* Caller does the dtt_update_congested() and set_fs() dance,
+ * so it can do that once for several pages. */
+static int __dtt_send_page(struct drbd_transport *transport, enum drbd_stream stream,
+			   struct socket *socket, struct page *page, int offset, size_t size,
+			   unsigned msg_flags)
 {
-	struct drbd_tcp_transport *tcp_transport =
-		container_of(transport, struct drbd_tcp_transport, transport);
-	struct socket *socket = tcp_transport->stream[stream];
-	mm_segment_t oldfs = get_fs();
 	int len = size;
 	int err = -EIO;
 
-	if (!socket)
-		return -ENOTCONN;
-
 	msg_flags |= MSG_NOSIGNAL;
-	dtt_update_congested(tcp_transport);
-	set_fs(KERNEL_DS);
 	do {
 		int sent;
 
@@ -1182,8 +1781,6 @@ static int dtt_send_page(struct drbd_transport *transport, enum drbd_stream stre
 		 * and add that to the while() condition below.
 		 */
 	} while (len > 0 /* THINK && peer_device->repl_state[NOW] >= L_ESTABLISHED */);
-	set_fs(oldfs);
-	clear_bit(NET_CONGESTED, &tcp_transport->transport.flags);
 
 	if (len == 0)
 		err = 0;
@@ -1191,24 +1788,120 @@ static int dtt_send_page(struct drbd_transport *transport, enum drbd_stream stre
 	return err;
 }
 
+static int dtt_send_page(struct drbd_transport *transport, enum drbd_stream stream,
+			 struct page *page, int offset, size_t size, unsigned msg_flags)
+{
+	struct drbd_tcp_transport *tcp_transport =
+		container_of(transport, struct drbd_tcp_transport, transport);
+	struct socket *socket = tcp_transport->stream[stream];
+	mm_segment_t oldfs = get_fs();
+	int err;
+
+	if (!socket)
+		return -ENOTCONN;
+
+	dtt_update_congested(tcp_transport);
+	set_fs(KERNEL_DS);
+	if (stream == DATA_STREAM && tcp_transport->nr_lanes > 1) {
+		/* The next frame goes to another socket, push this one out */
+		msg_flags &= ~MSG_MORE;
+		socket = dtt_start_frame(tcp_transport, size);
+	}
+	if (socket)
+		err = __dtt_send_page(transport, stream, socket, page, offset, size, msg_flags);
+	else
+		err = -EIO;
+	set_fs(oldfs);
+	clear_bit(NET_CONGESTED, &tcp_transport->transport.flags);
+
+	return err;
+}
+
+/* Stripe the bio over the data lanes, in frames of up to DTT_LANE_FRAME_MAX */
+static int dtt_send_zc_bio_lanes(struct drbd_tcp_transport *tcp_transport, struct bio *bio)
+{
+	struct drbd_transport *transport = &tcp_transport->transport;
+	unsigned int remaining = bio_op(bio) == REQ_OP_WRITE_SAME ?
+		bio_iovec(bio).bv_len : bio->bi_iter.bi_size;
+	unsigned int frame_left = 0;
+	struct socket *socket = NULL;
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	int err;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		unsigned int offset = bvec.bv_offset;
+		unsigned int len = bvec.bv_len;
+
+		while (len) {
+			unsigned int l;
+
+			if (!frame_left) {
+				frame_left = min_t(unsigned int, remaining, DTT_LANE_FRAME_MAX);
+				socket = dtt_start_frame(tcp_transport, frame_left);
+				if (!socket)
+					return -EIO;
+			}
+			l = min(len, frame_left);
+			frame_left -= l;
+			remaining -= l;
+			err = __dtt_send_page(transport, DATA_STREAM, socket, bvec.bv_page,
+					      offset, l,
+					      frame_left ? MSG_MORE | MSG_SENDPAGE_NOTLAST : 0);
+			if (err)
+				return err;
+			offset += l;
+			len -= l;
+		}
+
+		/* WRITE_SAME has only one segment */
+		if (bio_op(bio) == REQ_OP_WRITE_SAME)
+			break;
+	}
+	return 0;
+}
+
+/* Send all segments of the bio with one congestion update and one set_fs()
+ * switch.  All but the last segment are flagged MSG_SENDPAGE_NOTLAST, so TCP
+ * does not even try to push out a partial frame between them.  Partial sends
+ * are resumed within __dtt_send_page(). */
 static int dtt_send_zc_bio(struct drbd_transport *transport, struct bio *bio)
 {
+	struct drbd_tcp_transport *tcp_transport =
+		container_of(transport, struct drbd_tcp_transport, transport);
+	struct socket *socket = tcp_transport->stream[DATA_STREAM];
+	mm_segment_t oldfs = get_fs();
 	struct bio_vec bvec;
 	struct bvec_iter iter;
+	int err = 0;
 
+	if (!socket)
+		return -ENOTCONN;
+
+	dtt_update_congested(tcp_transport);
+	set_fs(KERNEL_DS);
+	if (tcp_transport->nr_lanes > 1) {
+		err = dtt_send_zc_bio_lanes(tcp_transport, bio);
+		goto out;
+	}
 	bio_for_each_segment(bvec, bio, iter) {
-		int err;
+		bool last = bio_iter_last(bvec, iter) || bio_op(bio) == REQ_OP_WRITE_SAME;
 
-		err = dtt_send_page(transport, DATA_STREAM, bvec.bv_page,
+		err = __dtt_send_page(transport, DATA_STREAM, socket, bvec.bv_page,
 				      bvec.bv_offset, bvec.bv_len,
-				      bio_iter_last(bvec, iter) ? 0 : MSG_MORE);
+				      last ? 0 : MSG_MORE | MSG_SENDPAGE_NOTLAST);
 		if (err)
-			return err;
+			break;
 
+		/* WRITE_SAME has only one segment */
 		if (bio_op(bio) == REQ_OP_WRITE_SAME)
 			break;
 	}
-	return 0;
+out:
+	set_fs(oldfs);
+	clear_bit(NET_CONGESTED, &tcp_transport->transport.flags);
+
+	return err;
 }
 
 static void dtt_cork(struct socket *socket)
@@ -1229,17 +1922,8 @@ static void dtt_quickack(struct socket *socket)
 	(void) kernel_setsockopt(socket, SOL_TCP, TCP_QUICKACK, (char *)&val, sizeof(val));
 }
 
-static bool dtt_hint(struct drbd_transport *transport, enum drbd_stream stream,
-		enum drbd_tr_hints hint)
+static bool dtt_hint_socket(struct socket *socket, enum drbd_tr_hints hint)
 {
-	struct drbd_tcp_transport *tcp_transport =
-		container_of(transport, struct drbd_tcp_transport, transport);
-	bool rv = true;
-	struct socket *socket = tcp_transport->stream[stream];
-
-	if (!socket)
-		return false;
-
 	switch (hint) {
 	case CORK:
 		dtt_cork(socket);
@@ -1261,7 +1945,27 @@ static bool dtt_hint(struct drbd_transport *transport, enum drbd_stream stream,
 		return true;
 	}
 
-	return rv;
+	return true;
+}
+
+static bool dtt_hint(struct drbd_transport *transport, enum drbd_stream stream,
+		enum drbd_tr_hints hint)
+{
+	struct drbd_tcp_transport *tcp_transport =
+		container_of(transport, struct drbd_tcp_transport, transport);
+	struct socket *socket = tcp_transport->stream[stream];
+	unsigned int i;
+
+	if (!socket)
+		return false;
+
+	if (stream == DATA_STREAM) {
+		for_each_lane(socket, i, tcp_transport)
+			dtt_hint_socket(socket, hint);
+		return true;
+	}
+
+	return dtt_hint_socket(socket, hint);
 }
 
 static void dtt_debugfs_show_stream(struct seq_file *m, struct socket *socket)
@@ -1281,13 +1985,15 @@ static void dtt_debugfs_show(struct drbd_transport *transport, struct seq_file *
 {
 	struct drbd_tcp_transport *tcp_transport =
 		container_of(transport, struct drbd_tcp_transport, transport);
+	struct socket *socket;
 	enum drbd_stream i;
+	unsigned int lane;
 
 	/* BUMP me if you change the file format/content/presentation */
-	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "v: %u\n\n", 2);
 
 	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
-		struct socket *socket = tcp_transport->stream[i];
+		socket = tcp_transport->stream[i];
 
 		if (socket) {
 			seq_printf(m, "%s stream\n", i == DATA_STREAM ? "data" : "control");
@@ -1295,6 +2001,18 @@ static void dtt_debugfs_show(struct drbd_transport *transport, struct seq_file *
 		}
 	}
 
+	seq_printf(m, "data lanes: %u\n", tcp_transport->nr_lanes);
+	for_each_lane(socket, lane, tcp_transport) {
+		if (lane) {
+			seq_printf(m, "data lane %u%s\n", lane,
+				   test_bit(lane, &tcp_transport->lost_lanes) ? " (lost)" : "");
+			dtt_debugfs_show_stream(m, socket);
+		}
+		if (tcp_transport->nr_lanes > 1)
+			seq_printf(m, "lane %u estimated delivery time: %llu us\n",
+				   lane, dtt_lane_cost(socket));
+	}
+
 }
 
 static int dtt_add_path(struct drbd_transport *transport, struct drbd_path *drbd_path)